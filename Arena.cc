@@ -0,0 +1,77 @@
+#include "Arena.h"
+
+#include <cstdlib>
+#include <cstring>
+
+namespace Attic {
+
+Arena::Arena() : Current(NULL), Remaining(0)
+{
+  std::memset(FreeLists, 0, sizeof(FreeLists));
+}
+
+Arena::~Arena()
+{
+  for (std::vector<char *>::iterator i = Slabs.begin();
+       i != Slabs.end();
+       i++)
+    std::free(*i);
+}
+
+void * Arena::Allocate(std::size_t size)
+{
+  if (size == 0)
+    size = 1;
+
+  std::size_t sizeClass = (size - 1) / ARENA_GRANULARITY;
+  if (sizeClass >= ARENA_CLASSES)
+    return ::operator new(size);
+
+  scoped_lock lock(ArenaMutex);
+
+  FreeBlock * block = FreeLists[sizeClass];
+  if (block) {
+    FreeLists[sizeClass] = block->Next;
+    return block;
+  }
+
+  std::size_t blockSize = (sizeClass + 1) * ARENA_GRANULARITY;
+  if (Remaining < blockSize) {
+    // Whatever is left of the current slab is simply abandoned; it
+    // is always smaller than the block being asked for.
+    void * slab;
+    if (posix_memalign(&slab, ARENA_SLAB_SIZE, ARENA_SLAB_SIZE) != 0)
+      throw std::bad_alloc();
+    Slabs.push_back(static_cast<char *>(slab));
+
+    // The first granule holds the back pointer used by Arena::Of.
+    *static_cast<Arena **>(slab) = this;
+    Current   = static_cast<char *>(slab) + ARENA_GRANULARITY;
+    Remaining = ARENA_SLAB_SIZE - ARENA_GRANULARITY;
+  }
+
+  void * ptr = Current;
+  Current   += blockSize;
+  Remaining -= blockSize;
+  return ptr;
+}
+
+void Arena::Deallocate(void * ptr, std::size_t size)
+{
+  if (size == 0)
+    size = 1;
+
+  std::size_t sizeClass = (size - 1) / ARENA_GRANULARITY;
+  if (sizeClass >= ARENA_CLASSES) {
+    ::operator delete(ptr);
+    return;
+  }
+
+  scoped_lock lock(ArenaMutex);
+
+  FreeBlock * block    = static_cast<FreeBlock *>(ptr);
+  block->Next	       = FreeLists[sizeClass];
+  FreeLists[sizeClass] = block;
+}
+
+} // namespace Attic
@@ -0,0 +1,123 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+namespace Attic {
+
+// An Arena hands out small blocks of memory carved from large slabs,
+// keeping a free list for each size class so that blocks can be
+// reused, and releases every slab at once when it is destroyed.  Each
+// Location keeps one for the FileInfo entries and directory maps of
+// its trees, which makes building a tree much cheaper than calling
+// the global operator new for every node, and makes tearing it down
+// nearly free.  Requests larger than the largest size class go
+// straight to the global heap.  An Arena may be shared by threads.
+//
+// Slabs are aligned on their own size, and each begins with a pointer
+// back to its Arena, so Arena::Of can tell which Arena a small block
+// came from without the block having to record it.
+
+#define ARENA_SLAB_SIZE	  (256 * 1024)
+#define ARENA_GRANULARITY 16
+#define ARENA_CLASSES	  32	// so, blocks of up to 512 bytes
+#define ARENA_MAX_BLOCK	  (ARENA_CLASSES * ARENA_GRANULARITY)
+
+class Arena
+{
+  struct FreeBlock {
+    FreeBlock * Next;
+  };
+
+  boost::mutex	      ArenaMutex;
+  std::vector<char *> Slabs;
+  char *	      Current;
+  std::size_t	      Remaining;
+  FreeBlock *	      FreeLists[ARENA_CLASSES];
+
+public:
+  typedef boost::mutex::scoped_lock scoped_lock;
+
+  Arena();
+  ~Arena();
+
+  void * Allocate(std::size_t size);
+  void	 Deallocate(void * ptr, std::size_t size);
+
+  // Only valid for blocks of at most ARENA_MAX_BLOCK bytes.
+  static Arena * Of(const void * ptr) {
+    std::size_t slab = (reinterpret_cast<std::size_t>(ptr) &
+			~std::size_t(ARENA_SLAB_SIZE - 1));
+    return *reinterpret_cast<Arena **>(slab);
+  }
+};
+
+// An STL allocator drawing from an Arena, or from the global heap if
+// it has none.
+
+template <typename T>
+class ArenaAllocator
+{
+public:
+  typedef T		   value_type;
+  typedef T *		   pointer;
+  typedef const T *	   const_pointer;
+  typedef T&		   reference;
+  typedef const T&	   const_reference;
+  typedef std::size_t	   size_type;
+  typedef std::ptrdiff_t   difference_type;
+
+  template <typename U>
+  struct rebind {
+    typedef ArenaAllocator<U> other;
+  };
+
+  Arena * Pool;
+
+  ArenaAllocator(Arena * _Pool = NULL) : Pool(_Pool) {}
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U>& other) : Pool(other.Pool) {}
+
+  pointer address(reference x) const { return &x; }
+  const_pointer address(const_reference x) const { return &x; }
+
+  pointer allocate(size_type n, const void * = 0) {
+    std::size_t size = n * sizeof(T);
+    return static_cast<pointer>(Pool ? Pool->Allocate(size) :
+				::operator new(size));
+  }
+  void deallocate(pointer p, size_type n) {
+    if (Pool)
+      Pool->Deallocate(p, n * sizeof(T));
+    else
+      ::operator delete(p);
+  }
+
+  size_type max_size() const {
+    return std::size_t(-1) / sizeof(T);
+  }
+
+  void construct(pointer p, const T& val) {
+    new (static_cast<void *>(p)) T(val);
+  }
+  void destroy(pointer p) {
+    p->~T();
+  }
+
+  template <typename U>
+  bool operator==(const ArenaAllocator<U>& other) const {
+    return Pool == other.Pool;
+  }
+  template <typename U>
+  bool operator!=(const ArenaAllocator<U>& other) const {
+    return Pool != other.Pool;
+  }
+};
+
+} // namespace Attic
+
+#endif // _ARENA_H
@@ -13,6 +13,7 @@ class Broker
 public:
   Location * Repository;
 
+  Broker() : Repository(NULL) {}
   virtual ~Broker() {}
 
   virtual void SetRepository(Location * _Repository) {
@@ -20,9 +21,29 @@ public:
   }
 
   virtual FileInfo * FindRoot() = 0;
+
+  // Called by whoever asked for a root once they are finished with
+  // it.  A broker which keeps its root for itself leaves it alone.
+  virtual void ReleaseRoot(FileInfo * root) {
+    delete root;
+  }
+
   virtual FileInfo * CreateFileInfo(const Path& path,
 				    FileInfo * parent = NULL) const = 0;
 
+  // False if entry's children were changed in memory since they were
+  // read, and so would not be read back the same if released.
+  virtual bool CanReleaseChildren(const FileInfo&) const {
+    return true;
+  }
+
+  // True if an entry's child can only be found by reading all of its
+  // children.  Otherwise a child not read yet is simply made when it
+  // is asked for, and its attributes looked up on their own.
+  virtual bool ListsToFindChild() const {
+    return true;
+  }
+
   virtual unsigned long long Length(const Path& path) const = 0;
 
   virtual bool Exists(const Path& path) const = 0;
@@ -34,7 +55,28 @@ public:
   virtual void SyncAttributes(const FileInfo& entry) = 0;
   virtual void CopyAttributes(const FileInfo& entry, const Path& dest) = 0;
 
-  virtual void ComputeChecksum(const Path& path, md5sum_t& csum) const = 0;
+  // False if the broker only knows the checksums it was given, as a
+  // database does, and cannot compute one for an entry without.
+  virtual bool ComputesChecksums() const {
+    return true;
+  }
+
+  // If chunks is given and algorithm is a tree algorithm, the digest
+  // of every chunk is appended to it.
+  virtual void ComputeChecksum(const Path& path,
+			       checksum_t::Algorithm algorithm,
+			       checksum_t& csum,
+			       std::vector<checksum_t> * chunks = NULL) const = 0;
+
+  // Compute the checksums of all the given entries, which a broker
+  // may be able to do more cheaply together than one at a time.
+  virtual void ReadChecksums(const FileInfoArray& entries,
+			     checksum_t::Algorithm algorithm) const {
+    for (FileInfoArray::const_iterator i = entries.begin();
+	 i != entries.end();
+	 i++)
+      (*i)->Checksum(algorithm);
+  }
 
   virtual void ReadDirectory(FileInfo& entry) const = 0;
   virtual void CreateDirectory(const Path& path) = 0;
@@ -43,6 +85,20 @@ public:
   virtual void Copy(const FileInfo& entry, const Path& dest) = 0;
   virtual void Move(FileInfo& entry, const Path& dest) = 0;
 
+  // Bring dest, which exists already, up to date with the contents of
+  // entry.  A broker which can do no better copies the whole file.
+  virtual void Update(const FileInfo& entry, FileInfo& dest) {
+    Copy(entry, dest.Pathname());
+  }
+
+  // Put every change applied through this broker so far in place, so
+  // that it can be read back, though Sync must still follow.
+  virtual void Flush() {}
+
+  // Make every change applied through this broker durable, finishing
+  // whatever work it has put off until now.
+  virtual void Sync() {}
+
   virtual Path GetSignature(const FileInfo& entry) const = 0;
   virtual Path CreateDelta(const FileInfo& entry, const Path& sigfile) = 0;
   virtual void ApplyDelta(const FileInfo& entry, const Path& delta) = 0;
@@ -51,7 +107,50 @@ public:
   virtual std::string Moniker(const FileInfo& entry) const = 0;
 };
 
-class DatabaseBroker : public Broker {};
+// Holds the root a broker finds for as long as it is in scope, and
+// then hands it back to the broker.  If the broker has no root, an
+// empty one stands in for it, and is freed here instead.
+class BrokerRoot
+{
+  Broker *   SiteBroker;
+  FileInfo * Entry;
+  bool	     StandIn;
+
+  BrokerRoot(const BrokerRoot&);
+  BrokerRoot& operator=(const BrokerRoot&);
+
+public:
+  explicit BrokerRoot(Broker * broker)
+    : SiteBroker(broker), Entry(broker->FindRoot()), StandIn(false) {
+    if (! Entry) {
+      Entry   = broker->CreateFileInfo("");
+      StandIn = true;
+    }
+  }
+  ~BrokerRoot() {
+    if (StandIn)
+      delete Entry;
+    else
+      SiteBroker->ReleaseRoot(Entry);
+  }
+
+  FileInfo * get() const {
+    return Entry;
+  }
+  FileInfo * operator->() const {
+    return Entry;
+  }
+};
+
+class StateChange;
+class DatabaseBroker : public Broker
+{
+public:
+  // A database holds no files, only the state of each entry, so a
+  // change applied to its Location is recorded rather than carried
+  // out.
+  virtual void RecordChange(const StateChange& change) = 0;
+};
 
 class Archive;
 class VolumeBroker : public Broker
@@ -78,11 +177,32 @@ public:
       CurrentPath(Path::Combine(VolumePath, RootPath)),
       ArchivalStore(NULL) {}
 
+  virtual bool ListsToFindChild() const {
+    return false;
+  }
+
   virtual Path FullPath(const Path& subpath) const {
     return Path::Combine(CurrentPath, subpath);
   }
+
+  // Append the path of entry on disk to buf, as FullPath would give
+  // it, but without making a string for each step along the way.
+  void AppendFullPath(const FileInfo& entry, std::string& buf) const {
+    std::size_t start = buf.length();
+    buf += CurrentPath;
+    std::size_t mark = buf.length();
+    if (mark > start && buf[mark - 1] != '/')
+      buf += '/';
+    std::size_t names = buf.length();
+    entry.AppendFullName(buf);
+    if (buf.length() == names)	// the root, which has no name
+      buf.resize(mark);
+  }
+
   virtual std::string Moniker(const FileInfo& entry) const {
-    return entry.Pathname;
+    std::string moniker;
+    AppendFullPath(entry, moniker);
+    return moniker;
   }
 };
 
@@ -1,22 +1,70 @@
 #include "ChangeSet.h"
 #include "FileInfo.h"
 #include "Location.h"
+#include "Scanner.h"
+#include "Snapshot.h"
 
 namespace Attic {
 
+ChangeSet::~ChangeSet()
+{
+  for (ChangesArray::iterator i = ChangeQueue.begin();
+       i != ChangeQueue.end();
+       i++)
+    delete *i;
+}
+
+static bool IsConflicting(const StateChange * change)
+{
+  return ! (change->ChangeKind == StateChange::UpdateAttrs &&
+	    change->Item->IsDirectory());
+}
+
 void ChangeSet::PostChange(StateChange::Kind kind,
 			   FileInfo * entry, FileInfo * ancestor)
 {
+  // Once posted, an entry belongs to the consumer, and the comparer
+  // must not change it again.  A directory's children are compared
+  // after it is posted, so they are read now, while it is still ours.
+  if (ChangeQueueLimit) {
+    entry->ReadAttributes();
+    if (entry->IsDirectory())
+      entry->ChildrenBegin();
+  }
+
   scoped_lock lock(ChangeQueueMutex);
 
+  while (ChangeQueueLimit && ! ChangeQueueAbandoned &&
+	 ChangeQueue.size() - ChangeQueueConsumed >= ChangeQueueLimit)
+    ChangeQueueSelector.wait(lock);
+
   StateChange * newChange = new StateChange(kind, entry, ancestor);
 
-  ChangesMap::iterator i = Changes.find(entry->FullName);
+  Path fullName(entry->FullName());
+
+  ChangesMap::iterator i = Changes.find(fullName);
   if (i == Changes.end()) {
     std::pair<ChangesMap::iterator, bool> result =
-      Changes.insert(ChangesPair(entry->FullName, newChange));
+      Changes.insert(ChangesPair(fullName, newChange));
     assert(result.second);
   } else {
+    // This path is in conflict the first time a second location
+    // posts a change to it.  A directory whose attributes change only
+    // because its contents did is not a conflict in itself.
+    if (IsConflicting(newChange)) {
+      Location * first	   = NULL;
+      bool	 conflicted = false;
+      for (StateChange * ptr = (*i).second; ptr; ptr = ptr->Next) {
+	if (! IsConflicting(ptr))
+	  continue;
+	if (first && ptr->Item->Repository != first)
+	  conflicted = true;
+	first = ptr->Item->Repository;
+      }
+      if (first && first != entry->Repository && ! conflicted)
+	Conflicts.push_back(fullName);
+    }
+
     newChange->Next = (*i).second;
     (*i).second	    = newChange;
   }
@@ -27,15 +75,54 @@ void ChangeSet::PostChange(StateChange::Kind kind,
   ChangeQueueSelector.notify_all();
 }
 
+StateChange * ChangeSet::NextChange(unsigned int& cursor)
+{
+  scoped_lock lock(ChangeQueueMutex);
+
+  // Everything before cursor has now been dealt with, which may make
+  // room for the poster.
+  if (cursor > ChangeQueueConsumed) {
+    ChangeQueueConsumed = cursor;
+    ChangeQueueSelector.notify_all();
+  }
+
+  while (cursor >= ChangeQueue.size() && ! ChangeQueueClosed)
+    ChangeQueueSelector.wait(lock);
+
+  if (cursor >= ChangeQueue.size())
+    return NULL;
+  return ChangeQueue[cursor++];
+}
+
+void ChangeSet::CloseQueue()
+{
+  scoped_lock lock(ChangeQueueMutex);
+  ChangeQueueClosed = true;
+  ChangeQueueSelector.notify_all();
+}
+
+void ChangeSet::AbandonQueue()
+{
+  // The consumer has given up, so nothing should wait on it
+  scoped_lock lock(ChangeQueueMutex);
+  ChangeQueueAbandoned = true;
+  ChangeQueueSelector.notify_all();
+}
+
 void ChangeSet::PostAddChange(FileInfo * entry)
 {
   if (entry->IsDirectory()) {
     PostChange(StateChange::Add, entry, NULL);
 
-    for (FileInfo::ChildrenMap::const_iterator i = entry->ChildrenBegin();
+    if (Shallow) {
+      Pending.push_back(PendingDirectory(entry, NULL));
+      return;
+    }
+
+    for (FileInfo::ChildrenArray::const_iterator i = entry->ChildrenBegin();
 	 i != entry->ChildrenEnd();
 	 i++)
-      PostAddChange((*i).second);
+      PostAddChange(*i);
   } else {
     PostChange(StateChange::Add, entry, NULL);
   }
@@ -47,30 +134,30 @@ void ChangeSet::PostRemoveChange(FileInfo *	    entryParent,
 {
   FileInfo * missingChild =
     entryParent->Repository->SiteBroker->CreateFileInfo
-      (Path::Combine(entryParent->FullName, childName), entryParent);
+      (Path::Combine(entryParent->FullName(), childName), entryParent);
+
+  if (Shallow && ancestorChild->IsDirectory()) {
+    Pending.push_back(PendingDirectory(missingChild, ancestorChild));
+    Pending.back().Removed = true;
+    return;
+  }
 
   if (ancestorChild->IsDirectory())
-    for (FileInfo::ChildrenMap::const_iterator
+    for (FileInfo::ChildrenArray::const_iterator
 	   i = ancestorChild->ChildrenBegin();
 	 i != ancestorChild->ChildrenEnd();
 	 i++)
-      PostRemoveChange(missingChild, (*i).first, (*i).second);
+      PostRemoveChange(missingChild, (*i)->Name(), *i);
 
   PostChange(StateChange::Remove, missingChild, ancestorChild);
 }
 
-void ChangeSet::CompareFiles(FileInfo * entry, FileInfo * ancestor)
+bool ChangeSet::CompareEntry(FileInfo * entry, FileInfo * ancestor,
+			     bool& updateAttrs)
 {
-  assert(entry->Repository);
-
-  if (! ancestor) {
-    PostAddChange(entry);
-    return;
-  }
-
-  if (! entry->IsVirtual() && entry->Name != ancestor->Name)
+  if (! entry->IsVirtual() && entry->NameId() != ancestor->NameId())
     throw Exception("Names do not match in comparison: " +
-		    entry->FullName + " != " + ancestor->Name);
+		    entry->FullName() + " != " + ancestor->Name());
 
   bool updateRegistered = false;
 
@@ -80,6 +167,8 @@ void ChangeSet::CompareFiles(FileInfo * entry, FileInfo * ancestor)
   }
   else if (entry->Exists()) {
     if (entry->IsRegularFile()) {
+      // Without a checksum for the ancestor, the same length and time
+      // are all there is to go on.
       if (entry->Length() != ancestor->Length()) {
 	PostUpdateChange(entry, ancestor);
 	updateRegistered = true;
@@ -87,50 +176,193 @@ void ChangeSet::CompareFiles(FileInfo * entry, FileInfo * ancestor)
       else if (! entry->Repository->TrustLengthOnly &&
 	       (entry->LastWriteTime() != ancestor->LastWriteTime() ||
 		(entry->Repository->UseChecksums &&
-		 entry->Checksum() != ancestor->Checksum()))) {
+		 ancestor->ChecksumKnown() &&
+		 ! entry->SameChecksum(*ancestor)))) {
 	PostUpdateChange(entry, ancestor);
 	updateRegistered = true;
       }
     }
 
     if (! updateRegistered && ! entry->CompareAttributes(*ancestor)) {
-      PostUpdateAttrsChange(entry, ancestor);
+      if (Shallow && entry->IsDirectory())
+	updateAttrs = true;	// posted by FinishDirectory
+      else
+	PostUpdateAttrsChange(entry, ancestor);
       updateRegistered = true;
     }
   }
 
-  if (! entry->IsDirectory())
+  return updateRegistered;
+}
+
+void ChangeSet::ReadChecksums(FileInfo * entry, FileInfo * ancestor)
+{
+  Location * repository = entry->Repository;
+  if (! repository->UseChecksums || repository->TrustLengthOnly)
     return;
 
-  bool updateAttrs = false;
+  // CompareEntry only looks at the checksums of files whose length
+  // and time are the same as their ancestor's, so those are the ones
+  // read here, all together, before the children are compared.  The
+  // ancestors' come first, since each file is checksummed by the same
+  // algorithm as its ancestor was.
+  typedef std::map<checksum_t::Algorithm, FileInfoArray> BatchMap;
 
-  for (FileInfo::ChildrenMap::iterator i = entry->ChildrenBegin();
-       i != entry->ChildrenEnd();
-       i++) {
-    FileInfo * ancestorChild = ancestor->FindChild((*i).first);
-    if (ancestorChild != NULL) {
-      ancestorChild->SetFlags(FILEINFO_HANDLED);
-      CompareFiles((*i).second, ancestorChild);
-    } else {
-      PostAddChange((*i).second);
-      updateAttrs = true;
+  FileInfoArray entryFiles;
+  FileInfoArray ancestorFiles;
+  BatchMap	ancestorsUnread;
+
+  FileInfo::ChildrenArray::iterator i	 = entry->ChildrenBegin();
+  FileInfo::ChildrenArray::iterator iend = entry->ChildrenEnd();
+  FileInfo::ChildrenArray::iterator j	 = ancestor->ChildrenBegin();
+  FileInfo::ChildrenArray::iterator jend = ancestor->ChildrenEnd();
+
+  while (i != iend && j != jend) {
+    int order = (*i)->CompareName(**j);
+    if (order < 0) {
+      i++;
+    }
+    else if (order > 0) {
+      j++;
+    }
+    else {
+      FileInfo * child	       = *i++;
+      FileInfo * ancestorChild = *j++;
+
+      if (! child->IsRegularFile() || ! ancestorChild->IsRegularFile() ||
+	  ! child->Exists() || ! ancestorChild->Exists() ||
+	  child->Length() != ancestorChild->Length() ||
+	  child->LastWriteTime() != ancestorChild->LastWriteTime() ||
+	  ! ancestorChild->ChecksumKnown())
+	continue;
+
+      entryFiles.push_back(child);
+      ancestorFiles.push_back(ancestorChild);
+      if (! ancestorChild->HasFlags(FILEINFO_READCSUM))
+	ancestorsUnread[ancestor->Repository->ChecksumAlgorithmFor
+			(ancestorChild->Length())].push_back(ancestorChild);
     }
   }
 
-  for (FileInfo::ChildrenMap::iterator i = ancestor->ChildrenBegin();
-       i != ancestor->ChildrenEnd();
-       i++) {
-    if ((*i).second->HasFlags(FILEINFO_HANDLED)) {
-      (*i).second->ClearFlags(FILEINFO_HANDLED);
+  for (BatchMap::iterator i = ancestorsUnread.begin();
+       i != ancestorsUnread.end();
+       i++)
+    if ((*i).second.size() > 1)
+      ancestor->Repository->SiteBroker->ReadChecksums((*i).second,
+						      (*i).first);
+
+  // An ancestor's checksum may still be on its way, from a service
+  // reading ahead, so the algorithm it will have is worked out rather
+  // than waited for.
+  BatchMap batches;
+  for (FileInfoArray::size_type k = 0; k < entryFiles.size(); k++) {
+    FileInfo * ancestorChild = ancestorFiles[k];
+    checksum_t::Algorithm algorithm =
+      ancestorChild->HasFlags(FILEINFO_READCSUM) ?
+      ancestorChild->Checksum().Kind() :
+      ancestor->Repository->ChecksumAlgorithmFor(ancestorChild->Length());
+    if (! entryFiles[k]->HasFlags(FILEINFO_READCSUM) ||
+	entryFiles[k]->Checksum().Kind() != algorithm)
+      batches[algorithm].push_back(entryFiles[k]);
+  }
+
+  for (BatchMap::iterator i = batches.begin(); i != batches.end(); i++)
+    if ((*i).second.size() > 1)
+      repository->SiteBroker->ReadChecksums((*i).second, (*i).first);
+}
+
+void ChangeSet::CompareFiles(FileInfo * entry, FileInfo * ancestor)
+{
+  assert(entry->Repository);
+
+  if (! ancestor) {
+    PostAddChange(entry);
+    return;
+  }
+
+  bool updateAttrs	= false;
+  bool updateRegistered = CompareEntry(entry, ancestor, updateAttrs);
+
+  if (! entry->IsDirectory())
+    return;
+
+  if (Shallow) {
+    Pending.push_back(PendingDirectory(entry, ancestor));
+    Pending.back().UpdateRegistered = updateRegistered;
+    Pending.back().UpdateAttrs	    = updateAttrs;
+    return;
+  }
+
+  if (CompareChildren(entry, ancestor) && ! updateRegistered)
+    PostUpdateAttrsChange(entry, ancestor);
+}
+
+bool ChangeSet::CompareChildren(FileInfo * entry, FileInfo * ancestor)
+{
+  bool updateAttrs = false;
+
+  // Both sets of children are sorted by name, so they are walked
+  // together as in a merge: each child is paired with its ancestor,
+  // or found to be new or gone, without looking anything up and
+  // without marking the ancestor tree.  Removals are posted after the
+  // walk, because each one adds a placeholder to entry's children.
+  FileInfoArray removed;
+
+  ReadChecksums(entry, ancestor);
+
+  FileInfo::ChildrenArray::iterator i	 = entry->ChildrenBegin();
+  FileInfo::ChildrenArray::iterator iend = entry->ChildrenEnd();
+  FileInfo::ChildrenArray::iterator j	 = ancestor->ChildrenBegin();
+  FileInfo::ChildrenArray::iterator jend = ancestor->ChildrenEnd();
+
+  while (i != iend || j != jend) {
+    int order = (i == iend ? 1 : (j == jend ? -1 : (*i)->CompareName(**j)));
+    if (order < 0) {
+      PostAddChange(*i++);
+      updateAttrs = true;
     }
-    else if (entry->FindChild((*i).first) == NULL) {
-      PostRemoveChange(entry, (*i).first, (*i).second);
+    else if (order > 0) {
+      removed.push_back(*j++);
       updateAttrs = true;
     }
+    else {
+      CompareFiles(*i++, *j++);
+    }
   }
 
-  if (updateAttrs && ! updateRegistered)
-    PostUpdateAttrsChange(entry, ancestor);
+  for (FileInfoArray::iterator k = removed.begin(); k != removed.end(); k++)
+    PostRemoveChange(entry, (*k)->Name(), *k);
+
+  return updateAttrs;
+}
+
+void ChangeSet::CompareChildren(PendingDirectory& dir)
+{
+  if (dir.Removed) {
+    for (FileInfo::ChildrenArray::const_iterator
+	   i = dir.Ancestor->ChildrenBegin();
+	 i != dir.Ancestor->ChildrenEnd();
+	 i++)
+      PostRemoveChange(dir.Entry, (*i)->Name(), *i);
+  }
+  else if (! dir.Ancestor) {
+    for (FileInfo::ChildrenArray::const_iterator i = dir.Entry->ChildrenBegin();
+	 i != dir.Entry->ChildrenEnd();
+	 i++)
+      PostAddChange(*i);
+  }
+  else if (CompareChildren(dir.Entry, dir.Ancestor) &&
+	   ! dir.UpdateRegistered) {
+    dir.UpdateAttrs = true;
+  }
+}
+
+void ChangeSet::FinishDirectory(const PendingDirectory& dir)
+{
+  if (dir.Removed)
+    PostChange(StateChange::Remove, dir.Entry, dir.Ancestor);
+  else if (dir.UpdateAttrs)
+    PostUpdateAttrsChange(dir.Entry, dir.Ancestor);
 }
 
 bool ChangeSet::ChangeComparer::operator()
@@ -151,15 +383,278 @@ bool ChangeSet::ChangeComparer::operator()
     return true;
 
   if (left->ChangeKind == StateChange::Remove)
-    return right->Item->FullName < left->Item->FullName;
+    return right->Item->FullName() < left->Item->FullName();
   else
-    return left->Item->FullName < right->Item->FullName;
+    return left->Item->FullName() < right->Item->FullName();
 }
 
 void ChangeSet::CompareLocations(const Location * origin,
 				 const Location * ancestor)
 {
-  CompareFiles(origin->Root(), ancestor ? ancestor->Root() : NULL);
+  FileInfo * originRoot	  = origin->Root();
+  FileInfo * ancestorRoot = ancestor ? ancestor->Root() : NULL;
+
+  if (origin->ScanEngine && originRoot)
+    origin->ScanEngine->Start(originRoot);
+  if (ancestor && ancestor->ScanEngine && ancestorRoot)
+    ancestor->ScanEngine->Start(ancestorRoot);
+
+  CompareFiles(originRoot, ancestorRoot);
+}
+
+void ChangeSet::CompareLocations(const std::vector<Location *>& origins,
+				 const Location * ancestor)
+{
+  FileInfoArray roots;
+  bool		snapshots = ! Shallow;
+  for (std::vector<Location *>::const_iterator i = origins.begin();
+       i != origins.end();
+       i++) {
+    FileInfo * root = (*i)->Root();
+    if ((*i)->ScanEngine && root)
+      (*i)->ScanEngine->Start(root);
+    roots.push_back(root);
+
+    // A snapshot has only the kind, length and time of each entry, so
+    // it cannot be used where checksums or attributes are compared.
+    if (! (*i)->UseSnapshots || (*i)->UseChecksums ||
+	(*i)->PreservePermissions || (*i)->PreserveOwnership ||
+	(*i)->PreserveGroup)
+      snapshots = false;
+  }
+
+  FileInfo * ancestorRoot = ancestor ? ancestor->Root() : NULL;
+  if (ancestor && ancestor->ScanEngine && ancestorRoot)
+    ancestor->ScanEngine->Start(ancestorRoot);
+
+  if (! snapshots || ! ancestorRoot) {
+    CompareFiles(roots, ancestorRoot);
+    return;
+  }
+
+  // The ancestor's snapshot is taken once, and each location's is
+  // compared against it in turn.
+  Snapshot ancestorSnapshot(ancestorRoot);
+  for (FileInfoArray::iterator i = roots.begin(); i != roots.end(); i++)
+    if (*i)
+      CompareSnapshots(Snapshot(*i), ancestorSnapshot);
+}
+
+void ChangeSet::CompareSnapshots(const Snapshot& entries,
+				 const Snapshot& ancestors)
+{
+  typedef Snapshot::size_type size_type;
+
+  size_type count	  = entries.size();
+  size_type ancestorCount = ancestors.size();
+  if (count == 0 || ancestorCount == 0)
+    return;
+
+  bool lengthOnly = entries.Entries[0]->Repository->TrustLengthOnly;
+
+  // For each directory in entries whose children were added or
+  // removed, the ancestor it was compared with; and whether a change
+  // has already been posted for each entry.
+  FileInfoArray	    changed(count);
+  std::vector<bool> registered(count);
+
+  size_type i = 0, j = 0;
+  while (i < count || j < ancestorCount) {
+    if (i < count && j < ancestorCount) {
+      size_type run = entries.MatchingRun(i, ancestors, j,
+					  std::min(count - i,
+						   ancestorCount - j),
+					  lengthOnly);
+      i += run;
+      j += run;
+      if (run > 0)
+	continue;
+    }
+
+    // The roots are always compared with each other, so from here on
+    // both i and j are past them.
+    int order = (i == count ? 1 : (j == ancestorCount ? -1 :
+				   entries.ComparePaths(i, ancestors, j)));
+    if (order < 0) {
+      unsigned int depth = entries.Depth(i);
+      changed[entries.Parents[i]] =
+	ancestors.Entries[ancestors.AncestorAt(j - 1, depth - 1)];
+
+      PostAddChange(entries.Entries[i]);
+      i = entries.SubtreeEnd(i);
+    }
+    else if (order > 0) {
+      unsigned int depth  = ancestors.Depth(j);
+      size_type	   parent = entries.AncestorAt(i - 1, depth - 1);
+      changed[parent] = ancestors.Entries[ancestors.Parents[j]];
+
+      FileInfo * ancestor = ancestors.Entries[j];
+      PostRemoveChange(entries.Entries[parent], ancestor->Name(), ancestor);
+      j = ancestors.SubtreeEnd(j);
+    }
+    else {
+      FileInfo * entry	  = entries.Entries[i];
+      FileInfo * ancestor = ancestors.Entries[j];
+
+      if (entries.Kinds[i] != ancestors.Kinds[j]) {
+	PostUpdateChange(entry, ancestor);
+	registered[i] = true;
+
+	// As in CompareFiles, nothing below a directory that has been
+	// replaced by something else is compared; everything below
+	// one that replaced something else is new.
+	if (ancestors.Kinds[j] == FileInfo::Directory) {
+	  i++;
+	  j = ancestors.SubtreeEnd(j);
+	  continue;
+	}
+      }
+      else if (entries.Kinds[i] == FileInfo::RegularFile) {
+	if (entries.Lengths[i] != ancestors.Lengths[j] ||
+	    (! lengthOnly && entries.Times[i] != ancestors.Times[j])) {
+	  PostUpdateChange(entry, ancestor);
+	  registered[i] = true;
+	}
+      }
+      else if (! entry->CompareAttributes(*ancestor)) {
+	PostUpdateAttrsChange(entry, ancestor);
+	registered[i] = true;
+      }
+      i++;
+      j++;
+    }
+  }
+
+  // Directories come after their contents, as in CompareFiles.
+  for (size_type k = count; k-- > 0; )
+    if (changed[k] && ! registered[k])
+      PostUpdateAttrsChange(entries.Entries[k], changed[k]);
+}
+
+void ChangeSet::CompareFiles(const FileInfoArray& entries,
+			     FileInfo * ancestor)
+{
+  // Streaming compares one location at a time; see DataPool.
+  assert(! Shallow);
+
+  if (! ancestor) {
+    for (FileInfoArray::const_iterator i = entries.begin();
+	 i != entries.end();
+	 i++)
+      if (*i)
+	PostAddChange(*i);
+    return;
+  }
+
+  FileInfoArray	    directories(entries.size());
+  std::vector<bool> registered(entries.size());
+  bool		    anyDirectories = false;
+
+  for (FileInfoArray::size_type k = 0; k < entries.size(); k++) {
+    if (! entries[k])
+      continue;
+
+    bool updateAttrs = false;
+    registered[k] = CompareEntry(entries[k], ancestor, updateAttrs);
+
+    if (entries[k]->IsDirectory()) {
+      directories[k] = entries[k];
+      anyDirectories = true;
+    }
+  }
+
+  if (! anyDirectories)
+    return;
+
+  // If the ancestor is not a directory, an Update has been posted for
+  // each directory which replaced it, and everything within them is
+  // new.
+  std::vector<bool> changed;
+  CompareChildren(directories, ancestor->IsDirectory() ? ancestor : NULL,
+		  changed);
+
+  for (FileInfoArray::size_type k = 0; k < directories.size(); k++)
+    if (directories[k] && changed[k] && ! registered[k])
+      PostUpdateAttrsChange(directories[k], ancestor);
+}
+
+void ChangeSet::CompareChildren(const FileInfoArray& entries,
+				FileInfo * ancestor,
+				std::vector<bool>& changed)
+{
+  typedef FileInfo::ChildrenArray::iterator iterator;
+
+  // As in the two-way CompareChildren, every list of children is
+  // sorted by name, so they can all be merged together.  Slot
+  // "count" holds the ancestor's.
+  FileInfoArray::size_type count = entries.size();
+
+  std::vector<iterator> next(count + 1);
+  std::vector<iterator> last(count + 1);
+  std::vector<bool>	active(count + 1);
+
+  for (FileInfoArray::size_type k = 0; k <= count; k++) {
+    FileInfo * dir = k < count ? entries[k] : ancestor;
+    if (dir) {
+      next[k]	= dir->ChildrenBegin();
+      last[k]	= dir->ChildrenEnd();
+      active[k] = true;
+    }
+  }
+
+  changed.assign(count, false);
+
+  if (ancestor)
+    for (FileInfoArray::size_type k = 0; k < count; k++)
+      if (entries[k])
+	ReadChecksums(entries[k], ancestor);
+
+  FileInfoArray		     children(count);
+  std::vector<FileInfoArray> removed(count);
+
+  for (;;) {
+    FileInfo * least = NULL;
+    for (FileInfoArray::size_type k = 0; k <= count; k++)
+      if (active[k] && next[k] != last[k] &&
+	  (! least || (*next[k])->CompareName(*least) < 0))
+	least = *next[k];
+    if (! least)
+      break;
+
+    // Names are interned, so entries with the same name in each
+    // location have the same id.
+    FileInfo * ancestorChild = NULL;
+    if (active[count] && next[count] != last[count] &&
+	(*next[count])->NameId() == least->NameId())
+      ancestorChild = *next[count]++;
+
+    for (FileInfoArray::size_type k = 0; k < count; k++) {
+      children[k] = NULL;
+      if (! active[k])
+	continue;
+
+      if (next[k] != last[k] && (*next[k])->NameId() == least->NameId())
+	children[k] = *next[k]++;
+
+      if (! children[k] && ancestorChild) {
+	removed[k].push_back(ancestorChild);
+	changed[k] = true;
+      }
+      else if (children[k] && ! ancestorChild) {
+	changed[k] = true;
+      }
+    }
+
+    CompareFiles(children, ancestorChild);
+  }
+
+  // Removals go last, since each adds a placeholder to the children
+  // we were walking.
+  for (FileInfoArray::size_type k = 0; k < count; k++)
+    for (FileInfoArray::iterator i = removed[k].begin();
+	 i != removed[k].end();
+	 i++)
+      PostRemoveChange(entries[k], (*i)->Name(), *i);
 }
 
 } // namespace Attic
@@ -7,12 +7,14 @@
 #include <string>
 #include <map>
 #include <deque>
+#include <vector>
 
 #include <boost/thread.hpp>
 
 namespace Attic {
 
 class Location;
+class Snapshot;
 class ChangeSet
 {
   void PostAddChange(FileInfo * entry);
@@ -27,6 +29,9 @@ class ChangeSet
     PostChange(StateChange::UpdateAttrs, entry, ancestor);
   }
 
+  bool CompareEntry(FileInfo * entry, FileInfo * ancestor, bool& updateAttrs);
+  void ReadChecksums(FileInfo * entry, FileInfo * ancestor);
+
 public:
   typedef std::map<std::string, StateChange *>  ChangesMap;
   typedef std::pair<std::string, StateChange *> ChangesPair;
@@ -38,29 +43,99 @@ public:
 
   typedef std::deque<StateChange *> ChangesArray;
 
+  // When a ChangeSet is Shallow, CompareFiles does not descend into
+  // directories.  Each directory whose children remain to be compared
+  // is added to Pending instead, so that the caller can compare (and
+  // apply, and free) one directory at a time.  Changes which must
+  // follow those made to a directory's children -- the directory's
+  // own removal, or an update of its attributes -- are not posted
+  // until the caller calls FinishDirectory.
+  struct PendingDirectory {
+    FileInfo * Entry;
+    FileInfo * Ancestor;	 // NULL if the directory was added
+    bool       UpdateRegistered; // an Update was posted for Entry
+    bool       UpdateAttrs;	 // its attributes must be updated
+    bool       Removed;		 // it must be removed
+
+    PendingDirectory(FileInfo * _Entry, FileInfo * _Ancestor)
+      : Entry(_Entry), Ancestor(_Ancestor), UpdateRegistered(false),
+	UpdateAttrs(false), Removed(false) {}
+  };
+
+  typedef std::deque<PendingDirectory> PendingArray;
+  typedef std::deque<std::string>      ConflictsArray;
+
   ChangesMap	   Changes;
   ChangesArray	   ChangeQueue;
   unsigned int	   ChangeQueueSize;
   boost::mutex	   ChangeQueueMutex;
   boost::condition ChangeQueueSelector;
 
+  // If ChangeQueueLimit is non-zero, some other thread is consuming
+  // the ChangeQueue (with NextChange) while changes are still being
+  // posted.  PostChange then waits whenever that many changes are
+  // waiting to be consumed, and reads whatever of each entry might
+  // otherwise be read lazily before posting it, so that the two
+  // threads never touch an entry at once.  It is set before the
+  // consumer starts, and never changed while it runs.
+  unsigned int	   ChangeQueueLimit;
+  unsigned int	   ChangeQueueConsumed;
+  bool		   ChangeQueueClosed;
+  bool		   ChangeQueueAbandoned; // the consumer gave up
+
+  bool		   Shallow;
+  PendingArray	   Pending;
+
+  // The paths which more than one location has changed, in the order
+  // they were discovered.
+  ConflictsArray   Conflicts;
+
   typedef boost::mutex::scoped_lock scoped_lock;
 
-  ChangeSet() {}
+  ChangeSet()
+    : ChangeQueueSize(0), ChangeQueueLimit(0), ChangeQueueConsumed(0),
+      ChangeQueueClosed(false), ChangeQueueAbandoned(false),
+      Shallow(false) {}
+  ~ChangeSet();
 
   void PostChange(StateChange::Kind kind, FileInfo * entry,
 		  FileInfo * ancestor);
 
   unsigned int GetChange(unsigned int lastKnownSize) {
     scoped_lock lock(ChangeQueueMutex);
-    while (ChangeQueueSize == lastKnownSize)
+    while (ChangeQueueSize == lastKnownSize && ! ChangeQueueClosed)
       ChangeQueueSelector.wait(lock);
     return ChangeQueueSize;
   }
 
+  StateChange * NextChange(unsigned int& cursor);
+  void CloseQueue();
+  void AbandonQueue();
+
   void CompareLocations(const Location * origin,
 			const Location * ancestor);
   void CompareFiles(FileInfo * entry, FileInfo * ancestor);
+  bool CompareChildren(FileInfo * entry, FileInfo * ancestor);
+
+  // Compare several locations against their common ancestor at once,
+  // walking the ancestor only once.  The entries passed in are those
+  // at the same path in each location, or NULL where a location has
+  // nothing there (or nothing worth descending into); changed is set
+  // for each location whose children differ from the ancestor's.
+  void CompareLocations(const std::vector<Location *>& origins,
+			const Location * ancestor);
+  void CompareFiles(const FileInfoArray& entries, FileInfo * ancestor);
+  void CompareChildren(const FileInfoArray& entries, FileInfo * ancestor,
+		       std::vector<bool>& changed);
+
+  // Compare two snapshots of whole trees, looking only at the kind,
+  // length and modification time of each entry (and where symbolic
+  // links point).  The changes posted are those CompareFiles would
+  // post if no other attributes were part of the state.
+  void CompareSnapshots(const Snapshot& entries, const Snapshot& ancestors);
+
+  void CompareChildren(PendingDirectory& dir);
+  void FinishDirectory(const PendingDirectory& dir);
 };
 
 } // namespace Attic
@@ -0,0 +1,162 @@
+#include "Checksum.h"
+#include "error.h"
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+
+namespace Attic {
+
+const char * checksum_t::Name(Algorithm algorithm)
+{
+  switch (algorithm) {
+  case MD5:	  return "md5";
+  case XXH64:	  return "xxh64";
+  case MD5Tree:	  return "md5-tree";
+  case XXH64Tree: return "xxh64-tree";
+  default:	  return "none";
+  }
+}
+
+checksum_t::Algorithm checksum_t::Named(const std::string& name)
+{
+  if (name == "md5")
+    return MD5;
+  if (name == "xxh64")
+    return XXH64;
+  return None;
+}
+
+ChecksumState::ChecksumState(checksum_t::Algorithm algorithm,
+			     std::vector<checksum_t> * chunks)
+  : Kind(algorithm), ChunkLength(0), Chunks(chunks)
+{
+  checksum_t::Algorithm base = checksum_t::Base(Kind);
+  if (base != checksum_t::MD5 && base != checksum_t::XXH64)
+    throw Exception("Attempt to compute a checksum with no algorithm");
+
+  Init(base, state);
+  if (checksum_t::IsTree(Kind))
+    Init(base, root);
+}
+
+void ChecksumState::Init(checksum_t::Algorithm algorithm, HashState& hash)
+{
+  switch (algorithm) {
+  case checksum_t::MD5:
+    md5_init(&hash.md5);
+    break;
+  case checksum_t::XXH64:
+    xxh64_init(&hash.xxh64, 0);
+    break;
+  default:
+    break;
+  }
+}
+
+void ChecksumState::Append(checksum_t::Algorithm algorithm, HashState& hash,
+			   const void * data, std::size_t length)
+{
+  const md5_byte_t * bytes = static_cast<const md5_byte_t *>(data);
+
+  switch (algorithm) {
+  case checksum_t::MD5:
+    // md5_append takes an int, so very large buffers go in pieces.
+    while (length > 0) {
+      int len = length > INT_MAX ? INT_MAX : static_cast<int>(length);
+      md5_append(&hash.md5, bytes, len);
+      bytes  += len;
+      length -= len;
+    }
+    break;
+  case checksum_t::XXH64:
+    xxh64_append(&hash.xxh64, bytes, length);
+    break;
+  default:
+    break;
+  }
+}
+
+void ChecksumState::Finish(checksum_t::Algorithm algorithm, HashState& hash,
+			   checksum_t& csum)
+{
+  csum = checksum_t(algorithm);
+
+  switch (algorithm) {
+  case checksum_t::MD5:
+    md5_finish(&hash.md5, csum.digest);
+    break;
+
+  case checksum_t::XXH64: {
+    // Stored most significant byte first, as xxHash prints it.
+    xxh64_word_t digest = xxh64_digest(&hash.xxh64);
+    for (int i = 7; i >= 0; i--, digest >>= 8)
+      csum.digest[i] = static_cast<unsigned char>(digest & 0xff);
+    break;
+  }
+
+  default:
+    break;
+  }
+}
+
+void ChecksumState::Append(const void * data, std::size_t length)
+{
+  if (! checksum_t::IsTree(Kind)) {
+    Append(Kind, state, data, length);
+    return;
+  }
+
+  const char * bytes = static_cast<const char *>(data);
+  while (length > 0) {
+    std::size_t len = std::min<std::size_t>(length,
+					    CHECKSUM_CHUNK_SIZE - ChunkLength);
+    Append(checksum_t::Base(Kind), state, bytes, len);
+    ChunkLength += len;
+    bytes	+= len;
+    length	-= len;
+
+    if (ChunkLength == CHECKSUM_CHUNK_SIZE)
+      FinishChunk();
+  }
+}
+
+void ChecksumState::FinishChunk()
+{
+  checksum_t::Algorithm base = checksum_t::Base(Kind);
+
+  checksum_t chunk;
+  Finish(base, state, chunk);
+  Init(base, state);
+  ChunkLength = 0;
+
+  AppendChunk(chunk);
+}
+
+void ChecksumState::AppendChunk(const checksum_t& chunk)
+{
+  assert(checksum_t::IsTree(Kind) && ChunkLength == 0);
+  assert(chunk.Kind() == checksum_t::Base(Kind));
+
+  Append(chunk.Kind(), root, chunk.digest, chunk.Length());
+  if (Chunks)
+    Chunks->push_back(chunk);
+}
+
+void ChecksumState::Finish(checksum_t& csum)
+{
+  if (! checksum_t::IsTree(Kind)) {
+    Finish(Kind, state, csum);
+    return;
+  }
+
+  // A file which is not a whole number of chunks long ends with a
+  // short one; an empty file has no chunks at all.
+  if (ChunkLength > 0)
+    FinishChunk();
+
+  Finish(checksum_t::Base(Kind), root, csum);
+  csum.algorithm = Kind;
+}
+
+} // namespace Attic
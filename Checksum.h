@@ -0,0 +1,160 @@
+#ifndef _CHECKSUM_H
+#define _CHECKSUM_H
+
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "md5.h"
+#include "xxhash.h"
+
+namespace Attic {
+
+// A checksum_t is the digest of a file's contents, together with the
+// algorithm that produced it, so that digests made by different
+// algorithms are never mistaken for one another.  XXH64 is the
+// default for noticing changes: it is many times faster than MD5, and
+// a change only has to be told from no change, not guarded against
+// someone forging it.  MD5 remains for verifying copies and for
+// databases written before there was a choice.
+//
+// Digests are kept in a fixed array, zero past their length, so that
+// checksums can be copied, compared and stored without allocation.
+//
+// Each algorithm also has a tree form, for very large files: the file
+// is cut into chunks of CHECKSUM_CHUNK_SIZE bytes, each chunk is
+// hashed separately, and the digest is the hash of the chunks'
+// digests one after another.  The chunks can then be hashed on as
+// many threads as there are cores, and the chunk digests say which
+// parts of a file differ.  The chunk size is part of what a tree
+// digest means, so it can never change.
+
+#define CHECKSUM_MAX_LENGTH 16
+#define CHECKSUM_TREE	    0x80
+#define CHECKSUM_CHUNK_SIZE (4 * 1024 * 1024)
+
+class checksum_t
+{
+public:
+  enum Algorithm {
+    None  = 0,
+    MD5	  = 1,
+    XXH64 = 2,
+
+    MD5Tree   = MD5 | CHECKSUM_TREE,
+    XXH64Tree = XXH64 | CHECKSUM_TREE
+  };
+
+  unsigned char algorithm;
+  unsigned char digest[CHECKSUM_MAX_LENGTH];
+
+  checksum_t(Algorithm _algorithm = None) : algorithm(_algorithm) {
+    std::memset(digest, 0, sizeof(digest));
+  }
+
+  Algorithm Kind() const {
+    return static_cast<Algorithm>(algorithm);
+  }
+  std::size_t Length() const {
+    return Length(Kind());
+  }
+
+  static std::size_t Length(Algorithm algorithm) {
+    switch (Base(algorithm)) {
+    case MD5:	return 16;
+    case XXH64: return 8;
+    default:	return 0;
+    }
+  }
+
+  static bool IsTree(Algorithm algorithm) {
+    return (algorithm & CHECKSUM_TREE) != 0;
+  }
+  static Algorithm Base(Algorithm algorithm) {
+    return static_cast<Algorithm>(algorithm & ~CHECKSUM_TREE);
+  }
+  static Algorithm Tree(Algorithm algorithm) {
+    return static_cast<Algorithm>(algorithm | CHECKSUM_TREE);
+  }
+
+  // The name of an algorithm on the command-line, and the algorithm
+  // by a given name, or None if there is no such algorithm.
+  static const char * Name(Algorithm algorithm);
+  static Algorithm Named(const std::string& name);
+
+  bool operator==(const checksum_t& other) const {
+    return (algorithm == other.algorithm &&
+	    std::memcmp(digest, other.digest, sizeof(digest)) == 0);
+  }
+  bool operator!=(const checksum_t& other) const {
+    return ! (*this == other);
+  }
+  bool operator<(const checksum_t& other) const {
+    if (algorithm != other.algorithm)
+      return algorithm < other.algorithm;
+    return std::memcmp(digest, other.digest, sizeof(digest)) < 0;
+  }
+
+  friend inline std::ostream& operator<<(std::ostream& out,
+					 const checksum_t& csum) {
+    for (std::size_t i = 0; i < csum.Length(); i++) {
+      out.fill('0');
+      out.width(2);
+      out << std::hex << (int)csum.digest[i];
+    }
+    return out << std::dec;
+  }
+};
+
+// A ChecksumState computes a checksum_t of a stream of data appended
+// to it in pieces.  For a tree algorithm the chunks may instead be
+// hashed elsewhere, and their digests given to AppendChunk in order.
+
+class ChecksumState
+{
+  union HashState {
+    md5_state_t	  md5;
+    xxh64_state_t xxh64;
+  };
+
+  checksum_t::Algorithm Kind;
+  HashState		state;	// all of the data, or the current chunk
+
+  // Only used by tree algorithms.
+  HashState		  root;	// the digests of the chunks so far
+  std::size_t		  ChunkLength;
+  std::vector<checksum_t> * Chunks;
+
+  static void Init(checksum_t::Algorithm algorithm, HashState& hash);
+  static void Append(checksum_t::Algorithm algorithm, HashState& hash,
+		     const void * data, std::size_t length);
+  static void Finish(checksum_t::Algorithm algorithm, HashState& hash,
+		     checksum_t& csum);
+
+  void FinishChunk();
+
+public:
+  // If chunks is given, the digest of every chunk of a tree
+  // algorithm is appended to it as well.
+  explicit ChecksumState(checksum_t::Algorithm algorithm,
+			 std::vector<checksum_t> * chunks = NULL);
+
+  checksum_t::Algorithm Algorithm() const {
+    return Kind;
+  }
+
+  // Only valid for plain MD5, for hashing in the lanes of MD5Lanes.
+  md5_state_t * MD5State() {
+    return &state.md5;
+  }
+
+  void Append(const void * data, std::size_t length);
+  void AppendChunk(const checksum_t& chunk);
+  void Finish(checksum_t& csum);
+};
+
+} // namespace Attic
+
+#endif // _CHECKSUM_H
@@ -0,0 +1,212 @@
+#include "ChecksumCache.h"
+#include "binary.h"
+#include "error.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+namespace Attic {
+
+#define CHECKSUM_CACHE_VERSION 0x00000003L
+
+// Each record is this long, followed by a count of its chunks and
+// the digest of each one.
+#define CHECKSUM_RECORD_SIZE   (5 * 8 + 1 + CHECKSUM_MAX_LENGTH)
+
+ChecksumCache::ChecksumCache(const Path& _CachePath)
+  : CachePath(_CachePath), Dirty(false)
+{
+  Load();
+}
+
+ChecksumCache::~ChecksumCache()
+{
+  try {
+    Save();
+  }
+  catch (const Exception&) {
+    // The checksums will simply be computed again next time.
+  }
+}
+
+bool ChecksumCache::Find(const Stamp& stamp, checksum_t::Algorithm algorithm,
+			 checksum_t& csum, std::vector<checksum_t> * chunks)
+{
+  scoped_lock lock(CacheMutex);
+
+  RecordMap::iterator i = Records.find(FileId(stamp.Device, stamp.Inode));
+  if (i == Records.end())
+    return false;
+
+  Record& record((*i).second);
+  record.Seen = true;
+
+  if (record.Size	!= stamp.Size ||
+      record.ModifyTime != stamp.ModifyTime ||
+      record.ChangeTime != stamp.ChangeTime ||
+      record.Checksum.Kind() != algorithm ||
+      (chunks && checksum_t::IsTree(algorithm) && record.Chunks.empty()))
+    return false;
+
+  csum = record.Checksum;
+  if (chunks)
+    chunks->insert(chunks->end(), record.Chunks.begin(), record.Chunks.end());
+  return true;
+}
+
+void ChecksumCache::Insert(const Stamp& stamp, std::time_t started,
+			   const checksum_t& csum,
+			   const std::vector<checksum_t> * chunks)
+{
+  long long cutoff =
+    static_cast<long long>(started - CHECKSUM_CACHE_MARGIN) * 1000000000LL;
+  if (stamp.ModifyTime >= cutoff || stamp.ChangeTime >= cutoff)
+    return;
+
+  scoped_lock lock(CacheMutex);
+
+  Record& record(Records[FileId(stamp.Device, stamp.Inode)]);
+  record.Size	    = stamp.Size;
+  record.ModifyTime = stamp.ModifyTime;
+  record.ChangeTime = stamp.ChangeTime;
+  record.Checksum   = csum;
+  record.Seen	    = true;
+  if (chunks && checksum_t::IsTree(csum.Kind()))
+    record.Chunks = *chunks;
+  else
+    record.Chunks.clear();
+
+  Dirty = true;
+}
+
+void ChecksumCache::Load()
+{
+  std::ifstream fin(CachePath.c_str(), std::ios::in | std::ios::binary);
+  if (! fin)
+    return;
+
+  std::string contents((std::istreambuf_iterator<char>(fin)),
+		       std::istreambuf_iterator<char>());
+
+  // The version, the count of records, the records, and a CRC-32 of
+  // everything before it.
+  std::size_t header = 2 * sizeof(unsigned long long);
+  if (contents.length() < header + sizeof(unsigned int))
+    return;
+
+  char * data = &contents[0];
+  char * end  = data + contents.length() - sizeof(unsigned int);
+
+  unsigned int crc = *reinterpret_cast<unsigned int *>(end);
+  if (crc != binary_crc32(0, data, end - data))
+    return;
+
+  if (read_binary_number<unsigned long long>(data) != CHECKSUM_CACHE_VERSION)
+    return;
+
+  unsigned long long count = read_binary_number<unsigned long long>(data);
+
+  RecordMap records;
+  for (unsigned long long n = 0; n < count; n++) {
+    if ((unsigned long long)(end - data) <
+	CHECKSUM_RECORD_SIZE + sizeof(unsigned int))
+      return;
+
+    FileId id;
+    id.first  = read_binary_number<unsigned long long>(data);
+    id.second = read_binary_number<unsigned long long>(data);
+
+    Record& record(records[id]);
+    read_binary_number(data, record.Size);
+    read_binary_number(data, record.ModifyTime);
+    read_binary_number(data, record.ChangeTime);
+    read_binary_number(data, record.Checksum.algorithm);
+    std::memcpy(record.Checksum.digest, data, CHECKSUM_MAX_LENGTH);
+    data += CHECKSUM_MAX_LENGTH;
+    record.Seen = false;
+
+    unsigned int chunks = read_binary_number<unsigned int>(data);
+    checksum_t	 chunk(checksum_t::Base(record.Checksum.Kind()));
+    std::size_t	 length = chunk.Length();
+    if (chunks > 0 &&
+	(length == 0 || (unsigned long long)(end - data) / length < chunks))
+      return;
+
+    record.Chunks.reserve(chunks);
+    for (unsigned int i = 0; i < chunks; i++) {
+      std::memcpy(chunk.digest, data, length);
+      data += length;
+      record.Chunks.push_back(chunk);
+    }
+  }
+
+  if (data == end)
+    Records.swap(records);
+}
+
+void ChecksumCache::Save()
+{
+  scoped_lock lock(CacheMutex);
+
+  if (! Dirty)
+    return;
+
+  // Records for files which were not visited this time are kept,
+  // since only part of the volume may have been looked at; but once
+  // they outnumber the rest, they are likely to be files which are
+  // gone, so they are dropped.
+  RecordMap::size_type seen = 0;
+  for (RecordMap::iterator i = Records.begin(); i != Records.end(); i++)
+    if ((*i).second.Seen)
+      seen++;
+  bool prune = Records.size() - seen > seen;
+
+  std::ostringstream out(std::ios::out | std::ios::binary);
+
+  write_binary_number<unsigned long long>(out, CHECKSUM_CACHE_VERSION);
+  write_binary_number<unsigned long long>
+    (out, prune ? seen : Records.size());
+
+  for (RecordMap::iterator i = Records.begin(); i != Records.end(); i++) {
+    const Record& record((*i).second);
+    if (prune && ! record.Seen)
+      continue;
+
+    write_binary_number(out, (*i).first.first);
+    write_binary_number(out, (*i).first.second);
+    write_binary_number(out, record.Size);
+    write_binary_number(out, record.ModifyTime);
+    write_binary_number(out, record.ChangeTime);
+    write_binary_number(out, record.Checksum.algorithm);
+    out.write(reinterpret_cast<const char *>(record.Checksum.digest),
+	      CHECKSUM_MAX_LENGTH);
+
+    write_binary_number<unsigned int>(out, record.Chunks.size());
+    for (std::vector<checksum_t>::const_iterator j = record.Chunks.begin();
+	 j != record.Chunks.end();
+	 j++)
+      out.write(reinterpret_cast<const char *>((*j).digest), (*j).Length());
+  }
+
+  std::string contents(out.str());
+  unsigned int crc = binary_crc32(0, contents.data(), contents.length());
+
+  Path tempPath(CachePath + ".new");
+
+  std::ofstream fout(tempPath.c_str(), std::ios::out | std::ios::binary);
+  fout.write(contents.data(), contents.length());
+  write_binary_number(fout, crc);
+  fout.close();
+
+  if (! fout || std::rename(tempPath.c_str(), CachePath.c_str()) != 0) {
+    std::remove(tempPath.c_str());
+    throw Exception("Failed to write checksum cache '" + CachePath + "'");
+  }
+
+  Dirty = false;
+}
+
+} // namespace Attic
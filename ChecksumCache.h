@@ -0,0 +1,91 @@
+#ifndef _CHECKSUMCACHE_H
+#define _CHECKSUMCACHE_H
+
+#include "FileInfo.h"
+
+#include <ctime>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+namespace Attic {
+
+// A ChecksumCache remembers the checksum of every file a volume has
+// had to read, keyed by the device and inode of the file, and valid
+// only for as long as its length, modification time and change time
+// are all what they were when it was read.  The change time cannot be
+// set by anyone but the kernel, so a file rewritten with its old
+// length and timestamp restored still misses.  The cache is loaded
+// from a file when it is created and written back, if it has changed,
+// when it is destroyed, so that verifying an unchanged tree with
+// checksums costs little more than an lstat of each file.
+//
+// The digests of the chunks of a tree checksum are kept along with it,
+// so that they need not be read again to find which parts of a large
+// file have changed.
+//
+// A file changed within CHECKSUM_CACHE_MARGIN seconds of being read
+// may have been changed again within the same tick of the clock,
+// without its times showing it, so its checksum is not kept.  Since
+// this is only a cache, a file which is missing or damaged is simply
+// ignored, and one which cannot be written is not reported.
+
+#define CHECKSUM_CACHE_NAME   ".attic.csums" // at the root of a volume
+#define CHECKSUM_CACHE_MARGIN 2	// seconds; FAT keeps times to two
+
+class ChecksumCache
+{
+public:
+  typedef boost::mutex::scoped_lock scoped_lock;
+
+  struct Stamp {
+    unsigned long long Device;
+    unsigned long long Inode;
+    unsigned long long Size;
+    long long	       ModifyTime; // both in nanoseconds since the epoch
+    long long	       ChangeTime;
+  };
+
+  explicit ChecksumCache(const Path& _CachePath);
+  ~ChecksumCache();
+
+  // Only a checksum made by the given algorithm is found.  If chunks
+  // is given, the digests of its chunks are appended to it, and one
+  // kept without them is not found.
+  bool Find(const Stamp& stamp, checksum_t::Algorithm algorithm,
+	    checksum_t& csum, std::vector<checksum_t> * chunks = NULL);
+
+  // started is when the file was opened to be read.
+  void Insert(const Stamp& stamp, std::time_t started,
+	      const checksum_t& csum,
+	      const std::vector<checksum_t> * chunks = NULL);
+
+  void Save();
+
+private:
+  typedef std::pair<unsigned long long, unsigned long long> FileId;
+
+  struct Record {
+    unsigned long long Size;
+    long long	       ModifyTime;
+    long long	       ChangeTime;
+    checksum_t	       Checksum;
+    std::vector<checksum_t> Chunks; // only for a tree checksum
+    bool	       Seen;	// looked up or inserted during this run
+  };
+
+  typedef std::map<FileId, Record> RecordMap;
+
+  Path	       CachePath;
+  boost::mutex CacheMutex;
+  RecordMap    Records;
+  bool	       Dirty;
+
+  void Load();
+};
+
+} // namespace Attic
+
+#endif // _CHECKSUMCACHE_H
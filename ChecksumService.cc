@@ -0,0 +1,348 @@
+#include "ChecksumService.h"
+
+#include <cassert>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace Attic {
+
+ChecksumService::ChecksumService(unsigned int readers, unsigned int hashers)
+  : Window(CHECKSUM_SERVICE_WINDOW), NextSequence(0), ShuttingDown(false)
+{
+  assert(readers > 0);
+  assert(hashers > 0);
+
+  for (unsigned int i = 0; i < CHECKSUM_SERVICE_BUFFERS; i++)
+    AllBuffers.push_back(new Buffer);
+  FreeBuffers = AllBuffers;
+
+  for (unsigned int i = 0; i < readers; i++)
+    Workers.create_thread(Reader(this));
+  for (unsigned int i = 0; i < hashers; i++)
+    Workers.create_thread(Hasher(this));
+}
+
+ChecksumService::~ChecksumService()
+{
+  {
+    scoped_lock lock(JobsMutex);
+    ShuttingDown = true;
+    WorkAvailable.notify_all();
+    BufferFreed.notify_all();
+    HashAvailable.notify_all();
+  }
+  Workers.join_all();
+
+  for (JobMap::iterator i = Jobs.begin(); i != Jobs.end(); i++)
+    delete (*i).second.Hash;
+  for (std::vector<Buffer *>::iterator i = AllBuffers.begin();
+       i != AllBuffers.end();
+       i++)
+    delete *i;
+}
+
+void ChecksumService::Enter(const std::vector<std::string>& paths,
+			    checksum_t::Algorithm algorithm)
+{
+  if (paths.empty())
+    return;
+
+  scoped_lock lock(JobsMutex);
+
+  // The comparer will want these files next, so they go ahead of
+  // everything queued so far, in the order given.
+  for (std::vector<std::string>::const_reverse_iterator i = paths.rbegin();
+       i != paths.rend();
+       i++) {
+    Key key(algorithm, *i);
+    if (Jobs.insert(JobMap::value_type(key, Job())).second)
+      Requests.push_front(key);
+  }
+
+  Trim();
+  WorkAvailable.notify_all();
+}
+
+bool ChecksumService::Take(const std::string& path,
+			   checksum_t::Algorithm algorithm, checksum_t& csum,
+			   struct stat& info, std::time_t& started, int& error)
+{
+  Key key(algorithm, path);
+
+  scoped_lock lock(JobsMutex);
+
+  JobMap::iterator i = Jobs.find(key);
+  if (i == Jobs.end())
+    return false;
+
+  if ((*i).second.RequestState == Queued) {
+    // Cheaper to do it ourselves than to wait our turn.  The stale
+    // key left in Requests is skipped by whichever reader finds it.
+    Jobs.erase(i);
+    return false;
+  }
+
+  while ((*i).second.RequestState == Running) {
+    RequestDone.wait(lock);
+    i = Jobs.find(key);
+    if (i == Jobs.end())
+      return false;
+  }
+
+  assert((*i).second.RequestState == Done);
+  Finished.erase((*i).second.Sequence);
+  csum	  = (*i).second.Csum;
+  info	  = (*i).second.Info;
+  started = (*i).second.Started;
+  error	  = (*i).second.Error;
+  Jobs.erase(i);
+  return true;
+}
+
+void ChecksumService::Share(const boost::function<void()>& body,
+			    unsigned int count)
+{
+  Task task(body);
+  if (count > 0) {
+    scoped_lock lock(JobsMutex);
+    task.Waiting = count;
+    Tasks.push_back(&task);
+    HashAvailable.notify_all();
+  }
+
+  body();
+
+  scoped_lock lock(JobsMutex);
+  if (task.Waiting > 0) {
+    for (std::deque<Task *>::iterator i = Tasks.begin();
+	 i != Tasks.end();
+	 i++)
+      if (*i == &task) {
+	Tasks.erase(i);
+	break;
+      }
+    task.Waiting = 0;
+  }
+  while (task.Running > 0)
+    TaskDone.wait(lock);
+}
+
+void ChecksumService::Trim()
+{
+  // Drop the least urgent requests first, since no work has been
+  // spent on them, then the oldest unclaimed results.
+  while (Jobs.size() > Window) {
+    if (! Requests.empty()) {
+      JobMap::iterator i = Jobs.find(Requests.back());
+      if (i != Jobs.end() && (*i).second.RequestState == Queued)
+	Jobs.erase(i);
+      Requests.pop_back();
+    }
+    else if (! Finished.empty()) {
+      Jobs.erase((*Finished.begin()).second);
+      Finished.erase(Finished.begin());
+    }
+    else {
+      break;
+    }
+  }
+}
+
+void ChecksumService::RunReader()
+{
+  for (;;) {
+    JobMap::iterator i;
+    {
+      scoped_lock lock(JobsMutex);
+      while (Requests.empty() && ! ShuttingDown)
+	WorkAvailable.wait(lock);
+      if (ShuttingDown)
+	return;
+
+      Key key = Requests.front();
+      Requests.pop_front();
+
+      i = Jobs.find(key);
+      if (i == Jobs.end() || (*i).second.RequestState != Queued)
+	continue;
+      (*i).second.RequestState = Running;
+    }
+
+    // Nothing removes a running job, so i stays valid until it is
+    // finished, and only this thread touches what is set up here
+    // until the job is first scheduled.
+    Job& job((*i).second);
+    job.Started = std::time(NULL);
+
+    int fd = open((*i).first.second.c_str(), O_RDONLY);
+    if (fd == -1 || fstat(fd, &job.Info) == -1) {
+      int error = errno;
+      if (fd != -1)
+	close(fd);
+
+      scoped_lock lock(JobsMutex);
+      job.Error = error;
+      job.AtEnd = true;
+      Schedule(i);
+      continue;
+    }
+
+    job.Hash = new ChecksumState((*i).first.first);
+    Read(i, fd);
+    close(fd);
+  }
+}
+
+void ChecksumService::Read(JobMap::iterator i, int fd)
+{
+  Job& job((*i).second);
+
+  for (;;) {
+    Buffer * buffer;
+    {
+      scoped_lock lock(JobsMutex);
+      while (FreeBuffers.empty() && ! ShuttingDown)
+	BufferFreed.wait(lock);
+      if (ShuttingDown)
+	return;
+
+      buffer = FreeBuffers.back();
+      FreeBuffers.pop_back();
+    }
+
+    int	 error = 0;
+    bool atEnd = false;
+
+    buffer->Length = 0;
+    while (buffer->Length < buffer->Data.size()) {
+      ssize_t len = read(fd, &buffer->Data[buffer->Length],
+			 buffer->Data.size() - buffer->Length);
+      if (len == -1) {
+	if (errno == EINTR)
+	  continue;
+	error = errno;
+	break;
+      }
+      if (len == 0) {
+	atEnd = true;
+	break;
+      }
+      buffer->Length += len;
+    }
+
+    scoped_lock lock(JobsMutex);
+
+    if (error == 0 && buffer->Length > 0) {
+      job.Filled.push_back(buffer);
+    } else {
+      FreeBuffers.push_back(buffer);
+      BufferFreed.notify_one();
+    }
+
+    if (error != 0) {
+      job.Error = error;
+      atEnd     = true;
+    }
+    if (atEnd)
+      job.AtEnd = true;
+
+    Schedule(i);
+    if (atEnd)
+      return;
+  }
+}
+
+void ChecksumService::Schedule(JobMap::iterator i)
+{
+  if (! (*i).second.Scheduled) {
+    (*i).second.Scheduled = true;
+    Hashable.push_back(i);
+    HashAvailable.notify_one();
+  }
+}
+
+void ChecksumService::RunHasher()
+{
+  for (;;) {
+    JobMap::iterator	 i;
+    std::deque<Buffer *> buffers;
+    bool		 failed;
+    {
+      scoped_lock lock(JobsMutex);
+      while (Hashable.empty() && Tasks.empty() && ! ShuttingDown)
+	HashAvailable.wait(lock);
+      if (ShuttingDown)
+	return;
+
+      // A shared task comes first, since its caller is waiting on it
+      // now, while a file's checksum is only wanted ahead of time.
+      if (! Tasks.empty()) {
+	Task * task = Tasks.front();
+	if (--task->Waiting == 0)
+	  Tasks.pop_front();
+	task->Running++;
+
+	lock.unlock();
+	task->Body();
+	lock.lock();
+
+	if (--task->Running == 0)
+	  TaskDone.notify_all();
+	continue;
+      }
+
+      i = Hashable.front();
+      Hashable.pop_front();
+      buffers.swap((*i).second.Filled);
+      failed = (*i).second.Error != 0;
+    }
+
+    // Only one hasher at a time has a job, since it is scheduled
+    // again only once this one is done with it, so its data is
+    // hashed in the order it was read.
+    Job& job((*i).second);
+    if (! failed)
+      for (std::deque<Buffer *>::iterator j = buffers.begin();
+	   j != buffers.end();
+	   j++)
+	job.Hash->Append(&(*j)->Data[0], (*j)->Length);
+
+    scoped_lock lock(JobsMutex);
+
+    for (std::deque<Buffer *>::iterator j = buffers.begin();
+	 j != buffers.end();
+	 j++)
+      FreeBuffers.push_back(*j);
+    if (! buffers.empty())
+      BufferFreed.notify_all();
+
+    if (! job.Filled.empty())
+      Hashable.push_back(i);
+    else if (job.AtEnd)
+      Finish(i);
+    else
+      job.Scheduled = false;
+  }
+}
+
+void ChecksumService::Finish(JobMap::iterator i)
+{
+  Job& job((*i).second);
+
+  if (job.Error == 0)
+    job.Hash->Finish(job.Csum);
+  delete job.Hash;
+  job.Hash = NULL;
+
+  job.Scheduled	   = false;
+  job.RequestState = Done;
+  job.Sequence	   = NextSequence++;
+  Finished[job.Sequence] = (*i).first;
+
+  Trim();
+  RequestDone.notify_all();
+}
+
+} // namespace Attic
@@ -0,0 +1,165 @@
+#ifndef _CHECKSUMSERVICE_H
+#define _CHECKSUMSERVICE_H
+
+#include "Checksum.h"
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <string>
+#include <ctime>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <boost/thread.hpp>
+#include <boost/function.hpp>
+
+namespace Attic {
+
+// A ChecksumService computes the checksums of files on background
+// threads, ahead of the comparer which will need them.  Whenever the
+// comparer reaches a directory, the files whose checksums it may
+// compare are given to Enter.  Reader threads open those files and
+// read them into a shared pool of buffers, several files at once, so
+// that every disk of an array is kept busy; hasher threads take the
+// buffers as they fill and hash each file's data in order, so that
+// reading never waits on hashing or the other way around.  The pool
+// is all the read-ahead there is: a reader with no free buffer waits
+// for a hasher to return one.
+//
+// The comparer picks up each checksum with Take, when it actually
+// needs it.  As with StatAhead, a file not yet opened is dropped and
+// the caller hashes it itself, rather than waiting its turn; a file
+// being read or hashed is waited for.  Only paths are dealt in, so
+// FileInfo objects are never touched by the service's threads.  At
+// most Window requests and unclaimed results are held at once.
+
+#define CHECKSUM_SERVICE_BLOCK	 (256 * 1024)
+#define CHECKSUM_SERVICE_BUFFERS 64	// 16 MB of read-ahead in all
+#define CHECKSUM_SERVICE_WINDOW	 4096
+
+class ChecksumService
+{
+public:
+  typedef boost::mutex::scoped_lock scoped_lock;
+
+  ChecksumService(unsigned int readers, unsigned int hashers);
+  ~ChecksumService();
+
+  void Enter(const std::vector<std::string>& paths,
+	     checksum_t::Algorithm algorithm);
+
+  // Returns false if the caller must compute the checksum itself;
+  // otherwise, error is zero or the errno from the failed call, and
+  // info and started say what the file was when it was opened, and
+  // when.
+  bool Take(const std::string& path, checksum_t::Algorithm algorithm,
+	    checksum_t& csum, struct stat& info, std::time_t& started,
+	    int& error);
+
+  // Run body on the calling thread and on up to count of the hasher
+  // threads besides, returning once every copy of it has returned.
+  // Hashers busy with a file join in as they come free; copies none
+  // has started by the time the caller's own copy returns are not
+  // run at all, so body must be something the copies share out
+  // among themselves, and must not throw.
+  void Share(const boost::function<void()>& body, unsigned int count);
+
+private:
+  enum State {
+    Queued, Running, Done
+  };
+
+  typedef std::pair<checksum_t::Algorithm, std::string> Key;
+
+  struct Buffer {
+    std::vector<char> Data;
+    std::size_t	      Length;
+
+    Buffer() : Data(CHECKSUM_SERVICE_BLOCK), Length(0) {}
+  };
+
+  struct Job {
+    State		RequestState;
+    unsigned long	Sequence;	// completion order, once Done
+    int			Error;
+    struct stat		Info;
+    std::time_t		Started;
+    checksum_t		Csum;
+
+    // Only used while Running.
+    ChecksumState *	Hash;
+    std::deque<Buffer *> Filled;	// read, and waiting to be hashed
+    bool		AtEnd;		// nothing more will be read
+    bool		Scheduled;	// in Hashable, or being hashed
+
+    Job() : RequestState(Queued), Sequence(0), Error(0), Started(0),
+	    Hash(NULL), AtEnd(false), Scheduled(false) {}
+  };
+
+  struct Task {
+    boost::function<void()> Body;
+    unsigned int	    Waiting;	// copies not yet started
+    unsigned int	    Running;
+
+    Task(const boost::function<void()>& _Body)
+      : Body(_Body), Waiting(0), Running(0) {}
+  };
+
+  typedef std::map<Key, Job>		JobMap;
+  typedef std::map<unsigned long, Key>	FinishedMap;
+
+  unsigned int		Window;
+  boost::thread_group	Workers;
+
+  // All of the following are guarded by JobsMutex.
+  boost::mutex		JobsMutex;
+  boost::condition	WorkAvailable;	// a request was queued, or shutdown
+  boost::condition	BufferFreed;	// a buffer was returned, or shutdown
+  boost::condition	HashAvailable;	// a buffer was filled, a task
+					// shared, or shutdown
+  boost::condition	RequestDone;	// a running request finished
+  boost::condition	TaskDone;	// a copy of a task returned
+  std::deque<Key>	Requests;
+  std::deque<JobMap::iterator> Hashable;
+  std::deque<Task *>	Tasks;
+  std::vector<Buffer *> FreeBuffers;
+  std::vector<Buffer *> AllBuffers;
+  JobMap		Jobs;
+  FinishedMap		Finished;
+  unsigned long		NextSequence;
+  bool			ShuttingDown;
+
+  class Reader {
+    ChecksumService * Engine;
+  public:
+    Reader(ChecksumService * _Engine) : Engine(_Engine) {}
+    void operator()() {
+      Engine->RunReader();
+    }
+  };
+
+  class Hasher {
+    ChecksumService * Engine;
+  public:
+    Hasher(ChecksumService * _Engine) : Engine(_Engine) {}
+    void operator()() {
+      Engine->RunHasher();
+    }
+  };
+
+  void RunReader();
+  void RunHasher();
+  void Read(JobMap::iterator i, int fd);
+  void Schedule(JobMap::iterator i);
+  void Finish(JobMap::iterator i);
+  void Trim();
+
+  friend class Reader;
+  friend class Hasher;
+};
+
+} // namespace Attic
+
+#endif // _CHECKSUMSERVICE_H
@@ -0,0 +1,448 @@
+#include "CopyEngine.h"
+#include "error.h"
+#include "acconf.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_LINUX_FS_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
+namespace Attic {
+
+// The most that copy_file_range and sendfile will move in one call.
+#define COPY_KERNEL_CHUNK 0x40000000
+
+CopyEngine::~CopyEngine()
+{
+  for (std::vector<char *>::iterator i = AllBuffers.begin();
+       i != AllBuffers.end();
+       i++)
+    std::free(*i);
+}
+
+void CopyEngine::Copy(int in, int out, const Path& source, const Path& dest,
+		      bool keepHoles)
+{
+  struct stat sourceInfo;
+  struct stat destInfo;
+  if (fstat(in, &sourceInfo) == -1 || fstat(out, &destInfo) == -1)
+    throw Exception("Failed to stat '" + source + "' or '" + dest + "'");
+
+  DevicePair devices(sourceInfo.st_dev, destInfo.st_dev);
+  Strategy   strategy = Clone;
+  {
+    scoped_lock lock(Mutex);
+    StrategyMap::iterator i = Strategies.find(devices);
+    if (i != Strategies.end())
+      strategy = (*i).second;
+  }
+
+  if (strategy == Clone) {
+    if (CloneFile(in, out) == Copied)
+      return;
+
+    strategy = CopyRange;
+    scoped_lock lock(Mutex);
+    Strategies[devices] = strategy;
+  }
+
+#ifdef SEEK_DATA
+  if (keepHoles &&
+      static_cast<unsigned long long>(sourceInfo.st_blocks) * 512 <
+      static_cast<unsigned long long>(sourceInfo.st_size)) {
+    unsigned long long offset = 0;
+    for (;;) {
+      off_t data = lseek(in, offset, SEEK_DATA);
+      off_t hole;
+      if (data == -1) {
+	if (errno == ENXIO)	// nothing but holes from here on
+	  break;
+	data = offset;		// no SEEK_DATA here; all of it is data
+	hole = -1;
+      } else {
+	hole = lseek(in, data, SEEK_HOLE);
+      }
+
+      unsigned long long end = hole == -1 ? COPY_TO_END : hole;
+      CopyExtent(strategy, devices, in, out, data, end, source, dest);
+      if (end == COPY_TO_END)
+	break;
+      offset = end;
+    }
+
+    // Whatever hole the file ends with is made by its length.
+    off_t length = lseek(in, 0, SEEK_END);
+    if (length == -1 || ftruncate(out, length) == -1)
+      throw Exception("Failed to copy '" + source + "' to '" + dest + "'");
+    return;
+  }
+#endif
+
+  CopyExtent(strategy, devices, in, out, 0, COPY_TO_END, source, dest);
+}
+
+void CopyEngine::CopyExtent(Strategy& strategy, const DevicePair& devices,
+			    int in, int out, unsigned long long offset,
+			    unsigned long long end, const Path& source,
+			    const Path& dest)
+{
+  for (;;) {
+    unsigned long long start = offset;
+
+    Outcome outcome;
+    switch (strategy) {
+    case CopyRange:
+      outcome = CopyFileRange(in, out, offset, end);
+      break;
+    case SendFile:
+      outcome = SendFileData(in, out, offset, end);
+      break;
+    default:
+      outcome = ReadAndWrite(in, out, offset, end);
+      break;
+    }
+
+    if (outcome == Copied)
+      return;
+    if (outcome == Failed)
+      throw Exception("Failed to copy '" + source + "' to '" + dest + "'");
+
+    assert(strategy != ReadWrite);
+    strategy = static_cast<Strategy>(strategy + 1);
+
+    // Only a method which could not even begin is sure never to work
+    // between these devices; one which stopped part of the way may
+    // have met something peculiar to this file.
+    if (offset == start) {
+      scoped_lock lock(Mutex);
+      Strategies[devices] = strategy;
+    }
+  }
+}
+
+CopyEngine::Outcome CopyEngine::CloneFile(int in, int out)
+{
+#ifdef FICLONE
+  if (ioctl(out, FICLONE, in) == 0)
+    return Copied;
+#else
+  (void)in;
+  (void)out;
+#endif
+  return Unsupported;
+}
+
+CopyEngine::Outcome CopyEngine::CopyFileRange(int in, int out,
+					      unsigned long long& offset,
+					      unsigned long long end)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+  while (offset < end) {
+    loff_t  inOffset  = offset;
+    loff_t  outOffset = offset;
+    ssize_t len = copy_file_range(in, &inOffset, out, &outOffset,
+				  std::min<unsigned long long>
+				  (end - offset, COPY_KERNEL_CHUNK), 0);
+    if (len == -1) {
+      if (errno == EINTR)
+	continue;
+      if (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+	  errno == EOPNOTSUPP || errno == EBADF)
+	return Unsupported;
+      return Failed;
+    }
+
+    // Some filesystems, such as /proc, report nothing to copy for a
+    // file which is not empty, so the end is confirmed by a read.
+    if (len == 0) {
+      char    probe;
+      ssize_t got = pread(in, &probe, 1, offset);
+      if (got == 0)
+	return Copied;
+      if (got == -1)
+	return Failed;
+      return Unsupported;
+    }
+    offset += len;
+  }
+  return Copied;
+#else
+  (void)in;
+  (void)out;
+  (void)offset;
+  (void)end;
+  return Unsupported;
+#endif
+}
+
+CopyEngine::Outcome CopyEngine::SendFileData(int in, int out,
+					     unsigned long long& offset,
+					     unsigned long long end)
+{
+#if defined(HAVE_SYS_SENDFILE_H) && defined(HAVE_SENDFILE)
+  // sendfile writes at the output's file position.
+  if (lseek(out, offset, SEEK_SET) == -1)
+    return Failed;
+
+  while (offset < end) {
+    off_t   inOffset = offset;
+    ssize_t len	     = sendfile(out, in, &inOffset,
+				std::min<unsigned long long>
+				(end - offset, COPY_KERNEL_CHUNK));
+    if (len == -1) {
+      if (errno == EINTR)
+	continue;
+      if (errno == ENOSYS || errno == EINVAL)
+	return Unsupported;
+      return Failed;
+    }
+    if (len == 0)
+      return Copied;
+    offset += len;
+  }
+  return Copied;
+#else
+  (void)in;
+  (void)out;
+  (void)offset;
+  (void)end;
+  return Unsupported;
+#endif
+}
+
+CopyEngine::Outcome CopyEngine::ReadAndWrite(int in, int out,
+					     unsigned long long& offset,
+					     unsigned long long end)
+{
+  struct stat info;
+  if (fstat(in, &info) == -1)
+    return Failed;
+  unsigned long long length =
+    std::min<unsigned long long>(end, info.st_size);
+
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+  // Reserve the target's space in one piece before writing any of
+  // it.  Its length is still set by the writes, so a copy which fails
+  // part of the way cannot pass for a whole one.  This is only ever a
+  // help, and is skipped wherever it is not supported.
+  if (length > offset)
+    fallocate(out, FALLOC_FL_KEEP_SIZE, offset, length - offset);
+#endif
+
+#ifndef SINGLE_THREADED
+  if (length > offset + COPY_BUFFER_SIZE)
+    return Pipeline(in, out, offset, end);
+#endif
+
+  char *  buffer  = TakeBuffer();
+  Outcome outcome = Copied;
+
+  while (offset < end) {
+    std::size_t want =
+      std::min<unsigned long long>(end - offset, COPY_BUFFER_SIZE);
+
+    Block block;
+    block.Data	 = buffer;
+    block.Offset = offset;
+
+    outcome = ReadBlock(in, buffer, block.Length, offset, want);
+    if (outcome != Copied || block.Length == 0)
+      break;
+    outcome = WriteBlock(out, block);
+    if (outcome != Copied)
+      break;
+
+    offset += block.Length;
+    if (block.Length < want)
+      break;
+  }
+
+  int error = errno;
+  ReturnBuffer(buffer);
+  errno = error;
+  return outcome;
+}
+
+CopyEngine::Outcome CopyEngine::Pipeline(int in, int out,
+					 unsigned long long& offset,
+					 unsigned long long end)
+{
+  Transfer job(in, offset, end);
+  for (unsigned int i = 0; i < COPY_PIPELINE_DEPTH; i++)
+    job.Spare.push_back(TakeBuffer());
+
+  Reader	fill(&job);
+  boost::thread reader(fill);
+
+  Outcome outcome = Copied;
+  int	  error	  = 0;
+
+  for (;;) {
+    Block block;
+    {
+      scoped_lock lock(job.Mutex);
+      while (job.Ready.empty() && ! job.AtEnd)
+	job.Filled.wait(lock);
+      if (job.Ready.empty()) {
+	if (job.Error != 0) {
+	  outcome = Failed;
+	  error	  = job.Error;
+	}
+	break;
+      }
+      block = job.Ready.front();
+      job.Ready.pop_front();
+    }
+
+    outcome = WriteBlock(out, block);
+    if (outcome == Copied)
+      offset = block.Offset + block.Length;
+    else
+      error = errno;
+
+    scoped_lock lock(job.Mutex);
+    job.Spare.push_back(block.Data);
+    if (outcome != Copied)
+      job.Stopped = true;
+    job.Emptied.notify_all();
+    if (job.Stopped)
+      break;
+  }
+
+  reader.join();
+
+  // Anything read but never written goes back with the rest.
+  for (std::deque<Block>::iterator i = job.Ready.begin();
+       i != job.Ready.end();
+       i++)
+    job.Spare.push_back((*i).Data);
+  for (std::vector<char *>::iterator i = job.Spare.begin();
+       i != job.Spare.end();
+       i++)
+    ReturnBuffer(*i);
+
+  errno = error;
+  return outcome;
+}
+
+void CopyEngine::ReadAhead(Transfer& job)
+{
+  // Only this thread moves job.Offset, so it may read it unlocked.
+  for (;;) {
+    Block block;
+    {
+      scoped_lock lock(job.Mutex);
+      while (job.Spare.empty() && ! job.Stopped)
+	job.Emptied.wait(lock);
+      if (job.Stopped)
+	return;
+      block.Data = job.Spare.back();
+      job.Spare.pop_back();
+    }
+
+    std::size_t want =
+      std::min<unsigned long long>(job.End - job.Offset, COPY_BUFFER_SIZE);
+    block.Offset = job.Offset;
+
+    Outcome outcome = ReadBlock(job.In, block.Data, block.Length,
+				block.Offset, want);
+    int	    error   = errno;
+
+    scoped_lock lock(job.Mutex);
+    if (outcome == Copied && block.Length > 0) {
+      job.Ready.push_back(block);
+      job.Offset += block.Length;
+    } else {
+      job.Spare.push_back(block.Data);
+    }
+
+    if (outcome != Copied)
+      job.Error = error;
+    if (outcome != Copied || block.Length < want || job.Offset >= job.End)
+      job.AtEnd = true;
+    job.Filled.notify_one();
+    if (job.AtEnd)
+      return;
+  }
+}
+
+CopyEngine::Outcome CopyEngine::ReadBlock(int in, char * data,
+					  std::size_t& length,
+					  unsigned long long offset,
+					  std::size_t want)
+{
+  // A short read is not taken for the end of the file until a read
+  // returns nothing at all.
+  length = 0;
+  while (length < want) {
+    ssize_t len = pread(in, data + length, want - length, offset + length);
+    if (len == -1) {
+      if (errno == EINTR)
+	continue;
+      return Failed;
+    }
+    if (len == 0)
+      break;
+    length += len;
+  }
+  return Copied;
+}
+
+CopyEngine::Outcome CopyEngine::WriteBlock(int out, const Block& block)
+{
+  for (std::size_t written = 0; written < block.Length; ) {
+    ssize_t len = pwrite(out, block.Data + written, block.Length - written,
+			 block.Offset + written);
+    if (len == -1) {
+      if (errno == EINTR)
+	continue;
+      return Failed;
+    }
+    written += len;
+  }
+  return Copied;
+}
+
+char * CopyEngine::TakeBuffer()
+{
+  {
+    scoped_lock lock(Mutex);
+    if (! FreeBuffers.empty()) {
+      char * buffer = FreeBuffers.back();
+      FreeBuffers.pop_back();
+      return buffer;
+    }
+  }
+
+  // Aligned to a page, so that the kernel can move whole pages to and
+  // from it.
+  void * buffer;
+  if (posix_memalign(&buffer, sysconf(_SC_PAGESIZE), COPY_BUFFER_SIZE) != 0)
+    throw std::bad_alloc();
+
+  scoped_lock lock(Mutex);
+  AllBuffers.push_back(static_cast<char *>(buffer));
+  return static_cast<char *>(buffer);
+}
+
+void CopyEngine::ReturnBuffer(char * buffer)
+{
+  scoped_lock lock(Mutex);
+  FreeBuffers.push_back(buffer);
+}
+
+} // namespace Attic
@@ -0,0 +1,145 @@
+#ifndef _COPYENGINE_H
+#define _COPYENGINE_H
+
+#include "Path.h"
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <utility>
+
+#include <sys/types.h>
+
+#include <boost/thread.hpp>
+
+namespace Attic {
+
+// A CopyEngine copies the contents of one open file to another, doing
+// as little of the work itself as the systems involved allow.  In
+// order, it tries:
+//
+//   Clone      a reflink (FICLONE), which shares the source's blocks
+//              on filesystems such as btrfs and XFS, and is nearly free
+//   CopyRange  copy_file_range, which keeps the data in the kernel and
+//              may be offloaded to the filesystem or the device
+//   SendFile   sendfile, which also keeps it in the kernel
+//   ReadWrite  a loop of large reads and writes
+//
+// Whichever of these first works for a pair of devices is remembered,
+// so that those which are bound to fail there are not tried for every
+// file.  A method which gives up part of the way through is carried
+// on from where it stopped by the next one.
+//
+// If holes are to be kept, and the source has fewer blocks than its
+// length needs, only the extents which SEEK_DATA and SEEK_HOLE say
+// hold data are copied, and the rest of the target is left as holes.
+// A reflink keeps the holes of its own accord.
+//
+// When the data must pass through user space, the space it needs in
+// the target is reserved first, and anything longer than one buffer
+// is copied by two threads: a reader fills buffers while the caller
+// writes out those already filled, so that neither disk waits on the
+// other.  The buffers are page-aligned, and are kept by the engine to
+// be used again for the next file.
+
+#define COPY_BUFFER_SIZE    (4 * 1024 * 1024)
+#define COPY_PIPELINE_DEPTH 4		// buffers in flight for each copy
+#define COPY_TO_END	    (~0ULL)
+
+class CopyEngine
+{
+public:
+  typedef boost::mutex::scoped_lock scoped_lock;
+
+  enum Strategy {
+    Clone, CopyRange, SendFile, ReadWrite
+  };
+
+  ~CopyEngine();
+
+  // Copy all of in to out, which must be empty.  The names are only
+  // used to report errors.
+  void Copy(int in, int out, const Path& source, const Path& dest,
+	    bool keepHoles);
+
+private:
+  // Failed leaves the reason in errno.
+  enum Outcome {
+    Copied, Unsupported, Failed
+  };
+
+  typedef std::pair<dev_t, dev_t>	       DevicePair;
+  typedef std::map<DevicePair, Strategy> StrategyMap;
+
+  boost::mutex Mutex;
+  StrategyMap  Strategies;	// where to start, for each pair of devices
+
+  std::vector<char *> FreeBuffers;	// also guarded by Mutex
+  std::vector<char *> AllBuffers;
+
+  struct Block {
+    char *		Data;
+    std::size_t		Length;
+    unsigned long long	Offset;
+  };
+
+  // The state shared by the two threads of one copy.
+  struct Transfer {
+    int			In;
+    unsigned long long	Offset;		// where the next read begins
+    unsigned long long	End;
+
+    boost::mutex	Mutex;
+    boost::condition	Filled;		// a block was read, or the end reached
+    boost::condition	Emptied;	// a block was written, or writing stopped
+    std::deque<Block>	Ready;		// read, and waiting to be written
+    std::vector<char *> Spare;
+    bool		AtEnd;		// nothing more will be read
+    bool		Stopped;	// nothing more will be written
+    int			Error;		// errno of a failed read
+
+    Transfer(int _In, unsigned long long _Offset, unsigned long long _End)
+      : In(_In), Offset(_Offset), End(_End), AtEnd(false), Stopped(false),
+	Error(0) {}
+  };
+
+  class Reader {
+    Transfer * Job;
+  public:
+    Reader(Transfer * _Job) : Job(_Job) {}
+    void operator()() {
+      CopyEngine::ReadAhead(*Job);
+    }
+  };
+
+  void CopyExtent(Strategy& strategy, const DevicePair& devices,
+		  int in, int out, unsigned long long offset,
+		  unsigned long long end, const Path& source,
+		  const Path& dest);
+
+  // Each copies from offset up to end, or the end of the file, and
+  // leaves offset where it stopped.
+  Outcome CloneFile(int in, int out);
+  Outcome CopyFileRange(int in, int out, unsigned long long& offset,
+			unsigned long long end);
+  Outcome SendFileData(int in, int out, unsigned long long& offset,
+		       unsigned long long end);
+  Outcome ReadAndWrite(int in, int out, unsigned long long& offset,
+		       unsigned long long end);
+  Outcome Pipeline(int in, int out, unsigned long long& offset,
+		   unsigned long long end);
+
+  static Outcome ReadBlock(int in, char * data, std::size_t& length,
+			   unsigned long long offset, std::size_t want);
+  static Outcome WriteBlock(int out, const Block& block);
+  static void	 ReadAhead(Transfer& job);
+
+  char * TakeBuffer();
+  void	 ReturnBuffer(char * buffer);
+
+  friend class Reader;
+};
+
+} // namespace Attic
+
+#endif // _COPYENGINE_H
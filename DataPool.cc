@@ -1,4 +1,5 @@
 #include "DataPool.h"
+#include "ChecksumService.h"
 
 namespace Attic {
 
@@ -11,6 +12,41 @@ DataPool::~DataPool()
        i != Locations.end();
        i++)
     delete *i;
+
+  if (HashEngine)
+    delete HashEngine;
+}
+
+void DataPool::Initialize()
+{
+#ifndef SINGLE_THREADED
+  unsigned int readers = 0;
+  for (std::vector<Location *>::iterator i = Locations.begin();
+       i != Locations.end();
+       i++)
+    if ((*i)->ChecksumThreads > 0 && (*i)->UseChecksums &&
+	dynamic_cast<VolumeBroker *>((*i)->SiteBroker))
+      readers += (*i)->ChecksumThreads;
+
+  if (readers > 0 && ! HashEngine)
+    HashEngine = new ChecksumService
+      (readers, std::max(1U, boost::thread::hardware_concurrency()));
+#endif
+
+  for (std::vector<Location *>::iterator i = Locations.begin();
+       i != Locations.end();
+       i++) {
+    // A Scanner reads the whole tree ahead of us, with no bound on
+    // how far, which would defeat the purpose of streaming.
+    if (Streaming)
+      (*i)->ScanThreads = 0;
+#ifndef SINGLE_THREADED
+    if (HashEngine && (*i)->ChecksumThreads > 0 && (*i)->UseChecksums &&
+	dynamic_cast<VolumeBroker *>((*i)->SiteBroker))
+      (*i)->HashEngine = HashEngine;
+#endif
+    (*i)->Initialize();
+  }
 }
 
 void DataPool::ComputeChanges()
@@ -19,32 +55,57 @@ void DataPool::ComputeChanges()
     delete AllChanges;
   AllChanges = new ChangeSet;
 
+  CompareLocations(*AllChanges);
+}
+
+void DataPool::CompareLocations(ChangeSet& changes)
+{
+  // Every location is compared in the same walk over the ancestor,
+  // which also finds the conflicts between them.
+  std::vector<Location *> origins;
   for (std::vector<Location *>::iterator i = Locations.begin();
        i != Locations.end();
        i++)
     if (*i != CommonAncestor && (*i)->PreserveChanges)
-      AllChanges->CompareLocations(*i, CommonAncestor);
+      origins.push_back(*i);
+
+  if (! origins.empty())
+    changes.CompareLocations(origins, CommonAncestor);
+}
+
+unsigned int DataPool::OriginCount() const
+{
+  unsigned int count = 0;
+  for (std::vector<Location *>::const_iterator i = Locations.begin();
+       i != Locations.end();
+       i++)
+    if (*i != CommonAncestor && (*i)->PreserveChanges)
+      count++;
+  return count;
 }
 
 void DataPool::ResolveConflicts()
 {
-  for (ChangeSet::ChangesMap::iterator j = AllChanges->Changes.begin();
-       j != AllChanges->Changes.end();
+  for (ChangeSet::ConflictsArray::iterator j = AllChanges->Conflicts.begin();
+       j != AllChanges->Conflicts.end();
        j++)
-    if ((*j).second->Next)
-      std::cout << "There are conflicts!" << std::endl;
+    std::cout << "There are conflicts: " << *j << std::endl;
 }
 
 void DataPool::ApplyChanges(MessageLog& log)
 {
-  if (! AllChanges)
-    return;
+  if (AllChanges)
+    ApplyChangeSet(log, *AllChanges);
+  SyncLocations();
+}
 
+void DataPool::ApplyChangeSet(MessageLog& log, ChangeSet& changes)
+{
   // jww (2006-11-11): Move this logic in ChangeSet.cc
   ChangeSet::ChangesArray changesArray;
 
-  for (ChangeSet::ChangesMap::iterator i = AllChanges->Changes.begin();
-       i != AllChanges->Changes.end();
+  for (ChangeSet::ChangesMap::iterator i = changes.Changes.begin();
+       i != changes.Changes.end();
        i++)
     changesArray.push_back((*i).second);
 
@@ -84,15 +145,179 @@ void DataPool::ApplyChanges(MessageLog& log)
 	 j != thisChangesArray.end();
 	 j++)
       for (StateChange * ptr = *j; ptr; ptr = ptr->Next)
-	if (LoggingOnly) {
-	  ptr->Report(log);
-	} else {
-	  ChangeSet * changeSet = (*i)->CurrentChanges;
-	  if (! changeSet && ! (*i)->PreserveChanges)
-	    changeSet = AllChanges;
-	  (*i)->ApplyChange(&log, *ptr, *changeSet);
-	}
+	ApplyChange(log, *i, *ptr, changes);
+  }
+}
+
+void DataPool::ApplyChange(MessageLog& log, Location * target,
+			   StateChange& change, ChangeSet& changes)
+{
+  if (LoggingOnly) {
+    change.Report(log);
+  } else {
+    ChangeSet * changeSet = target->CurrentChanges;
+    if (! changeSet && ! target->PreserveChanges)
+      changeSet = &changes;
+    target->ApplyChange(&log, change, *changeSet);
+  }
+}
+
+void DataPool::PipelineChanges(MessageLog& log)
+{
+#ifdef SINGLE_THREADED
+  ComputeChanges();
+  ApplyChanges(log);
+#else
+  if (AllChanges)
+    delete AllChanges;
+  AllChanges = new ChangeSet;
+  AllChanges->ChangeQueueLimit = ChangeQueueLimit;
+
+  ApplyError.clear();
+  boost::thread applier(ChangeApplier(this, log));
+
+  try {
+    CompareLocations(*AllChanges);
+  }
+  catch (...) {
+    AllChanges->CloseQueue();
+    applier.join();
+    throw;
+  }
+
+  AllChanges->CloseQueue();
+  applier.join();
+
+  if (! ApplyError.empty())
+    throw Exception(ApplyError);
+  SyncLocations();
+#endif
+}
+
+void DataPool::ConsumeChanges(MessageLog& log)
+{
+  // Changes are applied in the order they were posted, which already
+  // puts a directory's creation before its contents, and the removal
+  // of its contents before its own.  Only updates to the attributes
+  // of directories must wait until the end, since the changes made
+  // within a directory would otherwise disturb them again.
+  ChangeSet::ChangesArray directoryAttrs;
+
+  try {
+    unsigned int cursor = 0;
+    while (StateChange * change = AllChanges->NextChange(cursor)) {
+      if (change->ChangeKind == StateChange::UpdateAttrs &&
+	  change->Item->IsDirectory()) {
+	directoryAttrs.push_back(change);
+	continue;
+      }
+
+      for (std::vector<Location *>::iterator i = Locations.begin();
+	   i != Locations.end();
+	   i++) {
+	if (*i == change->Item->Repository)
+	  continue;
+
+	if (change->ChangeKind == StateChange::Add && CommonAncestor)
+	  change->Duplicates = CommonAncestor->ExistsAtLocation(change->Item);
+
+	ApplyChange(log, *i, *change, *AllChanges);
+      }
+    }
+
+    for (ChangeSet::ChangesArray::iterator j = directoryAttrs.begin();
+	 j != directoryAttrs.end();
+	 j++)
+      for (std::vector<Location *>::iterator i = Locations.begin();
+	   i != Locations.end();
+	   i++)
+	if (*i != (*j)->Item->Repository)
+	  ApplyChange(log, *i, **j, *AllChanges);
+  }
+  catch (const std::exception& err) {
+    ApplyError = err.what();
+    AllChanges->AbandonQueue();
+  }
+}
+
+void DataPool::StreamChanges(MessageLog& log)
+{
+  if (OriginCount() > 1) {
+    ComputeChanges();
+    ApplyChanges(log);
+    return;
   }
+
+  for (std::vector<Location *>::iterator i = Locations.begin();
+       i != Locations.end();
+       i++) {
+    if (*i == CommonAncestor || ! (*i)->PreserveChanges)
+      continue;
+
+    FileInfo * root	    = (*i)->Root();
+    FileInfo * ancestorRoot = CommonAncestor ? CommonAncestor->Root() : NULL;
+
+    ChangeSet::PendingArray pending;
+    {
+      ChangeSet changes;
+      changes.Shallow = true;
+      changes.CompareFiles(root, ancestorRoot);
+      ApplyChangeSet(log, changes);
+      pending.swap(changes.Pending);
+    }
+
+    for (ChangeSet::PendingArray::iterator j = pending.begin();
+	 j != pending.end();
+	 j++)
+      StreamDirectory(log, *j);
+  }
+  SyncLocations();
+}
+
+void DataPool::SyncLocations()
+{
+  // Changes may be held back by a broker until now, so that their
+  // cost can be shared; none of them is certain before this returns.
+  if (! LoggingOnly)
+    for (std::vector<Location *>::iterator i = Locations.begin();
+	 i != Locations.end();
+	 i++)
+      (*i)->Sync();
+}
+
+void DataPool::StreamDirectory(MessageLog& log,
+			       ChangeSet::PendingDirectory& dir)
+{
+  // Apply the changes to this directory's own entries before visiting
+  // its subdirectories, so that each directory exists before anything
+  // is copied into it.
+  ChangeSet::PendingArray pending;
+  {
+    ChangeSet changes;
+    changes.Shallow = true;
+    changes.CompareChildren(dir);
+    ApplyChangeSet(log, changes);
+    pending.swap(changes.Pending);
+  }
+
+  for (ChangeSet::PendingArray::iterator i = pending.begin();
+       i != pending.end();
+       i++)
+    StreamDirectory(log, *i);
+
+  // A database whose journal changed a directory cannot read it back
+  // as it is now, so its children are kept.
+  if (dir.Entry->Repository->SiteBroker->CanReleaseChildren(*dir.Entry))
+    dir.Entry->ReleaseChildren();
+  if (dir.Ancestor &&
+      dir.Ancestor->Repository->SiteBroker->CanReleaseChildren(*dir.Ancestor))
+    dir.Ancestor->ReleaseChildren();
+
+  // Removing the directory, or setting its attributes, can only be
+  // done after everything within it has been taken care of.
+  ChangeSet changes;
+  changes.FinishDirectory(dir);
+  ApplyChangeSet(log, changes);
 }
 
 } // namespace Attic
@@ -26,15 +26,32 @@ public:
 
   bool LoggingOnly;
 
-  DataPool() : CommonAncestor(NULL), AllChanges(NULL), LoggingOnly(false) {}
+  // If Streaming is true, changes are computed and applied one
+  // directory at a time, and each directory's entries are freed once
+  // it is done, rather than building the complete tree of every
+  // Location first.  Memory use is then bounded by the depth of the
+  // tree times the width of its directories.
+  bool Streaming;
+
+  // If Pipelined is true, changes are applied by another thread while
+  // they are still being computed, instead of after all of them are
+  // known.  The comparer may run at most ChangeQueueLimit changes
+  // ahead of that thread.
+  bool Pipelined;
+  unsigned int ChangeQueueLimit;
+
+  // The one ChecksumService which every Location hashing ahead shares,
+  // so that there is one hasher per core in all, rather than per core
+  // for each of them.  Its readers are those every Location asked for.
+  ChecksumService * HashEngine;
+
+  DataPool()
+    : CommonAncestor(NULL), AllChanges(NULL), LoggingOnly(false),
+      Streaming(false), Pipelined(false), ChangeQueueLimit(1024),
+      HashEngine(NULL) {}
   ~DataPool();
 
-  void Initialize() {
-    for (std::vector<Location *>::iterator i = Locations.begin();
-	 i != Locations.end();
-	 i++)
-      (*i)->Initialize();
-  }
+  void Initialize();
 
   Location * AddLocation(Broker * broker) {
     Locations.push_back(new Location(broker));
@@ -48,6 +65,42 @@ public:
   void ComputeChanges();
   void ResolveConflicts();
   void ApplyChanges(MessageLog& log);
+  void ApplyChangeSet(MessageLog& log, ChangeSet& changes);
+
+  // How many Locations' changes are to be carried to the others.
+  // Only with one of them can changes be streamed: each would
+  // otherwise be compared with the ancestor by itself, and its
+  // changes applied before the next is compared, so that the next
+  // one's older copy of an entry changed by both would look like a
+  // change of its own, and overwrite it with no conflict seen.
+  unsigned int OriginCount() const;
+
+  void StreamChanges(MessageLog& log);
+  void StreamDirectory(MessageLog& log, ChangeSet::PendingDirectory& dir);
+
+  void PipelineChanges(MessageLog& log);
+
+private:
+  std::string ApplyError;
+
+  class ChangeApplier {
+    DataPool *	Pool;
+    MessageLog& Log;
+  public:
+    ChangeApplier(DataPool * _Pool, MessageLog& _Log)
+      : Pool(_Pool), Log(_Log) {}
+    void operator()() {
+      Pool->ConsumeChanges(Log);
+    }
+  };
+
+  void CompareLocations(ChangeSet& changes);
+  void ConsumeChanges(MessageLog& log);
+  void SyncLocations();
+  void ApplyChange(MessageLog& log, Location * target, StateChange& change,
+		   ChangeSet& changes);
+
+  friend class ChangeApplier;
 };
 
 } // namespace Attic
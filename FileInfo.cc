@@ -1,28 +1,175 @@
 #include "FileInfo.h"
 #include "Location.h"
+#include "Scanner.h"
+
+#include <cstring>
+#include <algorithm>
 
 namespace Attic {
 
+NameTable FileInfo::Names;
+
+// Entries which do not belong to a Location come from here.
+static Arena DefaultArena;
+
+void * FileInfo::operator new(std::size_t size, Location * repository)
+{
+  // Entries must be small enough for Arena::Of to find their arena
+  // again when they are deleted.
+  assert(size <= ARENA_MAX_BLOCK);
+
+  Arena * arena = repository ? repository->NodeArena : &DefaultArena;
+  return arena->Allocate(size);
+}
+
+void * FileInfo::operator new(std::size_t size)
+{
+  return operator new(size, static_cast<Location *>(NULL));
+}
+
+void FileInfo::operator delete(void * ptr, std::size_t size)
+{
+  if (ptr)
+    Arena::Of(ptr)->Deallocate(ptr, size);
+}
+
+void FileInfo::operator delete(void *, Location *)
+{
+  // This is only called if a constructor throws, and is not told the
+  // size of the block, so it cannot be put on the right free list.
+  // It is left unused instead, which is safe: the block belongs to a
+  // slab of the arena, and is freed with it when the Location goes
+  // away, not lost to the process.  Nor is much wasted, since the
+  // constructors only throw when out of memory or out of name ids,
+  // and either one abandons the whole run.
+}
+
+// Up to this many entries may be left unsorted before FindChild
+// merges them in, rather than searching them one by one.
+#define CHILDREN_UNSORTED_MAX 16
+
+static int CompareNames(const char * left, std::size_t leftLength,
+			const char * right, std::size_t rightLength)
+{
+  // The same order as std::string::compare
+  int result = std::memcmp(left, right, std::min(leftLength, rightLength));
+  if (result != 0)
+    return result;
+  return leftLength < rightLength ? -1 : (leftLength > rightLength ? 1 : 0);
+}
+
+namespace {
+  struct NameOrder {
+    bool operator()(const FileInfo * left, const FileInfo * right) const {
+      return left->CompareName(*right) < 0;
+    }
+  };
+}
+
+void FileInfo::ChildrenArray::Merge()
+{
+  if (SortedCount == Entries.size())
+    return;
+
+  iterator middle = Entries.begin() + SortedCount;
+  std::sort(middle, Entries.end(), NameOrder());
+  std::inplace_merge(Entries.begin(), middle, Entries.end(), NameOrder());
+  SortedCount = Entries.size();
+
+  // Names are interned, so equal names have equal ids.
+  for (size_type i = 1; i < Entries.size(); i++)
+    assert(Entries[i - 1]->NameId() != Entries[i]->NameId());
+}
+
+FileInfo::ChildrenArray::size_type
+FileInfo::ChildrenArray::LowerBound(const char * name, std::size_t length) const
+{
+  size_type low = 0, high = SortedCount;
+  while (low < high) {
+    size_type middle = low + (high - low) / 2;
+    NameTable::name_id_t id = Entries[middle]->NameId();
+    if (CompareNames(Names.Data(id), Names.Length(id), name, length) < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+FileInfo * FileInfo::ChildrenArray::Find(const char * name,
+					 std::size_t length)
+{
+  if (Entries.size() - SortedCount > CHILDREN_UNSORTED_MAX)
+    Merge();
+
+  size_type index = LowerBound(name, length);
+  if (index < SortedCount) {
+    NameTable::name_id_t id = Entries[index]->NameId();
+    if (CompareNames(Names.Data(id), Names.Length(id), name, length) == 0)
+      return Entries[index];
+  }
+
+  for (index = SortedCount; index < Entries.size(); index++) {
+    NameTable::name_id_t id = Entries[index]->NameId();
+    if (CompareNames(Names.Data(id), Names.Length(id), name, length) == 0)
+      return Entries[index];
+  }
+  return NULL;
+}
+
+void FileInfo::ChildrenArray::Insert(FileInfo * entry)
+{
+  if (Listing) {
+    Entries.push_back(entry);
+    return;
+  }
+
+  NameTable::name_id_t id = entry->NameId();
+  size_type index = LowerBound(Names.Data(id), Names.Length(id));
+  assert(index == Entries.size() || Entries[index]->NameId() != id);
+
+  Entries.insert(Entries.begin() + index, entry);
+  SortedCount++;
+}
+
+void FileInfo::ChildrenArray::Erase(FileInfo * entry)
+{
+  NameTable::name_id_t id = entry->NameId();
+
+  size_type index = LowerBound(Names.Data(id), Names.Length(id));
+  if (index < SortedCount && Entries[index] == entry) {
+    Entries.erase(Entries.begin() + index);
+    SortedCount--;
+    return;
+  }
+
+  iterator i = std::find(Entries.begin() + SortedCount, Entries.end(), entry);
+  if (i != Entries.end())
+    Entries.erase(i);
+}
+
 FileInfo::~FileInfo()
 {
-  if (Children)
-    for (ChildrenMap::iterator i = Children->begin();
-	 i != Children->end();
-	 i++)
-      delete (*i).second;
+  ReleaseChildren();
 
   if (Parent)
     Parent->RemoveChild(this);
 
   if (IsTempFile())
     Delete();
+
+  delete extra;
 }
 
 void FileInfo::SetDetails(const Path& _FullName, FileInfo * _Parent,
 			  Location * _Repository)
 {
-  FullName = _FullName;
-  Name     = Path::GetFileName(FullName);
+  // An entry with a parent keeps only the last part of its name, so
+  // callers may pass just that; one without keeps the whole of it.
+  if (_Parent)
+    nameId = Names.Intern(Path::GetFileName(_FullName));
+  else
+    nameId = Names.Intern(_FullName);
 
   if (Parent)
     Parent->RemoveChild(this);
@@ -32,39 +179,114 @@ void FileInfo::SetDetails(const Path& _FullName, FileInfo * _Parent,
     Parent->InsertChild(this);
 
   Repository = _Repository;
+}
+
+int FileInfo::CompareName(const FileInfo& other) const
+{
+  if (nameId == other.nameId)
+    return 0;
+  return CompareNames(Names.Data(nameId), Names.Length(nameId),
+		      Names.Data(other.nameId), Names.Length(other.nameId));
+}
+
+void FileInfo::AppendFullName(std::string& buf) const
+{
+  std::size_t length = 0;
+  for (const FileInfo * entry = this; entry; entry = entry->Parent)
+    length += Names.Length(entry->nameId) + 1;
+
+  // Fill in the names from the end, working up toward the root; the
+  // empty name of the root contributes nothing.
+  std::size_t start = buf.length();
+  buf.resize(start + length);
+
+  std::size_t end = start + length;
+  for (const FileInfo * entry = this; entry; entry = entry->Parent) {
+    std::size_t len = Names.Length(entry->nameId);
+    if (len == 0)
+      continue;
+    end -= len;
+    std::memcpy(&buf[end], Names.Data(entry->nameId), len);
+    buf[--end] = '/';
+  }
+
+  // Drop the separator in front of the first name, and whatever room
+  // the root did not use.
+  buf.erase(start, end - start + (end < start + length ? 1 : 0));
+}
+
+Path FileInfo::FullName() const
+{
+  Path name;
+  AppendFullName(name);
+  return name;
+}
+
+Path FileInfo::Pathname() const
+{
   if (Repository)
-    Pathname = Repository->SiteBroker->FullPath(FullName);
+    return Repository->SiteBroker->FullPath(FullName());
   else
-    Pathname.clear();
+    return Path();
 }
 
-const md5sum_t& FileInfo::Checksum() const
+const checksum_t& FileInfo::Checksum() const
+{
+  if (HasFlags(FILEINFO_READCSUM))
+    return extra->csum;
+  return Checksum(Repository->ChecksumAlgorithmFor(Length()));
+}
+
+const checksum_t& FileInfo::Checksum(checksum_t::Algorithm algorithm) const
 {
   if (! IsRegularFile())
     throw Exception("Attempt to calc checksum of non-file '" + Moniker() + "'");
 
-  if (! HasFlags(FILEINFO_READCSUM)) {
-    Repository->SiteBroker->ComputeChecksum(FullName, csum);
+  if (! HasFlags(FILEINFO_READCSUM) || extra->csum.Kind() != algorithm) {
+    ExtraInfo& info(Extra());
+    delete info.Chunks;
+    info.Chunks = NULL;
+
+    if (checksum_t::IsTree(algorithm))
+      info.Chunks = new std::vector<checksum_t>;
+    Repository->SiteBroker->ComputeChecksum(Pathname(), algorithm,
+					    info.csum, info.Chunks);
     const_cast<FileInfo&>(*this).SetFlags(FILEINFO_READCSUM);
   }
-  return csum;
+  return extra->csum;
 }
 
-md5sum_t FileInfo::CurrentChecksum() const
+const std::vector<checksum_t>&
+FileInfo::ChunkChecksums(checksum_t::Algorithm algorithm) const
+{
+  assert(checksum_t::IsTree(algorithm));
+
+  // A checksum which was read from a database stored before its
+  // chunks were known comes without them, so those mean reading the
+  // file again.
+  if (HasFlags(FILEINFO_READCSUM) && extra->csum.Kind() == algorithm &&
+      ! extra->Chunks)
+    const_cast<FileInfo&>(*this).ClearFlags(FILEINFO_READCSUM);
+
+  Checksum(algorithm);
+  return *extra->Chunks;
+}
+
+checksum_t FileInfo::CurrentChecksum(checksum_t::Algorithm algorithm) const
 {
   if (! IsRegularFile())
     throw Exception("Attempt to calc checksum of non-file '" + Moniker() + "'");
 
-  md5sum_t temp;
-  Repository->SiteBroker->ComputeChecksum(FullName, temp);
+  checksum_t temp;
+  Repository->SiteBroker->ComputeChecksum(Pathname(), algorithm, temp);
   return temp;
 }
 
 void * FileInfo::GetAttribute(const std::string& name) const
 {
-  if (Attributes) { 
-    AttributesMap::const_iterator i = Attributes->find(name);
-    if (i != Attributes->end())
+  if (extra && extra->Attributes) {
+    AttributesMap::const_iterator i = extra->Attributes->find(name);
+    if (i != extra->Attributes->end())
       return (*i).second;
   }
   return NULL;
@@ -72,12 +294,16 @@ void * FileInfo::GetAttribute(const std::string& name) const
 
 void FileInfo::SetAttribute(const std::string& name, void * data)
 {
-  AttributesMap::iterator i = Attributes->find(name);
-  if (i != Attributes->end()) {
+  AttributesMap *& attributes(Extra().Attributes);
+  if (! attributes)
+    attributes = new AttributesMap;
+
+  AttributesMap::iterator i = attributes->find(name);
+  if (i != attributes->end()) {
     (*i).second = data;
   } else {
     std::pair<AttributesMap::iterator, bool> result =
-      Attributes->insert(AttributesPair(name, data));
+      attributes->insert(AttributesPair(name, data));
     assert(result.second);
   }
 }
@@ -92,7 +318,10 @@ void FileInfo::ReadAttributes()
 
 bool FileInfo::Exists() const
 {
-  const_cast<FileInfo&>(*this).ReadAttributes();
+  // Entries which came from a directory listing are already known to
+  // exist, without having to read their attributes.
+  if (! HasFlags(FILEINFO_EXISTS))
+    const_cast<FileInfo&>(*this).ReadAttributes();
   return HasFlags(FILEINFO_EXISTS);
 }
 
@@ -130,7 +359,7 @@ void FileInfo::Move(const Path& dest)
 
 void FileInfo::Copy(const FileInfo& source)
 {
-  Repository->SiteBroker->Copy(source, FullName);
+  Repository->SiteBroker->Copy(source, FullName());
 
   CopyAttributes(source);
 }
@@ -142,7 +371,7 @@ void FileInfo::CopyAttributes(const FileInfo& source)
   if (source.HasFlags(FILEINFO_READCSUM))
     SetChecksum(source.Checksum());
 
-  source.CopyAttributes(FullName);
+  source.CopyAttributes(FullName());
 }
 
 void FileInfo::CopyAttributes(const Path& dest) const
@@ -150,66 +379,124 @@ void FileInfo::CopyAttributes(const Path& dest) const
   Repository->SiteBroker->CopyAttributes(*this, dest);
 }
 
-FileInfo::ChildrenMap::size_type FileInfo::ChildrenSize() const
+bool FileInfo::ChecksumKnown() const
+{
+  return (HasFlags(FILEINFO_READCSUM) ||
+	  Repository->SiteBroker->ComputesChecksums());
+}
+
+FileInfo::ChildrenArray::size_type FileInfo::ChildrenSize() const
 {
   if (! IsDirectory())
     throw Exception("Attempt to call ChildrenSize on a non-directory");
 
-  if (! Children) {
-    Children = new ChildrenMap;
-    Repository->SiteBroker->ReadDirectory(const_cast<FileInfo&>(*this));
-  }
-  return Children->size();
+  ReadChildren();
+  return Children()->size();
 }
 
-FileInfo::ChildrenMap::iterator FileInfo::ChildrenBegin() const
+FileInfo::ChildrenArray::iterator FileInfo::ChildrenBegin() const
 {
   if (! IsDirectory())
     throw Exception("Attempt to call ChildrenBegin on a non-directory");
 
-  if (! Children) {
-    Children = new ChildrenMap;
+  ReadChildren();
+  return Children()->begin();
+}
+
+void FileInfo::ReadChildren() const
+{
+  // If this directory is being read by the Location's scan engine,
+  // wait until it has been handed to us.
+  if (Repository && Repository->ScanEngine &&
+      Repository->ScanEngine->WaitFor(*this))
+    return;
+
+  if (! Children())
+    ListChildren();
+}
+
+void FileInfo::ListChildren() const
+{
+  CreateChildren();
+
+  ChildrenArray * children = extra->Children;
+  children->BeginListing();
+  try {
     Repository->SiteBroker->ReadDirectory(const_cast<FileInfo&>(*this));
   }
-  return Children->begin();
+  catch (...) {
+    children->EndListing();
+    throw;
+  }
+  children->EndListing();
+}
+
+void FileInfo::ReleaseChildren()
+{
+  ChildrenArray * children = Children();
+  if (! children)
+    return;
+
+  // Detach each child first, so that it does not try to remove
+  // itself from the array we are walking.
+  for (ChildrenArray::iterator i = children->begin();
+       i != children->end();
+       i++) {
+    (*i)->Parent = NULL;
+    delete *i;
+  }
+
+  Arena * arena = children->GetArena();
+  children->~ChildrenArray();
+  if (arena)
+    arena->Deallocate(children, sizeof(ChildrenArray));
+  else
+    ::operator delete(children);
+  extra->Children = NULL;
+}
+
+void FileInfo::CreateChildren() const
+{
+  assert(! Children());
+
+  Arena * arena = Repository ? Repository->NodeArena : NULL;
+  void *  mem	= (arena ? arena->Allocate(sizeof(ChildrenArray)) :
+		   ::operator new(sizeof(ChildrenArray)));
+  Extra().Children = new (mem) ChildrenArray(arena);
 }
 
 FileInfo * FileInfo::CreateChild(const std::string& name)
 {
   assert(! name.empty());
-  return Repository->SiteBroker->CreateFileInfo(Path::Combine(FullName, name), this);
+  return Repository->SiteBroker->CreateFileInfo(name, this);
 }
 
 void FileInfo::InsertChild(FileInfo * entry)
 {
-  if (! Children)
-    Children = new ChildrenMap;
+  if (! Children())
+    CreateChildren();
 
-  std::pair<ChildrenMap::iterator, bool> result =
-    Children->insert(ChildrenPair(entry->Name, entry));
-  assert(result.second);
+  extra->Children->Insert(entry);
 }
 
 void FileInfo::RemoveChild(FileInfo * child)
 {
-  if (Children)
-    Children->erase(child->Name);
+  if (Children())
+    extra->Children->Erase(child);
 }
 
 FileInfo * FileInfo::FindChild(const std::string& name)
 {
   assert(! name.empty());
 
-  if (! Children)
+  // A directory whose children have not been read yet is read now,
+  // unless its broker can find the child without that.
+  if (! Children() &&
+      (! Repository->SiteBroker->ListsToFindChild() || ! IsDirectory()))
     return NULL;
 
-  for (ChildrenMap::iterator i = ChildrenBegin();
-       i != ChildrenEnd();
-       i++)
-    if ((*i).first == name)
-      return (*i).second;
-
-  return NULL;
+  ReadChildren();
+  return extra->Children->Find(name.data(), name.length());
 }
 
 FileInfo * FileInfo::FindOrCreateChild(const std::string& name)
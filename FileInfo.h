@@ -3,59 +3,105 @@
 
 #include "Path.h"
 #include "DateTime.h"
+#include "Arena.h"
+#include "NameTable.h"
 
 #include <string>
 #include <iostream>
 #include <map>
 #include <deque>
+#include <vector>
 
 #include <assert.h>
 
 #include "error.h"
-#include "md5.h"
+#include "Checksum.h"
 
 namespace Attic {
 
-class md5sum_t
-{
-public:
-  md5_byte_t digest[16];
-
-  bool operator==(const md5sum_t& other) const {
-    return memcmp(digest, other.digest, sizeof(md5_byte_t) * 16) == 0;
-  }
-  bool operator!=(const md5sum_t& other) const {
-    return ! (*this == other);
-  }
-  bool operator<(const md5sum_t& other) const {
-    return memcmp(digest, other.digest, sizeof(md5_byte_t) * 16) < 0;
-  }
-
-  friend inline std::ostream& operator<<(std::ostream& out, const md5sum_t& md5) {
-    for (int i = 0; i < 16; i++) {
-      out.fill('0');
-      out << std::hex << (int)md5.digest[i];
-    }
-    return out;
-  }
-};
-
 #define FILEINFO_NOFLAGS   0x00
 #define FILEINFO_EXISTS	   0x01 // file exists on disk
 #define FILEINFO_READATTR  0x02 // attributes have been read
 #define FILEINFO_READCSUM  0x04 // checksum has been computed
 #define FILEINFO_VIRTUAL   0x08 // file is a virtual directory
 #define FILEINFO_TEMPFILE  0x10 // delete upon destruction
-#define FILEINFO_HANDLED   0x20
 #define FILEINFO_ALLFLAGS  0xff
 
 class Location;
 class FileInfo
 {
 public:
-  typedef std::map<std::string, FileInfo *>  ChildrenMap;
-  typedef std::pair<std::string, FileInfo *> ChildrenPair;
-  typedef unsigned char			     flags_t;
+  typedef unsigned char flags_t;
+
+  // The entries of a directory are kept in a flat vector sorted by
+  // name, which is far more compact than a tree and searchable by
+  // bisection.  Entries read from a listing arrive in no particular
+  // order, so they are appended to an unsorted tail, which is sorted
+  // and merged in as soon as the listing is complete (or sooner, if
+  // it grows too long to search linearly).  Any added afterwards are
+  // put straight into place, so the array is always in order when it
+  // is iterated, and reading it never changes it.
+  //
+  // There is no lock.  A directory is listed by a single thread,
+  // either the one which first asks for its children or a Scanner
+  // thread, which hands it over through Scanner::WaitFor only once
+  // it is complete.  From then on, children are only added or
+  // removed by the thread comparing the tree; entries passed on to
+  // be applied through ChangeSet::PostChange are not changed again.
+  class ChildrenArray
+  {
+  public:
+    typedef std::vector<FileInfo *, ArenaAllocator<FileInfo *> > Vector;
+    typedef Vector::iterator	 iterator;
+    typedef Vector::const_iterator const_iterator;
+    typedef Vector::size_type	 size_type;
+
+    explicit ChildrenArray(Arena * arena)
+      : Entries(ArenaAllocator<FileInfo *>(arena)), SortedCount(0),
+	Listing(false) {}
+
+    // Only in order by name once the listing is complete.
+    iterator begin() {
+      assert(Listing || SortedCount == Entries.size());
+      return Entries.begin();
+    }
+    iterator end() {
+      return Entries.end();
+    }
+    size_type size() const {
+      return Entries.size();
+    }
+    bool empty() const {
+      return Entries.empty();
+    }
+    Arena * GetArena() const {
+      return Entries.get_allocator().Pool;
+    }
+
+    // No two children may have the same name.  This is checked as
+    // each entry is added, or, for those read while listing, when
+    // they are merged in.
+    void       Insert(FileInfo * entry);
+    void       Erase(FileInfo * entry);
+    FileInfo * Find(const char * name, std::size_t length);
+
+    // Bracket the reading of the directory's listing.
+    void BeginListing() {
+      Listing = true;
+    }
+    void EndListing() {
+      Merge();
+      Listing = false;
+    }
+
+  private:
+    Vector    Entries;
+    size_type SortedCount;	// the sorted prefix of Entries
+    bool      Listing;
+
+    void      Merge();
+    size_type LowerBound(const char * name, std::size_t length) const;
+  };
 
   enum Kind {
     Nonexistant,
@@ -73,35 +119,90 @@ public:
   typedef std::map<std::string, void *>  AttributesMap;
   typedef std::pair<std::string, void *> AttributesPair;
 
+  // Whatever most entries never need is kept out of line, and only
+  // allocated the first time it is wanted.  A derived class with
+  // more of that kind of data overrides CreateExtra.
+  struct ExtraInfo {
+    ChildrenArray * Children;	// directories, once they have been read
+    AttributesMap * Attributes;
+    checksum_t	    csum;	// only valid with FILEINFO_READCSUM
+    std::vector<checksum_t> * Chunks; // csum's chunks, if it is a tree
+
+    ExtraInfo() : Children(NULL), Attributes(NULL), Chunks(NULL) {}
+    virtual ~ExtraInfo() {
+      delete Attributes;
+      delete Chunks;
+    }
+  };
+
+  // The names of all entries, whatever their Location.
+  static NameTable Names;
+
 protected:
-  mutable flags_t	  flags;
-  mutable md5sum_t	  csum;
-  mutable ChildrenMap *	  Children; // This is dynamically generated on-demand
-  mutable AttributesMap * Attributes; // This is only created if necessary
+  mutable ExtraInfo * extra;
 
 public:
   Location *  Repository;
   FileInfo *  Parent;		// This is computed during load/read
-  Path	      FullName;		// This is computed during load/read
-  std::string Name;
-  Path        Pathname;		// The current literal location on disk
 
+protected:
+  NameTable::name_id_t nameId;
+  mutable flags_t      flags;
+
+  void ReadChildren() const;
+  void CreateChildren() const;
+  void ListChildren() const;
+
+  ChildrenArray * Children() const {
+    return extra ? extra->Children : NULL;
+  }
+  ExtraInfo& Extra() const {
+    if (! extra)
+      extra = CreateExtra();
+    return *extra;
+  }
+  virtual ExtraInfo * CreateExtra() const {
+    return new ExtraInfo;
+  }
+
+public:
   explicit FileInfo(Location * _Repository = NULL)
-    : flags(FILEINFO_READATTR | FILEINFO_VIRTUAL),
-      Children(NULL), Repository(_Repository), Parent(NULL) {}
+    : extra(NULL), Repository(_Repository), Parent(NULL), nameId(0),
+      flags(FILEINFO_READATTR | FILEINFO_VIRTUAL) {}
 
   explicit FileInfo(const Path& _FullName, FileInfo * _Parent = NULL,
 		    Location * _Repository = NULL)
-    : flags(FILEINFO_NOFLAGS),
-      Children(NULL), Repository(NULL), Parent(NULL) {
+    : extra(NULL), Repository(NULL), Parent(NULL), nameId(0),
+      flags(FILEINFO_NOFLAGS) {
     SetDetails(_FullName, _Parent, _Repository);
   }
 
   virtual ~FileInfo();
 
+  // Entries are allocated from their Location's arena, if they have
+  // one: new (repository) PosixFileInfo(...).
+  static void * operator new(std::size_t size);
+  static void * operator new(std::size_t size, Location * repository);
+  static void	operator delete(void * ptr, Location * repository);
+  static void	operator delete(void * ptr, std::size_t size);
+
   void SetDetails(const Path& _FullName, FileInfo * _Parent = NULL,
 		  Location * _Repository = NULL);
 
+  // Only the name of an entry is stored; its full name, relative to
+  // the root of its Location, and its current literal location on
+  // disk are worked out from its parents whenever they are asked for.
+  NameTable::name_id_t NameId() const {
+    return nameId;
+  }
+  std::string Name() const {
+    return Names.Lookup(nameId);
+  }
+  int CompareName(const FileInfo& other) const;
+  Path FullName() const;
+  Path Pathname() const;
+  void AppendFullName(std::string& buf) const;
+
   virtual void Reset() {
     flags = FILEINFO_NOFLAGS;
   }
@@ -118,21 +219,65 @@ public:
     return flags & _flags;
   }
 
-  const md5sum_t& Checksum() const;
-  void SetChecksum(const md5sum_t& _csum) {
-    csum = _csum;
+  // The checksum of this file's contents as it is known: either as
+  // it was read or set, or else computed by the algorithm the
+  // Location uses for files of its length.  Given an algorithm, it is
+  // computed afresh if the one known was made by a different
+  // algorithm.
+  const checksum_t& Checksum() const;
+  const checksum_t& Checksum(checksum_t::Algorithm algorithm) const;
+  void SetChecksum(const checksum_t& _csum) {
+    Extra().csum = _csum;
+    delete extra->Chunks;
+    extra->Chunks = NULL;
     SetFlags(FILEINFO_READCSUM);
   }
-  md5sum_t CurrentChecksum() const;
+  checksum_t CurrentChecksum(checksum_t::Algorithm algorithm) const;
+
+  // The digests of the chunks of a tree checksum, which are kept
+  // whenever the file is hashed by a tree algorithm, and stored with
+  // the checksum in a database or cache; otherwise it is read again.
+  const std::vector<checksum_t>&
+  ChunkChecksums(checksum_t::Algorithm algorithm) const;
+
+  // The same, but only if they are known already; otherwise NULL.
+  const std::vector<checksum_t> * KnownChunkChecksums() const {
+    if (HasFlags(FILEINFO_READCSUM))
+      return extra->Chunks;
+    return NULL;
+  }
+
+  // Give the chunks of the tree checksum last set, as stored with it.
+  void SetChunkChecksums(const std::vector<checksum_t>& chunks) {
+    assert(HasFlags(FILEINFO_READCSUM) &&
+	   checksum_t::IsTree(extra->csum.Kind()));
+    if (! extra->Chunks)
+      extra->Chunks = new std::vector<checksum_t>;
+    *extra->Chunks = chunks;
+  }
+
+  // Compare contents by checksum, using whichever algorithm other's
+  // checksum was made by, since other may be a database which cannot
+  // compute a new one.
+  bool SameChecksum(const FileInfo& other) const {
+    const checksum_t& theirs(other.Checksum());
+    return Checksum(theirs.Kind()) == theirs;
+  }
+
+  // False if this entry has no checksum and none can be had, as for
+  // a file recorded in a database before its checksum was known.
+  bool ChecksumKnown() const;
 
   void * GetAttribute(const std::string& name) const;
   void SetAttribute(const std::string& name, void * data);
 
   virtual void ClearAttribute(const std::string& name) {
-    Attributes->erase(name);
+    if (extra && extra->Attributes)
+      extra->Attributes->erase(name);
   }
   virtual void ClearAllAttributes(const std::string& name) {
-    Attributes->clear();
+    if (extra && extra->Attributes)
+      extra->Attributes->clear();
   }
 
   virtual DateTime LastWriteTime() const = 0;
@@ -154,7 +299,7 @@ public:
   void Update(const FileInfo& source);
 
   Path DirectoryName() const {
-    return FullName.DirectoryName();
+    return FullName().DirectoryName();
   }
 
   void Create();
@@ -171,12 +316,18 @@ public:
   virtual bool CompareAttributes(const FileInfo& other) const = 0;
   virtual void Dump(std::ostream& out, bool verbose, int depth = 0) const = 0;
 
-  ChildrenMap::iterator ChildrenBegin() const;
-  ChildrenMap::iterator ChildrenEnd() const {
-    assert(Children != NULL);
-    return Children->end();
+  ChildrenArray::iterator ChildrenBegin() const;
+  ChildrenArray::iterator ChildrenEnd() const {
+    assert(Children() != NULL);
+    return Children()->end();
   }
-  ChildrenMap::size_type ChildrenSize() const;
+  ChildrenArray::size_type ChildrenSize() const;
+
+  // Free every entry below this one.  Those read from the broker are
+  // read from it again if asked for; any made or changed in memory
+  // since then are lost.  The broker's CanReleaseChildren says
+  // whether there are any.
+  void ReleaseChildren();
 
   FileInfo *  CreateChild(const std::string& name);
   void        InsertChild(FileInfo * entry);
@@ -187,6 +338,8 @@ public:
   FileInfo *  FindOrCreateMember(const Path& path);
 
   std::string Moniker() const;
+
+  friend class Scanner;
 };
 
 typedef std::deque<FileInfo *> FileInfoArray;
@@ -1,67 +1,257 @@
 #include "FlatDB.h"
 #include "Location.h"
-#include "Posix.h"
+#include "StateChange.h"
 #include "binary.h"
 
 #include <fstream>
+#include <sstream>
+#include <iterator>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+#ifdef WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 namespace Attic {
 
-#define BINARY_VERSION 0x00000001L
+#define BINARY_VERSION_1     0x00000001L
+#define BINARY_VERSION	     0x00000002L
+#define BINARY_TRAILER_MAGIC 0x42445441U // "ATDB"
+#define BINARY_TRAILER_SIZE  32
+
+// A version 1 record is a name, followed by these fixed fields: the
+// kind, length, MD5 and modification time.
+#define V1_DETAILS_SIZE							\
+  (sizeof(FileInfo::Kind) + sizeof(unsigned long long) + 16 + sizeof(DateTime))
+
+#define RECORD_HAS_CHECKSUM  0x01 // an MD5 follows
+#define RECORD_HAS_DIGEST    0x02 // an algorithm and its digest follow
+#define RECORD_HAS_CHUNKS    0x04 // then a count and the chunks' digests
+
+#define JOURNAL_VERSION	      0x00000001L
+#define JOURNAL_COMPACT_MIN   (1024 * 1024)
+#define JOURNAL_COMPACT_RATIO 4 // compact once a quarter the database's size
 
 FlatDatabaseBroker::~FlatDatabaseBroker()
 {
-  if (Dirty)
+  // Every record is flushed as it is made, so nothing is lost here
+  // if Sync was never called; the journal is simply not folded in.
+  CloseJournal();
+  Unload();
+}
+
+void FlatDatabaseBroker::CloseJournal()
+{
+  if (Journal) {
+    Journal->close();
+    delete Journal;
+    Journal = NULL;
+  }
+}
+
+void FlatDatabaseBroker::Sync()
+{
+  if (JournalSize > 0 &&
+      JournalSize >= std::max<unsigned long long>
+	(JOURNAL_COMPACT_MIN, DataSize / JOURNAL_COMPACT_RATIO)) {
+    CloseJournal();
+    Compact();
+  }
+  else if (Dirty) {
     Save(static_cast<FlatDBFileInfo *>(Repository->Root()));
+  }
+}
+
+void FlatDatabaseBroker::KeepChildren(FileInfo * entry) const
+{
+  for (; entry; entry = entry->Parent)
+    static_cast<FlatDBFileInfo *>(entry)->childrenChanged = true;
 }
 
 void FlatDatabaseBroker::Create(FileInfo& entry)
 {
   FileInfo * root = Repository->Root();
   if (! root) {
-    root = CreateFileInfo("");
+    LoadedRoot = static_cast<FlatDBFileInfo *>(CreateFileInfo(""));
+    root = LoadedRoot;
     Repository->SetRoot(root);
   }
-  Repository->FindOrCreateMember(entry.FullName);
+  KeepChildren(Repository->FindOrCreateMember(entry.FullName())->Parent);
 }
 
 FlatDBFileInfo * FlatDatabaseBroker::Load()
 {
-  PosixVolumeBroker broker("/");
+  if (Loaded)
+    return LoadedRoot;
+  Loaded = true;
 
-  if (! broker.Exists(DatabasePath))
-    return NULL;
+  int fd = open(DatabasePath.c_str(), O_RDONLY);
+  if (fd < 0) {
+    if (errno != ENOENT)
+      throw Exception("Failed to open database file '" + DatabasePath + "'");
+    ReplayJournal();
+    return LoadedRoot;
+  }
 
-  int    len  = broker.Length(DatabasePath);
-  char * data = new char[len + 1];
+  struct stat info;
+  if (fstat(fd, &info) < 0) {
+    close(fd);
+    throw Exception("Failed to stat database file '" + DatabasePath + "'");
+  }
+  DataSize = info.st_size;
 
-  std::ifstream fin(DatabasePath.c_str());
-  fin.read(data, len);
-  if (fin.gcount() != len) {
-    delete[] data;
-    throw Exception("Failed to read database file '" + DatabasePath + "'");
+#ifdef HAVE_MMAP
+  if (DataSize > 0) {
+    void * addr = mmap(NULL, DataSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr != MAP_FAILED) {
+      Data   = static_cast<char *>(addr);
+      Mapped = true;
+    }
   }
+#endif
 
-  FlatDBFileInfo * Root = NULL;
-  try {
-    char * ptr = data;
-    if (read_binary_long<long>(ptr) == BINARY_VERSION) {
-      Root = ReadFileInfo(ptr, NULL);
-      //RegisterChecksums(Root);
+  if (! Mapped) {
+    Data = new char[DataSize + 1];
+
+    std::size_t done = 0;
+    while (done < DataSize) {
+      ssize_t len = read(fd, Data + done, DataSize - done);
+      if (len <= 0) {
+	if (len < 0 && errno == EINTR)
+	  continue;
+	close(fd);
+	Unload();
+	throw Exception("Failed to read database file '" + DatabasePath + "'");
+      }
+      done += len;
     }
   }
-  catch (...) {
-    delete[] data;
-    throw;
+  close(fd);
+
+  char * ptr = Data;
+  if (DataSize > 0)
+    Version = ReadLong(ptr, Data + DataSize);
+
+  if (Version == BINARY_VERSION_1) {
+    LoadedRoot = ReadFileInfo(ptr, NULL);
   }
-  delete[] data;
+  else if (Version == BINARY_VERSION) {
+    Trailer trailer;
+    ReadTrailer(trailer);
+    if (trailer.RootOffset)
+      LoadedRoot = ReadRecord(Data + trailer.RootOffset, NULL);
+  }
+
+  ReplayJournal();
+  return LoadedRoot;
+}
+
+void FlatDatabaseBroker::ReadTrailer(Trailer& trailer) const
+{
+  if (DataSize < BINARY_TRAILER_SIZE + 2)
+    throw Exception("Database file '" + DatabasePath + "' is truncated");
+
+  char * ptr = Data + DataSize - BINARY_TRAILER_SIZE;
+  read_binary_number(ptr, trailer.RootOffset);
+  read_binary_number(ptr, trailer.Entries);
+  read_binary_number(ptr, trailer.Directories);
+  read_binary_number(ptr, trailer.Checksum);
+  read_binary_number(ptr, trailer.Magic);
+
+  if (trailer.Magic != BINARY_TRAILER_MAGIC ||
+      trailer.RootOffset >= DataSize - BINARY_TRAILER_SIZE)
+    throw Exception("Database file '" + DatabasePath + "' is damaged");
 
-  return Root;
+  // Checking the whole file would mean reading all of it, which is
+  // just what loading it lazily avoids, so it is only done on request.
+  if (Repository && Repository->VerifyResults &&
+      binary_crc32(0, Data, DataSize - BINARY_TRAILER_SIZE) !=
+      trailer.Checksum)
+    throw Exception("Database file '" + DatabasePath +
+		    "' fails its checksum");
+}
+
+void FlatDatabaseBroker::Damaged() const
+{
+  throw Exception("Database file '" + DatabasePath + "' is damaged");
+}
+
+void FlatDatabaseBroker::CheckRoom(const char * data, const char * end,
+				   unsigned long long len) const
+{
+  if (data > end || len > (unsigned long long)(end - data))
+    Damaged();
+}
+
+unsigned long long
+FlatDatabaseBroker::ReadVarint(char *& data, const char * end) const
+{
+  unsigned long long num;
+  if (! read_binary_varint(data, end, num))
+    Damaged();
+  return num;
+}
+
+long FlatDatabaseBroker::ReadLong(char *& data, const char * end) const
+{
+  // One byte giving how many follow: at least one, and at most four.
+  CheckRoom(data, end, 1);
+  unsigned char len = static_cast<unsigned char>(*data);
+  CheckRoom(data, end, 1 + (len < 1 ? 1 : (len > 4 ? 4 : len)));
+  return read_binary_long<long>(data);
+}
+
+void FlatDatabaseBroker::Unload()
+{
+  if (! Data)
+    return;
+
+#ifdef HAVE_MMAP
+  if (Mapped)
+    munmap(Data, DataSize);
+  else
+#endif
+    delete[] Data;
+
+  Data	 = NULL;
+  Mapped = false;
+}
+
+std::size_t FlatDatabaseBroker::V1RecordSize(const char * data) const
+{
+  const char * end = Data + DataSize;
+
+  CheckRoom(data, end, 1);
+  std::size_t len  = static_cast<unsigned char>(*data);
+  std::size_t head = 1;
+  if (len == 0xff) {
+    CheckRoom(data, end, 3);
+    unsigned short slen;
+    std::memcpy(&slen, data + 1, sizeof slen);
+    len	 = slen;
+    head = 3;
+  }
+  CheckRoom(data, end, head + len + V1_DETAILS_SIZE);
+  return head + len + V1_DETAILS_SIZE;
 }
 
 FlatDBFileInfo *
 FlatDatabaseBroker::ReadFileInfo(char *& data, FlatDBFileInfo * parent) const
 {
+  V1RecordSize(data);
+
   Path name;
   read_binary_string(data, name);
 
@@ -70,47 +260,421 @@ FlatDatabaseBroker::ReadFileInfo(char *& data, FlatDBFileInfo * parent) const
 
   read_binary_number(data, entry->fileKind);
   read_binary_number(data, entry->length);
-  md5sum_t csum;
-  read_binary_number(data, csum);
+  checksum_t csum(checksum_t::MD5);
+  std::memcpy(csum.digest, data, checksum_t::Length(checksum_t::MD5));
+  data += checksum_t::Length(checksum_t::MD5);
   entry->SetChecksum(csum);
   read_binary_number(data, entry->lastWriteTime);
 
-  if (entry->IsDirectory()) {
-    int children = read_binary_long<int>(data);
-    for (int i = 0; i < children; i++)
-      ReadFileInfo(data, entry);
+  // The children follow directly, but are left where they are until
+  // ReadDirectory is asked for them.
+  if (entry->IsDirectory())
+    entry->childrenOffset = data - Data;
+
+  return entry;
+}
+
+void FlatDatabaseBroker::SkipChildren(char *& data) const
+{
+  long children = ReadLong(data, Data + DataSize);
+  for (long i = 0; i < children; i++) {
+    data += V1RecordSize(data) - V1_DETAILS_SIZE;
+
+    FileInfo::Kind kind = read_binary_number<FileInfo::Kind>(data);
+    data += V1_DETAILS_SIZE - sizeof(FileInfo::Kind);
+
+    if (kind == FileInfo::Directory)
+      SkipChildren(data);
   }
+}
+
+FlatDBFileInfo *
+FlatDatabaseBroker::ReadRecord(char * data, FlatDBFileInfo * parent) const
+{
+  const char * end = Data + DataSize - BINARY_TRAILER_SIZE;
+
+  std::size_t len = ReadVarint(data, end);
+  CheckRoom(data, end, len);
+  std::string name(data, len);
+  data += len;
+
+  FlatDBFileInfo * entry =
+    static_cast<FlatDBFileInfo *>(CreateFileInfo(name, parent));
+
+  ReadDetails(data, end, *entry);
+  if (entry->IsDirectory())
+    entry->childrenOffset = data - Data;
+
   return entry;
 }
 
+void FlatDatabaseBroker::ReadDetails(char *& data, const char * end,
+				     FlatDBFileInfo& entry) const
+{
+  CheckRoom(data, end, 2);
+  entry.fileKind = static_cast<FileInfo::Kind>
+    (read_binary_number<unsigned char>(data));
+  unsigned char flags = read_binary_number<unsigned char>(data);
+
+  entry.length = ReadVarint(data, end);
+  std::time_t secs = binary_unzigzag(ReadVarint(data, end));
+  entry.lastWriteTime = DateTime(secs, (long)ReadVarint(data, end));
+
+  if (flags & (RECORD_HAS_CHECKSUM | RECORD_HAS_DIGEST)) {
+    checksum_t csum(checksum_t::MD5);
+    if (flags & RECORD_HAS_DIGEST) {
+      CheckRoom(data, end, 1);
+      csum.algorithm = read_binary_number<unsigned char>(data);
+      if (csum.Length() == 0)
+	Damaged();
+    }
+    CheckRoom(data, end, csum.Length());
+    std::memcpy(csum.digest, data, csum.Length());
+    data += csum.Length();
+    entry.SetChecksum(csum);
+
+    if (flags & RECORD_HAS_CHUNKS) {
+      if (! checksum_t::IsTree(csum.Kind()))
+	Damaged();
+
+      checksum_t  chunk(checksum_t::Base(csum.Kind()));
+      std::size_t length = chunk.Length();
+      unsigned long long count = ReadVarint(data, end);
+      if (count > (unsigned long long)(end - data) / length)
+	Damaged();
+
+      std::vector<checksum_t> chunks;
+      chunks.reserve(count);
+      for (unsigned long long i = 0; i < count; i++) {
+	std::memcpy(chunk.digest, data, length);
+	data += length;
+	chunks.push_back(chunk);
+      }
+      entry.SetChunkChecksums(chunks);
+    }
+  } else {
+    entry.ClearFlags(FILEINFO_READCSUM);
+  }
+}
+
+void FlatDatabaseBroker::WriteDetails(const FileInfo& entry,
+				      std::ostream& out) const
+{
+  // Only files have checksums, and they are not computed just to be
+  // saved here.
+  bool hasChecksum =
+    entry.IsRegularFile() && entry.HasFlags(FILEINFO_READCSUM);
+  bool isMD5 = hasChecksum && entry.Checksum().Kind() == checksum_t::MD5;
+
+  // The chunks of a tree checksum are kept with it, if they are known.
+  const std::vector<checksum_t> * chunks = NULL;
+  if (hasChecksum && checksum_t::IsTree(entry.Checksum().Kind()))
+    chunks = entry.KnownChunkChecksums();
+  if (chunks && chunks->empty())
+    chunks = NULL;
+
+  unsigned char flags = 0;
+  if (hasChecksum)
+    flags = isMD5 ? RECORD_HAS_CHECKSUM : RECORD_HAS_DIGEST;
+  if (chunks)
+    flags |= RECORD_HAS_CHUNKS;
+
+  write_binary_number<unsigned char>(out, entry.FileKind());
+  write_binary_number<unsigned char>(out, flags);
+
+  // Only a file's length means anything from one run to the next.
+  DateTime when(entry.LastWriteTime());
+  write_binary_varint(out, entry.IsRegularFile() ? entry.Length() : 0);
+  write_binary_varint_signed(out, when.secs);
+  write_binary_varint(out, when.nsecs);
+
+  if (hasChecksum) {
+    const checksum_t& csum(entry.Checksum());
+    if (! isMD5)
+      write_binary_number(out, csum.algorithm);
+    out.write(reinterpret_cast<const char *>(csum.digest), csum.Length());
+  }
+
+  if (chunks) {
+    write_binary_varint(out, chunks->size());
+    for (std::vector<checksum_t>::const_iterator i = chunks->begin();
+	 i != chunks->end();
+	 i++)
+      out.write(reinterpret_cast<const char *>((*i).digest), (*i).Length());
+  }
+}
+
+void FlatDatabaseBroker::ReadDirectory(FileInfo& entry) const
+{
+  FlatDBFileInfo& dir(static_cast<FlatDBFileInfo&>(entry));
+  if (! dir.childrenOffset)
+    return;
+
+  char * data = Data + dir.childrenOffset;
+
+  if (Version == BINARY_VERSION_1) {
+    // Each child directory's own children are skipped over here, to
+    // be read when that directory is.
+    long children = ReadLong(data, Data + DataSize);
+    for (long i = 0; i < children; i++)
+      if (ReadFileInfo(data, &dir)->IsDirectory())
+	SkipChildren(data);
+  } else {
+    // The table gives how far back from itself each child's record
+    // is, which must be somewhere before it.
+    const char * end = Data + DataSize - BINARY_TRAILER_SIZE;
+    char * table = data;
+    unsigned long long children = ReadVarint(data, end);
+    for (unsigned long long i = 0; i < children; i++) {
+      unsigned long long back = ReadVarint(data, end);
+      if (back == 0 || back > (unsigned long long)(table - Data))
+	Damaged();
+      ReadRecord(table - back, &dir);
+    }
+  }
+}
+
+void FlatDatabaseBroker::RecordChange(const StateChange& change)
+{
+  // A record is the kind of change, the full name of the entry it
+  // applies to, and unless it was removed, its new details.  Each is
+  // framed by its length and a CRC-32, so that one left half-written
+  // can be recognized and dropped.
+  std::ostringstream record(std::ios::out | std::ios::binary);
+
+  // When changes are found by checksum, a file goes in with its
+  // checksum, even if none was needed to find this change; otherwise
+  // the next run could only compare its length and time with what is
+  // recorded here, and would miss a change which kept both.
+  if (change.ChangeKind != StateChange::Remove &&
+      Repository->UseChecksums && change.Item->IsRegularFile() &&
+      ! change.Item->HasFlags(FILEINFO_READCSUM) &&
+      change.Item->ChecksumKnown())
+    change.Item->Checksum();
+
+  std::string path(change.Item->FullName());
+  write_binary_number<unsigned char>(record, change.ChangeKind);
+  write_binary_varint(record, path.length());
+  record.write(path.data(), path.length());
+  if (change.ChangeKind != StateChange::Remove)
+    WriteDetails(*change.Item, record);
+
+  std::string payload(record.str());
+
+  if (! Journal)
+    OpenJournal();
+
+  write_binary_number<unsigned int>(*Journal, payload.length());
+  Journal->write(payload.data(), payload.length());
+  write_binary_number<unsigned int>
+    (*Journal, binary_crc32(0, payload.data(), payload.length()));
+  Journal->flush();
+  if (! *Journal)
+    throw Exception("Failed to write journal '" + JournalPath + "'");
+
+  JournalSize += payload.length() + 2 * sizeof(unsigned int);
+  JournalRecords++;
+}
+
+void FlatDatabaseBroker::OpenJournal()
+{
+  // Loading replays the journal, and finds where its last whole
+  // record ends; anything after that is cut off before appending.
+  Load();
+
+  struct stat info;
+  if (stat(JournalPath.c_str(), &info) == 0 &&
+      static_cast<unsigned long long>(info.st_size) != JournalSize &&
+      truncate(JournalPath.c_str(), JournalSize) < 0)
+    throw Exception("Failed to truncate journal '" + JournalPath + "'");
+
+  Journal = new std::ofstream(JournalPath.c_str(), (std::ios::out |
+						    std::ios::app |
+						    std::ios::binary));
+  if (! *Journal)
+    throw Exception("Failed to open journal '" + JournalPath + "'");
+
+  if (JournalSize == 0) {
+    std::ostringstream header(std::ios::out | std::ios::binary);
+    write_binary_long(header, JOURNAL_VERSION);
+    Journal->write(header.str().data(), header.str().length());
+    JournalSize = header.str().length();
+  }
+}
+
+void FlatDatabaseBroker::ReplayJournal()
+{
+  JournalSize = 0;
+
+  std::ifstream fin(JournalPath.c_str(), std::ios::in | std::ios::binary);
+  if (! fin)
+    return;
+
+  std::string contents((std::istreambuf_iterator<char>(fin)),
+		       std::istreambuf_iterator<char>());
+  if (contents.length() < 2)
+    return;
+
+  char * start = &contents[0];
+  char * end   = start + contents.length();
+  char * data  = start;
+
+  if (ReadLong(data, end) != JOURNAL_VERSION)
+    throw Exception("Journal '" + JournalPath + "' has an unknown version");
+  JournalSize = data - start;
+
+  while (end - data >= (long)sizeof(unsigned int)) {
+    unsigned int len = read_binary_number<unsigned int>(data);
+    if ((unsigned long long)(end - data) < len + sizeof(unsigned int))
+      break;
+
+    char * payload = data;
+    data += len;
+    if (read_binary_number<unsigned int>(data) !=
+	binary_crc32(0, payload, len))
+      break;
+
+    ApplyJournalRecord(payload, payload + len);
+    JournalSize = data - start;
+  }
+}
+
+void FlatDatabaseBroker::ApplyJournalRecord(char * data, const char * end)
+{
+  CheckRoom(data, end, 1);
+  StateChange::Kind kind =
+    static_cast<StateChange::Kind>(read_binary_number<unsigned char>(data));
+
+  std::size_t len = ReadVarint(data, end);
+  CheckRoom(data, end, len);
+  std::string path(data, len);
+  data += len;
+
+  if (kind == StateChange::Remove) {
+    if (LoadedRoot && ! path.empty())
+      if (FileInfo * entry = LoadedRoot->FindMember(path)) {
+	KeepChildren(entry->Parent);
+	delete entry;
+      }
+    return;
+  }
+
+  if (! LoadedRoot) {
+    LoadedRoot = static_cast<FlatDBFileInfo *>(CreateFileInfo(""));
+    Repository->SetRoot(LoadedRoot);
+  }
+
+  FlatDBFileInfo * entry = static_cast<FlatDBFileInfo *>
+    (path.empty() ? LoadedRoot : LoadedRoot->FindOrCreateMember(path));
+
+  KeepChildren(entry->Parent);
+
+  bool wasDirectory = entry->IsDirectory();
+  ReadDetails(data, end, *entry);
+
+  // A directory replaced by something else takes its contents with it.
+  if (wasDirectory && ! entry->IsDirectory()) {
+    entry->ReleaseChildren();
+    entry->childrenOffset = 0;
+  }
+}
+
+void FlatDatabaseBroker::Compact()
+{
+  // If anything was recorded since the database was loaded, it is
+  // loaded again, to pick those records up from the journal.
+  if (JournalRecords > 0) {
+    delete LoadedRoot;
+    LoadedRoot = NULL;
+    Repository->SetRoot(NULL);
+
+    Unload();
+    Loaded = false;
+  }
+
+  Save(Load());
+
+  if (std::remove(JournalPath.c_str()) != 0 && errno != ENOENT)
+    throw Exception("Failed to remove journal '" + JournalPath + "'");
+
+  JournalSize	 = 0;
+  JournalRecords = 0;
+}
+
 void FlatDatabaseBroker::Save(FlatDBFileInfo * Root)
 {
-  std::ofstream fout(DatabasePath.c_str());
-  write_binary_long(fout, BINARY_VERSION);
+  // The new database is written alongside the old one and renamed
+  // over it, since whatever has not been read yet is still being read
+  // from the old one as the new one is written.
+  Path tempPath(DatabasePath + ".new");
+
+  std::ofstream	  fout(tempPath.c_str(), std::ios::out | std::ios::binary);
+  crc32_streambuf counter(fout.rdbuf());
+  std::ostream	  out(&counter);
+
+  write_binary_long(out, BINARY_VERSION);
+
+  Trailer trailer;
+  trailer.RootOffset  = 0;
+  trailer.Entries     = 0;
+  trailer.Directories = 0;
   if (Root)
-    WriteFileInfo(*Root, fout);
+    trailer.RootOffset = WriteFileInfo(*Root, out, counter, trailer);
+  trailer.Checksum = counter.crc;
+  trailer.Magic	   = BINARY_TRAILER_MAGIC;
+
+  write_binary_number(out, trailer.RootOffset);
+  write_binary_number(out, trailer.Entries);
+  write_binary_number(out, trailer.Directories);
+  write_binary_number(out, trailer.Checksum);
+  write_binary_number(out, trailer.Magic);
+
+  out.flush();
   fout.close();
 
+  if (! out || ! fout ||
+      std::rename(tempPath.c_str(), DatabasePath.c_str()) != 0) {
+    std::remove(tempPath.c_str());
+    throw Exception("Failed to write database file '" + DatabasePath + "'");
+  }
+
   Dirty = false;
 }
 
-void FlatDatabaseBroker::WriteFileInfo(const FlatDBFileInfo& entry,
-				       std::ostream& out) const
+unsigned long long
+FlatDatabaseBroker::WriteFileInfo(const FlatDBFileInfo& entry,
+				  std::ostream& out,
+				  const crc32_streambuf& counter,
+				  Trailer& trailer) const
 {
-  write_binary_string(out, entry.Name);
+  std::vector<unsigned long long> children;
+  if (entry.IsDirectory())
+    for (FileInfo::ChildrenArray::iterator i = entry.ChildrenBegin();
+	 i != entry.ChildrenEnd();
+	 i++)
+      children.push_back(WriteFileInfo(static_cast<FlatDBFileInfo&>(**i),
+				       out, counter, trailer));
+
+  unsigned long long offset = counter.count;
+
+  std::string name(entry.Name());
+  write_binary_varint(out, name.length());
+  out.write(name.data(), name.length());
 
-  write_binary_number(out, entry.FileKind());
-  write_binary_number(out, entry.Length());
-  write_binary_number(out, entry.Checksum());
-  write_binary_number(out, entry.LastWriteTime());
+  WriteDetails(entry, out);
 
   if (entry.IsDirectory()) {
-    write_binary_long(out, (int)entry.ChildrenSize());
-    for (FileInfo::ChildrenMap::iterator i = entry.ChildrenBegin();
-	 i != entry.ChildrenEnd();
+    unsigned long long table = counter.count;
+    write_binary_varint(out, children.size());
+    for (std::vector<unsigned long long>::iterator i = children.begin();
+	 i != children.end();
 	 i++)
-      WriteFileInfo(static_cast<FlatDBFileInfo&>(*(*i).second), out);
+      write_binary_varint(out, table - *i);
+    trailer.Directories++;
   }
+  trailer.Entries++;
+
+  return offset;
 }
 
 } // namespace Attic
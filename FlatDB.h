@@ -3,6 +3,10 @@
 
 #include "Broker.h"
 
+#include <fstream>
+
+class crc32_streambuf;
+
 namespace Attic {
 
 class FlatDBFileInfo : public FileInfo
@@ -13,13 +17,24 @@ private:
   Kind     fileKind;
   DateTime lastWriteTime;
 
+  // Where this directory's children (or, from version 2 on, the table
+  // of their offsets) begin in the database file, or zero if it has
+  // none there.  It is kept after they are read, so that they can be
+  // read again if they are released -- unless childrenChanged says
+  // that the journal changed them since, in which case they are kept.
+  std::size_t childrenOffset;
+  bool	      childrenChanged;
+
 public:
   FlatDBFileInfo(Location * _Repository = NULL)
-    : FileInfo(_Repository) {}
+    : FileInfo(_Repository), length(0), fileKind(Nonexistant),
+      lastWriteTime(0), childrenOffset(0), childrenChanged(false) {}
   
   FlatDBFileInfo(const Path& _FullName, FileInfo * _Parent = NULL,
 		 Location * _Repository = NULL)
-    : FileInfo(_FullName, _Parent, _Repository) {}
+    : FileInfo(_FullName, _Parent, _Repository), length(0),
+      fileKind(Nonexistant), lastWriteTime(0), childrenOffset(0),
+      childrenChanged(false) {}
 
   virtual unsigned long long Length() const {
     return length;
@@ -55,6 +70,32 @@ public:
   friend class FlatDatabaseBroker;
 };
 
+// The database is mapped into memory when it is first asked for its
+// root, but only the root is read from it then.  The children of each
+// directory are read from the mapping the first time they are wanted,
+// so that whatever is never looked at -- most of the tree, when only
+// one path is of interest -- costs nothing but address space.
+//
+// Version 2 databases are written in post-order: each directory's
+// record follows those of everything within it, and ends with a table
+// of the offsets of its children's records, so that a reader can go
+// straight to any of them.  Numbers are LEB128 varints, and only
+// regular files store a checksum: MD5s as they always were, and those
+// of any other algorithm preceded by the algorithm.  A tree checksum
+// is followed by the digests of its chunks, when they are known, so
+// that they need not be read again to find what part of a large file
+// has changed.  A trailer at the very end gives the offset of the
+// root's record, how many entries and directories there are, and a
+// CRC-32 of everything before it.  Version 1 databases, which can
+// only be read from front to back, are still read, but always saved
+// as version 2.
+//
+// Rather than rewriting the whole database whenever anything changes,
+// each change recorded is appended to a journal kept beside it, which
+// is replayed over the database whenever it is loaded.  Replaying a
+// record twice does no harm, so the journal is simply removed once it
+// has grown large enough to be worth folding into a new database.
+
 class FlatDatabaseBroker : public DatabaseBroker
 {
 public:
@@ -62,16 +103,23 @@ public:
   bool Dirty;
 
   FlatDatabaseBroker(const Path& _DatabasePath)
-    : DatabasePath(_DatabasePath), Dirty(false) {}
+    : DatabasePath(_DatabasePath), Dirty(false), LoadedRoot(NULL),
+      Loaded(false), Data(NULL), DataSize(0), Mapped(false), Version(0),
+      JournalPath(_DatabasePath + ".journal"), Journal(NULL),
+      JournalSize(0), JournalRecords(0) {}
 
   virtual ~FlatDatabaseBroker();
 
   virtual FileInfo * FindRoot() {
     return Load();
   }
+  virtual void ReleaseRoot(FileInfo *) {}
+  virtual bool CanReleaseChildren(const FileInfo& entry) const {
+    return ! static_cast<const FlatDBFileInfo&>(entry).childrenChanged;
+  }
   virtual FileInfo * CreateFileInfo(const Path& path,
 				    FileInfo * parent = NULL) const {
-    return new FlatDBFileInfo(path, parent, Repository);
+    return new (Repository) FlatDBFileInfo(path, parent, Repository);
   }
 
   virtual long long unsigned int Length(const Path&) const {
@@ -98,12 +146,14 @@ public:
   virtual void CopyAttributes(const FileInfo&, const Path&) {
     assert(0);
   }
-  virtual void ComputeChecksum(const Path&, md5sum_t&) const {
-    assert(0);
+  virtual bool ComputesChecksums() const {
+    return false;
   }
-  virtual void ReadDirectory(FileInfo&) const {
+  virtual void ComputeChecksum(const Path&, checksum_t::Algorithm,
+			       checksum_t&, std::vector<checksum_t> *) const {
     assert(0);
   }
+  virtual void ReadDirectory(FileInfo& entry) const;
   virtual void CreateDirectory(const Path&) {
     assert(0);
   }
@@ -130,15 +180,72 @@ public:
     return path;
   }
   virtual std::string Moniker(const FileInfo& entry) const {
-    return "flatdb://" + DatabasePath + "/" + entry.FullName;
+    return "flatdb://" + DatabasePath + "/" + entry.FullName();
   }
 
+  virtual void RecordChange(const StateChange& change);
+
+  // Fold the journal into the database, if it has grown large enough
+  // to be worth it.  This is left until now, rather than done when the
+  // broker is destroyed, since it can fail.
+  virtual void Sync();
+
 private:
+  FlatDBFileInfo * LoadedRoot;
+  bool		   Loaded;
+  char *	   Data;	// the database file, mapped or read in
+  std::size_t	   DataSize;
+  bool		   Mapped;
+  long		   Version;	// of the database file as loaded
+
+  struct Trailer {
+    unsigned long long RootOffset; // zero if there is no root
+    unsigned long long Entries;
+    unsigned long long Directories;
+    unsigned int       Checksum;
+    unsigned int       Magic;
+  };
+
   FlatDBFileInfo * Load();
+  void		   Unload();
+  void		   ReadTrailer(Trailer& trailer) const;
+
+  // Nothing is read from the file, or from a journal record, without
+  // first checking that it lies before end; if not, these throw.
+  void		     Damaged() const;
+  void		     CheckRoom(const char * data, const char * end,
+			       unsigned long long len) const;
+  unsigned long long ReadVarint(char *& data, const char * end) const;
+  long		     ReadLong(char *& data, const char * end) const;
+
+  // Version 1
+  std::size_t	   V1RecordSize(const char * data) const;
   FlatDBFileInfo * ReadFileInfo(char *& entry, FlatDBFileInfo * parent) const;
+  void		   SkipChildren(char *& data) const;
+
+  // Version 2
+  FlatDBFileInfo * ReadRecord(char * data, FlatDBFileInfo * parent) const;
+  void		   ReadDetails(char *& data, const char * end,
+			       FlatDBFileInfo& entry) const;
+  void		   WriteDetails(const FileInfo& entry, std::ostream& out) const;
+
+  Path		     JournalPath;
+  std::ofstream *    Journal;	     // open for appending, once needed
+  unsigned long long JournalSize;    // of its valid records
+  unsigned int	     JournalRecords; // recorded since it was loaded
+
+  void KeepChildren(FileInfo * entry) const;
+  void ReplayJournal();
+  void ApplyJournalRecord(char * data, const char * end);
+  void OpenJournal();
+  void CloseJournal();
+  void Compact();
 
   void Save(FlatDBFileInfo * Root);
-  void WriteFileInfo(const FlatDBFileInfo& entry, std::ostream& out) const;
+  unsigned long long WriteFileInfo(const FlatDBFileInfo& entry,
+				   std::ostream& out,
+				   const crc32_streambuf& counter,
+				   Trailer& trailer) const;
 };
 
 } // namespace Attic
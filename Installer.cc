@@ -0,0 +1,247 @@
+#include "Installer.h"
+#include "error.h"
+#include "acconf.h"
+
+#include <cassert>
+#include <cstdio>
+#include <sstream>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace Attic {
+
+static Path DirectoryOf(const Path& path)
+{
+  Path dir(path.DirectoryName());
+  if (dir.empty())
+    return path[0] == '/' ? "/" : ".";
+  return dir;
+}
+
+Installer::Installer() : UseTmpFile(false), NextTemp(0)
+{
+#ifdef O_TMPFILE
+  // An anonymous file can only be given a name again through /proc.
+  UseTmpFile = access("/proc/self/fd", X_OK) == 0;
+#endif
+}
+
+Installer::~Installer()
+{
+  if (Current.Fd != -1)
+    Abandon(Current);
+  for (PendingArray::iterator i = Batch.begin(); i != Batch.end(); i++)
+    Abandon(*i);
+}
+
+Path Installer::TempName(const Path& dest)
+{
+  std::ostringstream name;
+  name << DirectoryOf(dest) << "/." << dest.FileName() << ".attic"
+       << getpid() << "." << NextTemp++;
+  return name.str();
+}
+
+int Installer::OpenTemp(const Path& dest, Path& temp)
+{
+#ifdef O_TMPFILE
+  if (UseTmpFile) {
+    int fd = open(DirectoryOf(dest).c_str(), O_TMPFILE | O_WRONLY, 0666);
+    if (fd != -1) {
+      temp.clear();
+      return fd;
+    }
+    // Older kernels, and some filesystems, do not support them.
+    if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)
+      throw Exception("Failed to create '" + dest + "'");
+    UseTmpFile = false;
+  }
+#endif
+
+  for (;;) {
+    temp = TempName(dest);
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd != -1)
+      return fd;
+    if (errno != EEXIST)
+      throw Exception("Failed to create '" + dest + "'");
+  }
+}
+
+int Installer::Open(const Path& dest)
+{
+  assert(Current.Fd == -1);
+
+  Path dir(DirectoryOf(dest));
+  if (! Batch.empty() &&
+      (dir != BatchDirectory || Batch.size() >= INSTALL_BATCH_SIZE))
+    Flush();
+  BatchDirectory = dir;
+
+  Current.Dest = dest;
+  Current.Fd   = OpenTemp(dest, Current.Temp);
+
+  // A replacement keeps the ownership and permissions of the file it
+  // replaces, as it would have if written over it.  Only a privileged
+  // user can give a file away, so failing to do that is no error.
+  struct stat info;
+  if (lstat(dest.c_str(), &info) == 0 && S_ISREG(info.st_mode) &&
+      ((fchown(Current.Fd, info.st_uid, info.st_gid) == -1 &&
+	errno != EPERM) ||
+       fchmod(Current.Fd, info.st_mode & 07777) == -1)) {
+    Discard();
+    throw Exception("Failed to set permissions of '" + dest + "'");
+  }
+
+  return Current.Fd;
+}
+
+void Installer::Close()
+{
+  assert(Current.Fd != -1);
+  Batch.push_back(Current);
+  Current = Pending();
+}
+
+void Installer::Discard()
+{
+  Abandon(Current);
+  Current = Pending();
+}
+
+void Installer::Abandon(Pending& file)
+{
+  close(file.Fd);
+  if (! file.Temp.empty())
+    unlink(file.Temp.c_str());
+  file.Fd = -1;
+}
+
+bool Installer::Holds(const Path& path) const
+{
+  if (Batch.empty())
+    return false;
+
+  std::string prefix(path);
+  if (prefix.empty() || prefix[prefix.length() - 1] != '/')
+    prefix += '/';
+  if (BatchDirectory == path ||
+      BatchDirectory.compare(0, prefix.length(), prefix) == 0)
+    return true;
+
+  for (PendingArray::const_iterator i = Batch.begin(); i != Batch.end(); i++)
+    if ((*i).Dest == path)
+      return true;
+  return false;
+}
+
+void Installer::Install(Pending& file)
+{
+#ifdef O_TMPFILE
+  if (file.Temp.empty()) {
+    char link[64];
+    std::snprintf(link, sizeof link, "/proc/self/fd/%d", file.Fd);
+
+    if (linkat(AT_FDCWD, link, AT_FDCWD, file.Dest.c_str(),
+	       AT_SYMLINK_FOLLOW) == 0)
+      return;
+    if (errno != EEXIST)
+      throw Exception("Failed to install '" + file.Dest + "'");
+
+    // Something is already there, so the file is given a name of its
+    // own and renamed over it.
+    for (;;) {
+      file.Temp = TempName(file.Dest);
+      if (linkat(AT_FDCWD, link, AT_FDCWD, file.Temp.c_str(),
+		 AT_SYMLINK_FOLLOW) == 0)
+	break;
+      if (errno != EEXIST) {
+	file.Temp.clear();
+	throw Exception("Failed to install '" + file.Dest + "'");
+      }
+    }
+  }
+#endif
+
+  if (rename(file.Temp.c_str(), file.Dest.c_str()) == -1)
+    throw Exception("Failed to install '" + file.Dest + "'");
+  file.Temp.clear();
+}
+
+void Installer::Flush()
+{
+  FlushBatch(false);
+}
+
+void Installer::Sync()
+{
+  FlushBatch(true);
+}
+
+void Installer::FlushBatch(bool wholeVolume)
+{
+  if (Batch.empty())
+    return;
+
+  PendingArray batch;
+  batch.swap(Batch);
+
+  std::string error;
+
+  // The data of the whole batch must be on disk before any of it is
+  // given its name, or a crash could leave an empty file in place of
+  // a good one.  Writeback of every file is started before any is
+  // waited for, so that the disk is handed the whole batch at once,
+  // and each fsync then finds its file's data mostly written.  Any
+  // error starting it shows up again when it is waited for.
+#ifdef HAVE_SYNC_FILE_RANGE
+  for (PendingArray::iterator i = batch.begin(); i != batch.end(); i++)
+    sync_file_range((*i).Fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+
+#ifndef HAVE_SYNCFS
+  wholeVolume = false;
+#endif
+  if (wholeVolume) {
+#ifdef HAVE_SYNCFS
+    if (syncfs(batch.front().Fd) == -1)
+      error = "Failed to sync '" + batch.front().Dest + "'";
+#endif
+  } else {
+    for (PendingArray::iterator i = batch.begin(); i != batch.end(); i++)
+      if (fsync((*i).Fd) == -1) {
+	error = "Failed to sync '" + (*i).Dest + "'";
+	break;
+      }
+  }
+
+  bool installed = false;
+  for (PendingArray::iterator i = batch.begin(); i != batch.end(); i++) {
+    if (error.empty()) {
+      try {
+	Install(*i);
+	installed = true;
+      }
+      catch (const std::exception& err) {
+	error = err.what();
+      }
+    }
+    Abandon(*i);
+  }
+
+  if (installed) {
+    int dir = open(BatchDirectory.c_str(), O_RDONLY | O_DIRECTORY);
+    if ((dir == -1 || fsync(dir) == -1) && error.empty())
+      error = "Failed to sync directory '" + BatchDirectory + "'";
+    if (dir != -1)
+      close(dir);
+  }
+
+  if (! error.empty())
+    throw Exception(error);
+}
+
+} // namespace Attic
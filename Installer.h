@@ -0,0 +1,77 @@
+#ifndef _INSTALLER_H
+#define _INSTALLER_H
+
+#include "Path.h"
+
+#include <vector>
+
+namespace Attic {
+
+// An Installer puts new files into place so that a crash never leaves
+// one half-written under its final name.  Each file is written to an
+// anonymous O_TMPFILE in the directory it is bound for, or to a hidden
+// temporary name where that is not possible, and is only linked or
+// renamed into place once its data is safely on disk.
+//
+// Rather than syncing every file by itself, the files bound for one
+// directory are gathered into a batch.  When the batch is full, or the
+// next file is bound elsewhere, or Flush is called, the data of each
+// file in the batch is made durable by an fsync, the files are moved
+// into place, and then the directory is synced once to keep their
+// names.  Only Sync, once everything has been written, makes the last
+// batch durable by one syncfs of the volume instead, since in the
+// middle of a run that would wait on every other writer to it too.
+//
+// A file replaces whatever was at its path only at that point, and
+// takes over the old file's permissions and ownership; any other hard
+// links to the old file are left pointing to it.  Files still waiting
+// when the Installer is destroyed were never installed, and are thrown
+// away.
+
+#define INSTALL_BATCH_SIZE 64	// also bounds the descriptors held open
+
+class Installer
+{
+public:
+  Installer();
+  ~Installer();
+
+  // Open a new, empty file which is to become dest.  Either Close or
+  // Discard must follow before the next call to Open.
+  int  Open(const Path& dest);
+  void Close();			// it is complete; install it with its batch
+  void Discard();		// it could not be written; remove it
+
+  // True if path, or anything beneath it, is waiting to be installed.
+  bool Holds(const Path& path) const;
+
+  void Flush();
+  void Sync();			// the last Flush, when nothing more follows
+
+private:
+  struct Pending {
+    int	 Fd;
+    Path Temp;			// empty if the file is anonymous
+    Path Dest;
+
+    Pending() : Fd(-1) {}
+  };
+
+  typedef std::vector<Pending> PendingArray;
+
+  PendingArray Batch;
+  Path	       BatchDirectory;
+  Pending      Current;		// between Open and Close
+  bool	       UseTmpFile;	// cleared once O_TMPFILE is refused
+  unsigned int NextTemp;
+
+  Path TempName(const Path& dest);
+  int  OpenTemp(const Path& dest, Path& temp);
+  void Install(Pending& file);
+  void Abandon(Pending& file);
+  void FlushBatch(bool wholeVolume);
+};
+
+} // namespace Attic
+
+#endif // _INSTALLER_H
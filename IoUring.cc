@@ -0,0 +1,253 @@
+#include "IoUring.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include "error.h"
+
+#include <cstring>
+#include <vector>
+
+#include <boost/thread/once.hpp>
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace Attic {
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params * p)
+{
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, void * arg,
+			     unsigned int count)
+{
+  return (int) syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+static int io_uring_enter(int fd, unsigned int toSubmit,
+			  unsigned int minComplete, unsigned int flags)
+{
+  return (int) syscall(__NR_io_uring_enter, fd, toSubmit, minComplete,
+		       flags, NULL, 0);
+}
+
+#define RING_FIELD(ring, offset) \
+  reinterpret_cast<unsigned int *>(static_cast<char *>(ring) + (offset))
+
+IoUring::IoUring(unsigned int entries)
+  : RingFd(-1), SqRing(MAP_FAILED), CqRing(MAP_FAILED),
+    Sqes(static_cast<struct io_uring_sqe *>(MAP_FAILED)), Unsubmitted(0),
+    InFlight(0)
+{
+  struct io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+
+  RingFd = io_uring_setup(entries, &params);
+  if (RingFd == -1)
+    throw Exception(std::string("Failed to set up io_uring: ") +
+		    std::strerror(errno));
+
+  Entries    = params.sq_entries;
+  SqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  CqRingSize = (params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe));
+
+  bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (singleMap) {
+    if (CqRingSize > SqRingSize)
+      SqRingSize = CqRingSize;
+    CqRingSize = SqRingSize;
+  }
+
+  SqRing = mmap(NULL, SqRingSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, RingFd, IORING_OFF_SQ_RING);
+  if (SqRing == MAP_FAILED) {
+    close(RingFd);
+    throw Exception("Failed to map io_uring submission queue");
+  }
+
+  if (singleMap) {
+    CqRing = SqRing;
+  } else {
+    CqRing = mmap(NULL, CqRingSize, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, RingFd, IORING_OFF_CQ_RING);
+    if (CqRing == MAP_FAILED) {
+      munmap(SqRing, SqRingSize);
+      close(RingFd);
+      throw Exception("Failed to map io_uring completion queue");
+    }
+  }
+
+  Sqes = static_cast<struct io_uring_sqe *>
+    (mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+	  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	  RingFd, IORING_OFF_SQES));
+  if (Sqes == MAP_FAILED) {
+    if (CqRing != SqRing)
+      munmap(CqRing, CqRingSize);
+    munmap(SqRing, SqRingSize);
+    close(RingFd);
+    throw Exception("Failed to map io_uring submission entries");
+  }
+
+  SqHead  = RING_FIELD(SqRing, params.sq_off.head);
+  SqTail  = RING_FIELD(SqRing, params.sq_off.tail);
+  SqMask  = RING_FIELD(SqRing, params.sq_off.ring_mask);
+  SqArray = RING_FIELD(SqRing, params.sq_off.array);
+  CqHead  = RING_FIELD(CqRing, params.cq_off.head);
+  CqTail  = RING_FIELD(CqRing, params.cq_off.tail);
+  CqMask  = RING_FIELD(CqRing, params.cq_off.ring_mask);
+  Cqes	  = reinterpret_cast<struct io_uring_cqe *>
+    (static_cast<char *>(CqRing) + params.cq_off.cqes);
+}
+
+IoUring::~IoUring()
+{
+  munmap(Sqes, Entries * sizeof(struct io_uring_sqe));
+  if (CqRing != SqRing)
+    munmap(CqRing, CqRingSize);
+  munmap(SqRing, SqRingSize);
+  close(RingFd);
+}
+
+struct io_uring_sqe * IoUring::GetSubmission()
+{
+  // Only we ever move the tail, but the kernel moves the head.
+  unsigned int tail = *SqTail + Unsubmitted;
+  unsigned int head = __atomic_load_n(SqHead, __ATOMIC_ACQUIRE);
+  if (tail - head >= Entries)
+    return NULL;
+
+  unsigned int index = tail & *SqMask;
+  struct io_uring_sqe * sqe = &Sqes[index];
+  std::memset(sqe, 0, sizeof(*sqe));
+  SqArray[index] = index;
+  Unsubmitted++;
+  return sqe;
+}
+
+unsigned int IoUring::Offered() const
+{
+  return *SqTail - __atomic_load_n(SqHead, __ATOMIC_ACQUIRE);
+}
+
+void IoUring::Submit(unsigned int waitCount)
+{
+  if (Unsubmitted) {
+    __atomic_store_n(SqTail, *SqTail + Unsubmitted, __ATOMIC_RELEASE);
+    Unsubmitted = 0;
+  }
+
+  // The kernel may take fewer entries than it was offered, so keep
+  // offering the rest until all are in, and only then wait.  While
+  // the completion queue is full (EBUSY) it takes nothing at all, so
+  // the caller is left to reap some; the entries it has not taken
+  // stay in the ring, and are offered again next time.
+  for (;;) {
+    unsigned int toSubmit = Offered();
+    bool	 wait	  = toSubmit == 0;
+    if (wait && waitCount == 0)
+      return;
+
+    int result = io_uring_enter(RingFd, toSubmit, wait ? waitCount : 0,
+				wait ? IORING_ENTER_GETEVENTS : 0);
+    if (result == -1) {
+      if (errno == EBUSY)
+	return;
+      if (errno != EINTR && errno != EAGAIN)
+	throw Exception(std::string("Failed to submit to io_uring: ") +
+			std::strerror(errno));
+      continue;
+    }
+
+    InFlight += result;
+    if (wait)
+      return;
+  }
+}
+
+bool IoUring::NextCompletion(unsigned long long& userData, int& result)
+{
+  unsigned int head = *CqHead;
+  if (head == __atomic_load_n(CqTail, __ATOMIC_ACQUIRE))
+    return false;
+
+  struct io_uring_cqe * cqe = &Cqes[head & *CqMask];
+  userData = cqe->user_data;
+  result   = cqe->res;
+
+  __atomic_store_n(CqHead, head + 1, __ATOMIC_RELEASE);
+  InFlight--;
+  return true;
+}
+
+bool IoUring::Drain()
+{
+  // Queued entries were never published to the kernel, so dropping
+  // them is enough.  Those it was offered but has not taken cannot be
+  // withdrawn, since it would take them with the next call, so they
+  // are submitted and waited for like the rest.
+  Unsubmitted = 0;
+
+  for (;;) {
+    unsigned long long userData;
+    int		       result;
+    while (NextCompletion(userData, result))
+      ;
+
+    unsigned int toSubmit = Offered();
+    if (toSubmit == 0 && InFlight == 0)
+      break;
+
+    int taken = toSubmit > 0 ?
+      io_uring_enter(RingFd, toSubmit, 0, 0) :
+      io_uring_enter(RingFd, 0, InFlight, IORING_ENTER_GETEVENTS);
+    if (taken == -1) {
+      if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+	return false;
+      continue;
+    }
+    InFlight += taken;
+  }
+  return true;
+}
+
+static bool		 StatxSupported = false;
+static boost::once_flag StatxProbed	= BOOST_ONCE_INIT;
+
+static void ProbeStatx()
+{
+  struct io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  int fd = io_uring_setup(1, &params);
+  if (fd == -1)
+    return;
+
+  // Ask the kernel which operations it supports.  A kernel too old to
+  // answer is also too old for IORING_OP_STATX.
+  std::size_t size = (sizeof(struct io_uring_probe) +
+		      256 * sizeof(struct io_uring_probe_op));
+  std::vector<char> buffer(size);
+  struct io_uring_probe * probe =
+    reinterpret_cast<struct io_uring_probe *>(&buffer[0]);
+
+  if (io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+      probe->ops_len > IORING_OP_STATX &&
+      (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED))
+    StatxSupported = true;
+
+  close(fd);
+}
+
+bool IoUring::Available()
+{
+  boost::call_once(ProbeStatx, StatxProbed);
+  return StatxSupported;
+}
+
+} // namespace Attic
+
+#endif // HAVE_LINUX_IO_URING_H
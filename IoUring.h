@@ -0,0 +1,83 @@
+#ifndef _IOURING_H
+#define _IOURING_H
+
+#include "acconf.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <linux/io_uring.h>
+
+namespace Attic {
+
+// A minimal wrapper around a Linux io_uring instance, driven through
+// the raw io_uring_setup and io_uring_enter system calls so that no
+// extra library is needed.  It is used to keep many metadata requests
+// in flight at once from a single thread.  An IoUring is not
+// thread-safe; each thread which needs one should create its own.
+
+class IoUring
+{
+  int	       RingFd;
+  unsigned int Entries;
+
+  void *	      SqRing;
+  void *	      CqRing;
+  unsigned int	      SqRingSize;
+  unsigned int	      CqRingSize;
+  struct io_uring_sqe * Sqes;
+
+  unsigned int *      SqHead;
+  unsigned int *      SqTail;
+  unsigned int *      SqMask;
+  unsigned int *      SqArray;
+  unsigned int *      CqHead;
+  unsigned int *      CqTail;
+  unsigned int *      CqMask;
+  struct io_uring_cqe * Cqes;
+
+  unsigned int	      Unsubmitted;
+  unsigned int	      InFlight;	// submitted, but not yet completed
+
+  // Entries published to the kernel that it has not taken yet.
+  unsigned int Offered() const;
+
+public:
+  explicit IoUring(unsigned int entries);
+  ~IoUring();
+
+  unsigned int Size() const {
+    return Entries;
+  }
+
+  // Returns a cleared submission entry, or NULL if the submission
+  // queue is full (in which case, call Submit first).
+  struct io_uring_sqe * GetSubmission();
+
+  // Submit everything queued so far, and then wait until at least
+  // waitCount completions are available.  If the completion queue is
+  // full, this returns early, having waited for nothing; whatever was
+  // not submitted then is submitted by the next call, after some of
+  // the completions have been taken.
+  void Submit(unsigned int waitCount = 0);
+
+  // Take the next completion, if there is one.
+  bool NextCompletion(unsigned long long& userData, int& result);
+
+  // Forget whatever has been queued but not submitted, and wait for
+  // everything submitted to complete, throwing the completions away.
+  // This must be done before giving up on a batch whose requests
+  // point into memory that is about to be freed.  Returns false if
+  // the wait itself failed, in which case the kernel may still be
+  // using that memory, and the ring should not be used again.
+  bool Drain();
+
+  // Returns false if io_uring cannot be used on this system to stat
+  // files (an old kernel, or one which forbids it).
+  static bool Available();
+};
+
+} // namespace Attic
+
+#endif // HAVE_LINUX_IO_URING_H
+
+#endif // _IOURING_H
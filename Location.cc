@@ -1,11 +1,19 @@
 #include "Location.h"
 #include "StateChange.h"
+#include "Scanner.h"
+#include "ChecksumService.h"
+#include "Arena.h"
 
 namespace Attic {
 
 Location::Location(Broker * _SiteBroker)
   : SiteBroker(_SiteBroker),
+    RootEntry(NULL),
     CurrentChanges(NULL),
+    NodeArena(new Arena),
+    ScanEngine(NULL),
+    HashEngine(NULL),
+    OwnsHashEngine(false),
 
     LowBandwidth(false),
     PreserveChanges(false),
@@ -34,7 +42,16 @@ Location::Location(Broker * _SiteBroker)
     RespectBoundaries(false),
     LoggingOnly(false),
     VerboseLogging(false),
-    ExcludeCVS(false)
+    ExcludeCVS(false),
+    BatchMetadata(false),
+    UseSnapshots(false),
+    CacheChecksums(false),
+    ChecksumAlgorithm(checksum_t::XXH64),
+    VerifyAlgorithm(checksum_t::MD5),
+    TreeChecksumSize(64 * 1024 * 1024),
+    ScanThreads(0),
+    StatAheadThreads(0),
+    ChecksumThreads(0)
 {
 #if 0
   if (SiteBroker)
@@ -43,7 +60,9 @@ Location::Location(Broker * _SiteBroker)
 }
 
 Location::Location(Broker * _SiteBroker, const Location& optionTemplate)
-  : SiteBroker(_SiteBroker)
+  : SiteBroker(_SiteBroker), RootEntry(NULL), CurrentChanges(NULL),
+    NodeArena(new Arena),
+    ScanEngine(NULL), HashEngine(NULL), OwnsHashEngine(false)
 {
 #if 0
   if (SiteBroker)
@@ -54,6 +73,18 @@ Location::Location(Broker * _SiteBroker, const Location& optionTemplate)
 
 Location::~Location()
 {
+  if (ScanEngine)
+    delete ScanEngine;
+  if (HashEngine && OwnsHashEngine)
+    delete HashEngine;
+
+  // Only now that nothing is reading the tree can it be let go.
+  if (SiteBroker && RootEntry) {
+    FileInfo * root = RootEntry;
+    RootEntry = NULL;
+    SiteBroker->ReleaseRoot(root);
+  }
+
   if (SiteBroker)
     delete SiteBroker;
 
@@ -61,6 +92,10 @@ Location::~Location()
        i != Regexps.end();
        i++)
     delete *i;
+
+  // This comes last, since the broker may still touch entries as it
+  // shuts down.
+  delete NodeArena;
 }
 
 FileInfo * Location::FindMember(const Path& path)
@@ -132,6 +167,15 @@ void Location::CopyOptions(const Location& optionTemplate)
   LoggingOnly	      = optionTemplate.LoggingOnly;
   VerboseLogging      = optionTemplate.VerboseLogging;
   ExcludeCVS	      = optionTemplate.ExcludeCVS;
+  BatchMetadata	      = optionTemplate.BatchMetadata;
+  UseSnapshots	      = optionTemplate.UseSnapshots;
+  CacheChecksums      = optionTemplate.CacheChecksums;
+  ChecksumAlgorithm   = optionTemplate.ChecksumAlgorithm;
+  VerifyAlgorithm     = optionTemplate.VerifyAlgorithm;
+  TreeChecksumSize    = optionTemplate.TreeChecksumSize;
+  ScanThreads	      = optionTemplate.ScanThreads;
+  StatAheadThreads    = optionTemplate.StatAheadThreads;
+  ChecksumThreads     = optionTemplate.ChecksumThreads;
 
   Regexps.clear();
 
@@ -144,6 +188,24 @@ void Location::CopyOptions(const Location& optionTemplate)
 
 void Location::Initialize()
 {
+#ifndef SINGLE_THREADED
+  // Only volumes can be scanned in parallel; databases are read in
+  // one piece when loaded.  This is done first, so that the broker
+  // can tell whether a Scanner will be reading ahead for it.
+  if (ScanThreads > 0 && ! ScanEngine &&
+      dynamic_cast<VolumeBroker *>(SiteBroker))
+    ScanEngine = new Scanner(ScanThreads);
+
+  // The files are read on ChecksumThreads threads, so that many
+  // disks can be busy at once, and hashed on one thread per core.
+  if (ChecksumThreads > 0 && UseChecksums && ! HashEngine &&
+      dynamic_cast<VolumeBroker *>(SiteBroker)) {
+    HashEngine = new ChecksumService
+      (ChecksumThreads, std::max(1U, boost::thread::hardware_concurrency()));
+    OwnsHashEngine = true;
+  }
+#endif
+
   SiteBroker->SetRepository(this);
 
   // RCS SCCS CVS  CVS.adm  RCSLOG  cvslog.*  tags  TAGS  .make.state
@@ -190,7 +252,18 @@ void Location::Initialize()
 void Location::ApplyChange(MessageLog * log, const StateChange& change,
 			   const ChangeSet& changeSet)
 {
-  FileInfo * targetInfo(FindOrCreateMember(change.Item->FullName));
+  if (DatabaseBroker * database = dynamic_cast<DatabaseBroker *>(SiteBroker)) {
+    database->RecordChange(change);
+    return;
+  }
+
+  // The root is handed back to our broker once the change is made,
+  // along with the entries created here on the way to the target, so
+  // that a broker which builds a new root every time does not leak a
+  // path's worth for every change applied.
+  BrokerRoot targetRoot(SiteBroker);
+
+  FileInfo * targetInfo(targetRoot->FindOrCreateMember(change.Item->FullName()));
 
   std::string label;
   switch (change.ChangeKind) {
@@ -209,19 +282,26 @@ void Location::ApplyChange(MessageLog * log, const StateChange& change,
     else if (change.Item->IsRegularFile()) {
       if (targetInfo->Exists()) {
 	if (targetInfo->IsRegularFile() &&
-	    targetInfo->Checksum() == change.Item->Checksum()) {
+	    targetInfo->SameChecksum(*change.Item)) {
 	  ChangeSet ignoredChanges;
 	  ignoredChanges.CompareFiles(change.Item, targetInfo);
 	  if (! ignoredChanges.Changes.empty()) {
-	    change.Item->CopyAttributes(targetInfo->Pathname);
+	    SiteBroker->CopyAttributes(*change.Item, targetInfo->Pathname());
 	    label = "p ";
 	    break;
 	  }
 	  return;
 	}
-	targetInfo->Delete();
-	if (log)
-	  LOG(*log, Message, "D " << targetInfo->Moniker());
+
+	// A file is left for the new one to be renamed over, so that
+	// the path is never empty; but anything else must be removed,
+	// as must a file the copy would be written into in place.
+	if (! targetInfo->IsRegularFile() || CopyByOverwrite ||
+	    DeleteBeforeUpdate) {
+	  targetInfo->Delete();
+	  if (log)
+	    LOG(*log, Message, "D " << targetInfo->Moniker());
+	}
       }
 
       // If Duplicate is non-NULL (and this applies only for Add
@@ -238,7 +318,7 @@ void Location::ApplyChange(MessageLog * log, const StateChange& change,
 	       i != change.Duplicates->end();
 	       i++) {
 	    ChangeSet::ChangesMap::const_iterator j =
-	      changeSet.Changes.find((*i)->FullName);
+	      changeSet.Changes.find((*i)->FullName());
 	    if (j != changeSet.Changes.end()) {
 	      for (StateChange * ptr = (*j).second; ptr; ptr = ptr->Next)
 		if (ptr->ChangeKind == StateChange::Remove) {
@@ -253,22 +333,20 @@ void Location::ApplyChange(MessageLog * log, const StateChange& change,
 
 	targetInfo->CreateDirectory();
 	if (markedForDeletion) {
-	  Duplicate->Move(targetInfo->Pathname);
+	  Duplicate->Move(targetInfo->Pathname());
 	  label = "m ";
 	  break;
 	} else {
-	  Duplicate->Copy(targetInfo->Pathname);
+	  Duplicate->Copy(targetInfo->Pathname());
 	  label = "u ";
 	  break;
 	}
       }
 
-      // jww (2006-11-21): A direct copy will not work here, rather I
-      // need to pass the source FileInfo to the target Broker, giving
-      // the FullName, and let it manage the installation of the
-      // contents.
-      //change.Item->Copy(targetInfo->Pathname);
-      change.Item->Copy(SiteBroker->FullPath(targetInfo->FullName));
+      // The contents are handed to our own broker, which decides how
+      // they are to be installed.
+      SiteBroker->Copy(*change.Item,
+		       SiteBroker->FullPath(targetInfo->FullName()));
       label = "U ";
     }
     else {
@@ -284,14 +362,14 @@ void Location::ApplyChange(MessageLog * log, const StateChange& change,
 
   case StateChange::Update:
     if (change.Item->IsRegularFile())
-      change.Item->Copy(targetInfo->Pathname);
+      SiteBroker->Update(*change.Item, *targetInfo);
     else
       assert(0);
     label = "P ";
     break;
 
   case StateChange::UpdateAttrs:
-    change.Item->CopyAttributes(targetInfo->Pathname);
+    SiteBroker->CopyAttributes(*change.Item, targetInfo->Pathname());
     label = "p ";
     break;
 
@@ -300,21 +378,65 @@ void Location::ApplyChange(MessageLog * log, const StateChange& change,
     break;
   }
 
+  // A file's new contents are read back and checked against its
+  // source by a checksum strong enough to be trusted for it, rather
+  // than the one used to find changes.  They must be installed first.
+  if (ChecksumVerify && change.Item->IsRegularFile() &&
+      (change.ChangeKind == StateChange::Add ||
+       change.ChangeKind == StateChange::Update)) {
+    UnverifiedCopy copy;
+    copy.Expected      = change.Item->CurrentChecksum(VerifyAlgorithm);
+    copy.Target	       = targetInfo->Pathname();
+    copy.SourceMoniker = change.Item->Moniker();
+    copy.TargetMoniker = targetInfo->Moniker();
+    Unverified.push_back(copy);
+
+    if (Unverified.size() >= VERIFY_BATCH_SIZE) {
+      SiteBroker->Flush();
+      VerifyCopies();
+    }
+  }
+
   if (log)
     LOG(*log, Message, label << change.Item->Moniker());
 }
 
+void Location::VerifyCopies()
+{
+  std::vector<UnverifiedCopy> copies;
+  copies.swap(Unverified);
+
+  for (std::vector<UnverifiedCopy>::iterator i = copies.begin();
+       i != copies.end();
+       i++) {
+    checksum_t csum;
+    SiteBroker->ComputeChecksum((*i).Target, VerifyAlgorithm, csum);
+    if (csum != (*i).Expected)
+      throw Exception("Copy of '" + (*i).SourceMoniker + "' to '" +
+		      (*i).TargetMoniker + "' failed verification");
+  }
+}
+
+void Location::Sync()
+{
+  SiteBroker->Sync();
+  VerifyCopies();
+}
+
 void Location::Install(const FileInfo& newEntry)
 {
   assert(Root());
 
-  FileInfo * entry = Root()->FindOrCreateMember(newEntry.FullName);
+  FileInfo * entry = Root()->FindOrCreateMember(newEntry.FullName());
   entry->Copy(newEntry);
 }
 
 void Location::RegisterChecksums(FileInfo * entry)
 {
   if (entry->IsRegularFile()) {
+    if (! entry->ChecksumKnown())
+      return;
+
     ChecksumMap::iterator i = EntriesByChecksum.find(entry->Checksum());
     if (i == EntriesByChecksum.end()) {
       FileInfoArray entryArray;
@@ -325,10 +447,10 @@ void Location::RegisterChecksums(FileInfo * entry)
     }
   }
   else if (entry->IsDirectory()) {
-    for (FileInfo::ChildrenMap::const_iterator i = entry->ChildrenBegin();
+    for (FileInfo::ChildrenArray::const_iterator i = entry->ChildrenBegin();
 	 i != entry->ChildrenEnd();
 	 i++)
-      RegisterChecksums((*i).second);
+      RegisterChecksums(*i);
   }
 }
 
@@ -349,25 +471,25 @@ void StateMap::ApplyChange(const StateChange& change)
 
   switch (change.ChangeKind) {
   case StateChange::Add:
-    entry = Root->FindOrCreateMember(change.Item->FullName);
+    entry = Root->FindOrCreateMember(change.Item->FullName());
     change.Item->CopyDetails(*entry, true);
     change.Item->CopyAttributes(*entry, true);
     break;
 
   case StateChange::Remove:
-    entry = Root->FindMember(change.Item->FullName);
+    entry = Root->FindMember(change.Item->FullName());
     if (entry)
       entry->Parent->DestroyChild(entry);
     break;
 
   case StateChange::Update:
-    entry = Root->FindMember(change.Item->FullName);
+    entry = Root->FindMember(change.Item->FullName());
     if (entry)
       change.Item->CopyDetails(*entry, true);
     break;
 
   case StateChange::UpdateAttrs:
-    entry = Root->FindMember(change.Item->FullName);
+    entry = Root->FindMember(change.Item->FullName());
     if (entry)
       change.Item->CopyAttributes(*entry, true);
     break;
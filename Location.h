@@ -14,9 +14,15 @@
 
 namespace Attic {
 
+class Scanner;
+class ChecksumService;
+class Arena;
+
 // A Location represents a directory on a mounted volume or a remote
 // host, with an associated state map.
 
+#define VERIFY_BATCH_SIZE 64	// copies made before the broker is flushed
+
 class Location
 {
 public:
@@ -30,8 +36,13 @@ public:
 
   mutable FileInfo * RootEntry;
 
+  // The root is found once, and handed back to the broker only when
+  // the Location is destroyed, so that every entry reached through it
+  // (and held by a ChangeSet or a Scanner) lives as long as it does.
   FileInfo * Root() const {
-    return SiteBroker->FindRoot();
+    if (! RootEntry)
+      RootEntry = SiteBroker->FindRoot();
+    return RootEntry;
   }
   void SetRoot(FileInfo * root) {
     RootEntry = root;
@@ -40,8 +51,8 @@ public:
   FileInfo * FindMember(const Path& path);
   FileInfo * FindOrCreateMember(const Path& path);
 
-  typedef std::map<md5sum_t, FileInfoArray>  ChecksumMap;
-  typedef std::pair<md5sum_t, FileInfoArray> ChecksumPair;
+  typedef std::map<checksum_t, FileInfoArray>  ChecksumMap;
+  typedef std::pair<checksum_t, FileInfoArray> ChecksumPair;
 
   ChecksumMap EntriesByChecksum;
 
@@ -64,6 +75,23 @@ public:
 
   std::vector<Regex *> Regexps;
 
+  // All the FileInfo entries of this location's trees, and their
+  // directory maps, are allocated from NodeArena.  When the Location
+  // is destroyed, it is released in one piece, without destroying any
+  // entries still alive one at a time.
+  Arena * NodeArena;
+
+  // If ScanThreads is non-zero, directories at this location are
+  // read ahead of the comparer by a pool of worker threads.
+  Scanner * ScanEngine;
+
+  // If ChecksumThreads is non-zero, the files whose checksums the
+  // comparer is about to need are read and hashed ahead of it.  A
+  // DataPool gives all its Locations the one service, which it owns;
+  // otherwise the Location makes one of its own.
+  ChecksumService * HashEngine;
+  bool		    OwnsHashEngine;
+
   // If LowBandwidth is true, signature files will be kept in the
   // state map for the common ancestor so that this data need not be
   // transferred to us before we begin sending deltas.  Note that this
@@ -97,6 +125,17 @@ public:
   bool LoggingOnly;		// -n if true, don't transfer, just log operations
   bool VerboseLogging;		// -v if true, make logging much more verbose
   bool ExcludeCVS;		// -C if true, exclude files related to CVS
+  bool BatchMetadata;		// -a if true, stat many entries at once (io_uring)
+  bool UseSnapshots;		// -m if true, compare only lengths & times, in bulk
+  bool CacheChecksums;		// -k if true, remember checksums between runs
+
+  checksum_t::Algorithm ChecksumAlgorithm; // -K which checksum finds changes
+  checksum_t::Algorithm VerifyAlgorithm;   //    which checksum verifies copies
+  unsigned long long TreeChecksumSize; // -T files this long hash in chunks
+
+  unsigned int ScanThreads;	// -j if non-zero, read directories in parallel
+  unsigned int StatAheadThreads; // -A if non-zero, stat ahead of the comparer
+  unsigned int ChecksumThreads;	// -H if non-zero, read files to hash ahead
 
   // Initialize this location using optionTemplate to determine the
   // default values for options.
@@ -107,6 +146,14 @@ public:
   void CopyOptions(const Location& optionTemplate);
   void Initialize();
 
+  // Files of TreeChecksumSize or more are hashed by the tree form of
+  // ChecksumAlgorithm, so that their chunks can be hashed in parallel.
+  checksum_t::Algorithm ChecksumAlgorithmFor(unsigned long long length) const {
+    if (TreeChecksumSize && length >= TreeChecksumSize)
+      return checksum_t::Tree(ChecksumAlgorithm);
+    return ChecksumAlgorithm;
+  }
+
   FileInfoArray * ExistsAtLocation(const FileInfo * Item) const {
 #if 0
     Location * currentState = SiteBroker;
@@ -120,6 +167,26 @@ public:
 
   void ApplyChange(MessageLog * log, const StateChange& change,
 		   const ChangeSet& changeSet);
+
+  // Make every change applied here durable, and check any copies not
+  // verified yet.  None of them is certain before this returns.
+  void Sync();
+
+private:
+  // With ChecksumVerify, a copy can only be read back once its broker
+  // has put it in place, so rather than flushing the broker for each
+  // one, copies wait here with their sources' checksums, taken as they
+  // were made, and are checked VERIFY_BATCH_SIZE at a time.
+  struct UnverifiedCopy {
+    checksum_t	Expected;
+    Path	Target;
+    std::string SourceMoniker;
+    std::string TargetMoniker;
+  };
+
+  std::vector<UnverifiedCopy> Unverified;
+
+  void VerifyCopies();
 };
 
 } // namespace Attic
@@ -0,0 +1,272 @@
+#include "MD5Lanes.h"
+
+#include <cassert>
+
+namespace Attic {
+
+#ifdef __GNUC__
+#define MD5_VECTOR_LANES
+#if defined(__x86_64__) || defined(__i386__)
+#define MD5_DISPATCH_X86
+#endif
+#endif
+
+#ifdef MD5_VECTOR_LANES
+
+// GCC's generic vectors are lowered to whatever the target of the
+// function using them supports, so the same round code serves each
+// width; only the functions at the bottom are compiled for AVX2 and
+// AVX-512.
+typedef md5_word_t md5_vec4_t  __attribute__((vector_size(16)));
+typedef md5_word_t md5_vec8_t  __attribute__((vector_size(32)));
+typedef md5_word_t md5_vec16_t __attribute__((vector_size(64)));
+
+#define ROTATE_LEFT(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+#define SET(f, a, b, c, d, k, s, Ti)		\
+  a += f(b, c, d) + X[k] + (md5_word_t)(Ti);	\
+  a = ROTATE_LEFT(a, s) + b
+
+template <typename V, unsigned int N>
+static inline __attribute__((always_inline))
+void ProcessLanes(md5_state_t * const states[],
+		  const md5_byte_t * const data[], std::size_t blocks)
+{
+  V a, b, c, d;
+  for (unsigned int lane = 0; lane < N; lane++) {
+    a[lane] = states[lane]->abcd[0];
+    b[lane] = states[lane]->abcd[1];
+    c[lane] = states[lane]->abcd[2];
+    d[lane] = states[lane]->abcd[3];
+  }
+
+  for (std::size_t block = 0; block < blocks; block++) {
+    // Word k of every lane's block goes into X[k], one per lane.
+    // Reading the bytes one at a time keeps this right on either byte
+    // order; on a little-endian machine it is simply a load.
+    V X[16];
+    for (unsigned int lane = 0; lane < N; lane++) {
+      const md5_byte_t * xp = data[lane] + block * MD5_BLOCK_SIZE;
+      for (unsigned int k = 0; k < 16; k++, xp += 4)
+	X[k][lane] = (xp[0] | (xp[1] << 8) | (xp[2] << 16) |
+		      ((md5_word_t)xp[3] << 24));
+    }
+
+    V aa = a, bb = b, cc = c, dd = d;
+
+    SET(F, a, b, c, d,  0,  7, 0xd76aa478);
+    SET(F, d, a, b, c,  1, 12, 0xe8c7b756);
+    SET(F, c, d, a, b,  2, 17, 0x242070db);
+    SET(F, b, c, d, a,  3, 22, 0xc1bdceee);
+    SET(F, a, b, c, d,  4,  7, 0xf57c0faf);
+    SET(F, d, a, b, c,  5, 12, 0x4787c62a);
+    SET(F, c, d, a, b,  6, 17, 0xa8304613);
+    SET(F, b, c, d, a,  7, 22, 0xfd469501);
+    SET(F, a, b, c, d,  8,  7, 0x698098d8);
+    SET(F, d, a, b, c,  9, 12, 0x8b44f7af);
+    SET(F, c, d, a, b, 10, 17, 0xffff5bb1);
+    SET(F, b, c, d, a, 11, 22, 0x895cd7be);
+    SET(F, a, b, c, d, 12,  7, 0x6b901122);
+    SET(F, d, a, b, c, 13, 12, 0xfd987193);
+    SET(F, c, d, a, b, 14, 17, 0xa679438e);
+    SET(F, b, c, d, a, 15, 22, 0x49b40821);
+
+    SET(G, a, b, c, d,  1,  5, 0xf61e2562);
+    SET(G, d, a, b, c,  6,  9, 0xc040b340);
+    SET(G, c, d, a, b, 11, 14, 0x265e5a51);
+    SET(G, b, c, d, a,  0, 20, 0xe9b6c7aa);
+    SET(G, a, b, c, d,  5,  5, 0xd62f105d);
+    SET(G, d, a, b, c, 10,  9, 0x02441453);
+    SET(G, c, d, a, b, 15, 14, 0xd8a1e681);
+    SET(G, b, c, d, a,  4, 20, 0xe7d3fbc8);
+    SET(G, a, b, c, d,  9,  5, 0x21e1cde6);
+    SET(G, d, a, b, c, 14,  9, 0xc33707d6);
+    SET(G, c, d, a, b,  3, 14, 0xf4d50d87);
+    SET(G, b, c, d, a,  8, 20, 0x455a14ed);
+    SET(G, a, b, c, d, 13,  5, 0xa9e3e905);
+    SET(G, d, a, b, c,  2,  9, 0xfcefa3f8);
+    SET(G, c, d, a, b,  7, 14, 0x676f02d9);
+    SET(G, b, c, d, a, 12, 20, 0x8d2a4c8a);
+
+    SET(H, a, b, c, d,  5,  4, 0xfffa3942);
+    SET(H, d, a, b, c,  8, 11, 0x8771f681);
+    SET(H, c, d, a, b, 11, 16, 0x6d9d6122);
+    SET(H, b, c, d, a, 14, 23, 0xfde5380c);
+    SET(H, a, b, c, d,  1,  4, 0xa4beea44);
+    SET(H, d, a, b, c,  4, 11, 0x4bdecfa9);
+    SET(H, c, d, a, b,  7, 16, 0xf6bb4b60);
+    SET(H, b, c, d, a, 10, 23, 0xbebfbc70);
+    SET(H, a, b, c, d, 13,  4, 0x289b7ec6);
+    SET(H, d, a, b, c,  0, 11, 0xeaa127fa);
+    SET(H, c, d, a, b,  3, 16, 0xd4ef3085);
+    SET(H, b, c, d, a,  6, 23, 0x04881d05);
+    SET(H, a, b, c, d,  9,  4, 0xd9d4d039);
+    SET(H, d, a, b, c, 12, 11, 0xe6db99e5);
+    SET(H, c, d, a, b, 15, 16, 0x1fa27cf8);
+    SET(H, b, c, d, a,  2, 23, 0xc4ac5665);
+
+    SET(I, a, b, c, d,  0,  6, 0xf4292244);
+    SET(I, d, a, b, c,  7, 10, 0x432aff97);
+    SET(I, c, d, a, b, 14, 15, 0xab9423a7);
+    SET(I, b, c, d, a,  5, 21, 0xfc93a039);
+    SET(I, a, b, c, d, 12,  6, 0x655b59c3);
+    SET(I, d, a, b, c,  3, 10, 0x8f0ccc92);
+    SET(I, c, d, a, b, 10, 15, 0xffeff47d);
+    SET(I, b, c, d, a,  1, 21, 0x85845dd1);
+    SET(I, a, b, c, d,  8,  6, 0x6fa87e4f);
+    SET(I, d, a, b, c, 15, 10, 0xfe2ce6e0);
+    SET(I, c, d, a, b,  6, 15, 0xa3014314);
+    SET(I, b, c, d, a, 13, 21, 0x4e0811a1);
+    SET(I, a, b, c, d,  4,  6, 0xf7537e82);
+    SET(I, d, a, b, c, 11, 10, 0xbd3af235);
+    SET(I, c, d, a, b,  2, 15, 0x2ad7d2bb);
+    SET(I, b, c, d, a,  9, 21, 0xeb86d391);
+
+    a += aa;
+    b += bb;
+    c += cc;
+    d += dd;
+  }
+
+  for (unsigned int lane = 0; lane < N; lane++) {
+    states[lane]->abcd[0] = a[lane];
+    states[lane]->abcd[1] = b[lane];
+    states[lane]->abcd[2] = c[lane];
+    states[lane]->abcd[3] = d[lane];
+  }
+}
+
+#undef SET
+#undef I
+#undef H
+#undef G
+#undef F
+#undef ROTATE_LEFT
+
+static void Process4(md5_state_t * const states[],
+		     const md5_byte_t * const data[], std::size_t blocks)
+{
+  ProcessLanes<md5_vec4_t, 4>(states, data, blocks);
+}
+
+#ifdef MD5_DISPATCH_X86
+__attribute__((target("avx2")))
+static void Process8(md5_state_t * const states[],
+		     const md5_byte_t * const data[], std::size_t blocks)
+{
+  ProcessLanes<md5_vec8_t, 8>(states, data, blocks);
+}
+
+__attribute__((target("avx512f")))
+static void Process16(md5_state_t * const states[],
+		      const md5_byte_t * const data[], std::size_t blocks)
+{
+  ProcessLanes<md5_vec16_t, 16>(states, data, blocks);
+}
+#endif
+
+#endif // MD5_VECTOR_LANES
+
+typedef void (*md5_lanes_func_t)(md5_state_t * const states[],
+				 const md5_byte_t * const data[],
+				 std::size_t blocks);
+
+static unsigned int     LaneWidth;
+static md5_lanes_func_t LaneFunction;
+
+static void ChooseLanes()
+{
+#ifdef MD5_VECTOR_LANES
+#ifdef MD5_DISPATCH_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    LaneFunction = Process16;
+    LaneWidth	 = 16;
+    return;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    LaneFunction = Process8;
+    LaneWidth	 = 8;
+    return;
+  }
+#ifndef __SSE2__
+  if (! __builtin_cpu_supports("sse2")) {
+    LaneWidth = 1;
+    return;
+  }
+#endif
+#endif
+  LaneFunction = Process4;
+  LaneWidth    = 4;
+#else
+  LaneWidth = 1;
+#endif
+}
+
+unsigned int MD5Lanes::Width()
+{
+  // Statics are initialized once, even if several threads get here
+  // at the same time.
+  static bool chosen = (ChooseLanes(), true);
+  (void)chosen;
+  return LaneWidth;
+}
+
+void MD5Lanes::Update(md5_state_t * const states[],
+		      const md5_byte_t * const data[],
+		      unsigned int count, std::size_t blocks)
+{
+  unsigned int width = Width();
+  assert(count <= width);
+
+  if (count == 0 || blocks == 0)
+    return;
+
+  for (unsigned int i = 0; i < count; i++)
+    assert((states[i]->count[0] & (MD5_BLOCK_SIZE * 8 - 1)) == 0);
+
+  // A single message gains nothing from the lanes.
+  if (width == 1 || count == 1) {
+    for (unsigned int i = 0; i < count; i++)
+      for (std::size_t block = 0; block < blocks; block++)
+	md5_append(states[i], data[i] + block * MD5_BLOCK_SIZE,
+		   MD5_BLOCK_SIZE);
+    return;
+  }
+
+  // Any lanes left over hash a copy of the first message into a state
+  // which is then thrown away.
+  md5_state_t		spare;
+  md5_state_t *		laneStates[16];
+  const md5_byte_t *	laneData[16];
+  for (unsigned int i = 0; i < width; i++) {
+    if (i < count) {
+      laneStates[i] = states[i];
+      laneData[i]   = data[i];
+    } else {
+      laneStates[i] = &spare;
+      laneData[i]   = data[0];
+    }
+  }
+  md5_init(&spare);
+
+  LaneFunction(laneStates, laneData, blocks);
+
+  // The lengths are kept in bits, as md5_append does.
+  unsigned long long bits =
+    static_cast<unsigned long long>(blocks) * MD5_BLOCK_SIZE * 8;
+  for (unsigned int i = 0; i < count; i++) {
+    unsigned long long total =
+      ((static_cast<unsigned long long>(states[i]->count[1]) << 32) |
+       states[i]->count[0]) + bits;
+    states[i]->count[0] = static_cast<md5_word_t>(total);
+    states[i]->count[1] = static_cast<md5_word_t>(total >> 32);
+  }
+}
+
+} // namespace Attic
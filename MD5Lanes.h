@@ -0,0 +1,40 @@
+#ifndef _MD5LANES_H
+#define _MD5LANES_H
+
+#include "md5.h"
+
+#include <cstddef>
+
+namespace Attic {
+
+// MD5Lanes hashes several independent messages at once, one in each
+// lane of the vector unit: four with SSE2 (or any other 128-bit vector
+// unit GCC can target), eight with AVX2, and sixteen with AVX-512,
+// whichever the processor running us supports.  A single MD5 cannot
+// be made faster this way, since every step depends on the one before
+// it, but many files hashed side by side can.  The lanes work directly
+// on md5_state_t, so md5_append and md5_finish take over for whatever
+// part of each message is not a whole number of blocks, and the
+// digests are exactly those of md5.c.
+
+#define MD5_BLOCK_SIZE 64
+
+class MD5Lanes
+{
+public:
+  // How many messages Update hashes at once on this machine, or one
+  // if there is no vector unit to use.
+  static unsigned int Width();
+
+  // Append the same number of whole blocks to each of count states at
+  // once, those for states[i] starting at data[i].  Any count up to
+  // Width() may be given, and none of the states may have part of a
+  // block still waiting in its buffer.
+  static void Update(md5_state_t * const states[],
+		     const md5_byte_t * const data[],
+		     unsigned int count, std::size_t blocks);
+};
+
+} // namespace Attic
+
+#endif // _MD5LANES_H
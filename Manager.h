@@ -20,8 +20,14 @@ public:
   void operator()() {
     assert(Pool);
     Pool->Initialize();
-    Pool->ComputeChanges();
-    Pool->ApplyChanges(Log);
+    if (Pool->Streaming) {
+      Pool->StreamChanges(Log);
+    } else if (Pool->Pipelined) {
+      Pool->PipelineChanges(Log);
+    } else {
+      Pool->ComputeChanges();
+      Pool->ApplyChanges(Log);
+    }
   }
 };
 
@@ -0,0 +1,112 @@
+#include "NameTable.h"
+#include "error.h"
+
+#include <cstring>
+
+namespace Attic {
+
+static unsigned int HashName(const char * data, std::size_t length)
+{
+  // FNV-1a
+  unsigned int hash = 2166136261U;
+  for (std::size_t i = 0; i < length; i++) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+NameTable::NameTable() : Count(0), Current(NULL), Remaining(0)
+{
+  std::memset(Blocks, 0, sizeof(Blocks));
+  Buckets.resize(1024);
+  Intern("", 0);
+}
+
+NameTable::~NameTable()
+{
+  for (unsigned int i = 0; i < NAMETABLE_MAX_BLOCKS && Blocks[i]; i++)
+    delete[] Blocks[i];
+
+  for (std::vector<char *>::iterator i = Chunks.begin();
+       i != Chunks.end();
+       i++)
+    delete[] *i;
+}
+
+NameTable::name_id_t NameTable::Intern(const char * data, std::size_t length)
+{
+  unsigned int hash = HashName(data, length);
+
+  scoped_lock lock(TableMutex);
+
+  std::size_t mask = Buckets.size() - 1;
+  std::size_t slot = hash & mask;
+  while (Buckets[slot]) {
+    const Entry& entry(EntryFor(Buckets[slot] - 1));
+    if (entry.Hash == hash && entry.Length == length &&
+	std::memcmp(entry.Data, data, length) == 0)
+      return Buckets[slot] - 1;
+    slot = (slot + 1) & mask;
+  }
+
+  name_id_t id = Count;
+  unsigned int block = id >> NAMETABLE_BLOCK_BITS;
+  if (block >= NAMETABLE_MAX_BLOCKS)
+    throw Exception("Too many distinct names");
+  if (! Blocks[block])
+    Blocks[block] = new Entry[NAMETABLE_BLOCK_SIZE];
+
+  Entry& entry(Blocks[block][id & (NAMETABLE_BLOCK_SIZE - 1)]);
+  entry.Data   = Store(data, length);
+  entry.Length = length;
+  entry.Hash   = hash;
+
+  Buckets[slot] = id + 1;
+  __atomic_store_n(&Count, id + 1, __ATOMIC_RELEASE);
+
+  // Keep the table at most half full, so that probes stay short.
+  if (Count * 2 > Buckets.size())
+    Rehash();
+
+  return id;
+}
+
+const char * NameTable::Store(const char * data, std::size_t length)
+{
+  char * text;
+  if (length + 1 > NAMETABLE_CHUNK_SIZE / 4) {
+    text = new char[length + 1];
+    Chunks.push_back(text);
+  } else {
+    if (Remaining < length + 1) {
+      Current	= new char[NAMETABLE_CHUNK_SIZE];
+      Remaining = NAMETABLE_CHUNK_SIZE;
+      Chunks.push_back(Current);
+    }
+    text       = Current;
+    Current   += length + 1;
+    Remaining -= length + 1;
+  }
+
+  std::memcpy(text, data, length);
+  text[length] = '\0';
+  return text;
+}
+
+void NameTable::Rehash()
+{
+  std::vector<name_id_t> buckets(Buckets.size() * 2);
+  std::size_t mask = buckets.size() - 1;
+
+  for (name_id_t id = 0; id < Count; id++) {
+    std::size_t slot = EntryFor(id).Hash & mask;
+    while (buckets[slot])
+      slot = (slot + 1) & mask;
+    buckets[slot] = id + 1;
+  }
+
+  Buckets.swap(buckets);
+}
+
+} // namespace Attic
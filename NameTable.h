@@ -0,0 +1,88 @@
+#ifndef _NAMETABLE_H
+#define _NAMETABLE_H
+
+#include <cassert>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+namespace Attic {
+
+// A NameTable keeps a single copy of each distinct string handed to
+// it, for as long as the table lives, and refers to it thereafter by a
+// small integer id.  FileInfo entries store only the id of their name,
+// so that the many entries sharing a name (Makefile, index.html, and
+// so on) share its storage too, and two names can be compared for
+// equality without looking at them.  Id zero is always the empty
+// string.
+//
+// Interning takes a lock, but looking up an id does not: the storage
+// of a string never moves once it has been interned, and Count is
+// only advanced past an entry, with release ordering, once the entry
+// is complete.  Lookups load Count with acquire ordering, so whatever
+// id they are given, its entry is visible to them.  Strings may
+// contain NULs, and are always followed by one.
+
+#define NAMETABLE_BLOCK_BITS 16
+#define NAMETABLE_BLOCK_SIZE (1 << NAMETABLE_BLOCK_BITS)
+#define NAMETABLE_MAX_BLOCKS 4096 // so, 2^28 distinct names
+#define NAMETABLE_CHUNK_SIZE (256 * 1024)
+
+class NameTable
+{
+public:
+  typedef unsigned int name_id_t;
+  typedef boost::mutex::scoped_lock scoped_lock;
+
+  NameTable();
+  ~NameTable();
+
+  name_id_t Intern(const char * data, std::size_t length);
+  name_id_t Intern(const std::string& name) {
+    return Intern(name.data(), name.length());
+  }
+
+  const char * Data(name_id_t id) const {
+    return EntryFor(id).Data;
+  }
+  std::size_t Length(name_id_t id) const {
+    return EntryFor(id).Length;
+  }
+  std::string Lookup(name_id_t id) const {
+    const Entry& entry(EntryFor(id));
+    return std::string(entry.Data, entry.Length);
+  }
+
+private:
+  struct Entry {
+    const char * Data;
+    unsigned int Length;
+    unsigned int Hash;
+  };
+
+  Entry *		  Blocks[NAMETABLE_MAX_BLOCKS];
+  name_id_t		  Count;	// only written under TableMutex
+
+  // All of the following are guarded by TableMutex.
+  boost::mutex		  TableMutex;
+  std::vector<name_id_t>  Buckets; // id + 1 of each entry, or 0
+  std::vector<char *>	  Chunks;
+  char *		  Current;
+  std::size_t		  Remaining;
+
+  const Entry& EntryFor(name_id_t id) const {
+    name_id_t count = __atomic_load_n(&Count, __ATOMIC_ACQUIRE);
+    assert(id < count);
+    (void)count;
+    return Blocks[id >> NAMETABLE_BLOCK_BITS][id & (NAMETABLE_BLOCK_SIZE - 1)];
+  }
+
+  const char * Store(const char * data, std::size_t length);
+  void Rehash();
+};
+
+} // namespace Attic
+
+#endif // _NAMETABLE_H
@@ -1,12 +1,37 @@
 #include "Posix.h"
 #include "Location.h"
+#include "StatAhead.h"
+#include "ChecksumCache.h"
+#include "ChecksumService.h"
+#include "CopyEngine.h"
+#include "Installer.h"
+#include "MD5Lanes.h"
 
 #include <fstream>
+#include <string>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <vector>
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+
+#include <boost/thread.hpp>
+
+#ifdef HAVE_GETDENTS64
+#include <sys/syscall.h>
+#include <boost/scoped_array.hpp>
+#include <boost/scoped_ptr.hpp>
+#endif
+#ifdef HAVE_STATX
+#include <sys/sysmacros.h>
+#endif
+#ifdef HAVE_LINUX_IO_URING_H
+#include "IoUring.h"
+#include <boost/thread/tss.hpp>
+#endif
 
 #if defined(HAVE_GETPWUID) || defined(HAVE_GETPWNAM)
 #include <pwd.h>
@@ -20,12 +45,101 @@
 
 namespace Attic {
 
+NameTable PosixFileInfo::Owners;
+
+struct OwnerPair {
+  uid_t Uid;
+  gid_t Gid;
+};
+
+static DateTime NanosecsToTime(long long nsecs)
+{
+  long long secs = nsecs / 1000000000LL;
+  long	    rest = nsecs % 1000000000LL;
+  if (rest < 0) {
+    secs--;
+    rest += 1000000000L;
+  }
+  return DateTime(static_cast<std::time_t>(secs), rest);
+}
+
+static long long TimeToNanosecs(const DateTime& when)
+{
+  return static_cast<long long>(when.secs) * 1000000000LL + when.nsecs;
+}
+
+static DateTime ModificationTime(const struct stat& info)
+{
+#ifdef STAT_USES_ST_ATIM
+  return DateTime(info.st_mtim);
+#else
+#ifdef STAT_USES_ST_ATIMESPEC
+  return DateTime(info.st_mtimespec);
+#else
+#ifdef STAT_USES_ST_ATIMENSEC
+  return DateTime(info.st_mtime, info.st_mtimensec);
+#else
+  return DateTime(info.st_mtime);
+#endif
+#endif
+#endif
+}
+
+static DateTime ChangeTime(const struct stat& info)
+{
+#ifdef STAT_USES_ST_ATIM
+  return DateTime(info.st_ctim);
+#else
+#ifdef STAT_USES_ST_ATIMESPEC
+  return DateTime(info.st_ctimespec);
+#else
+#ifdef STAT_USES_ST_ATIMENSEC
+  return DateTime(info.st_ctime, info.st_ctimensec);
+#else
+  return DateTime(info.st_ctime);
+#endif
+#endif
+#endif
+}
+
+static DateTime AccessTime(const struct stat& info)
+{
+#ifdef STAT_USES_ST_ATIM
+  return DateTime(info.st_atim);
+#else
+#ifdef STAT_USES_ST_ATIMESPEC
+  return DateTime(info.st_atimespec);
+#else
+#ifdef STAT_USES_ST_ATIMENSEC
+  return DateTime(info.st_atime, info.st_atimensec);
+#else
+  return DateTime(info.st_atime);
+#endif
+#endif
+#endif
+}
+
 FileInfo::Kind PosixFileInfo::FileKind() const
 {
-  if (! HasFlags(FILEINFO_READATTR))
+  if (! HasFlags(FILEINFO_READATTR)) {
+#ifdef DT_UNKNOWN
+    // If the directory listing told us what kind of entry this is,
+    // there is no need to stat it just to find out.
+    switch (entryType) {
+    case DT_FIFO: return NamedPipe;
+    case DT_CHR:  return CharDevice;
+    case DT_DIR:  return Directory;
+    case DT_BLK:  return BlockDevice;
+    case DT_REG:  return RegularFile;
+    case DT_LNK:  return SymbolicLink;
+    case DT_SOCK: return Socket;
+    default:      break;
+    }
+#endif
     Repository->SiteBroker->ReadAttributes(const_cast<PosixFileInfo&>(*this));
+  }
 
-  switch (info.st_mode & S_IFMT) {
+  switch (mode & S_IFMT) {
   case S_IFIFO:			/* [XSI] named pipe (fifo) */
     return NamedPipe;
   case S_IFCHR:			/* [XSI] character special */
@@ -48,19 +162,19 @@ FileInfo::Kind PosixFileInfo::FileKind() const
 bool PosixFileInfo::IsReadable() const
 {
   return static_cast<PosixVolumeBroker *>
-    (Repository->SiteBroker)->IsReadable(Pathname);
+    (Repository->SiteBroker)->IsReadable(Pathname());
 }
 
 bool PosixFileInfo::IsWritable() const
 {
   return static_cast<PosixVolumeBroker *>
-    (Repository->SiteBroker)->IsWritable(Pathname);
+    (Repository->SiteBroker)->IsWritable(Pathname());
 }
   
 bool PosixFileInfo::IsSearchable() const
 {
   return static_cast<PosixVolumeBroker *>
-    (Repository->SiteBroker)->IsSearchable(Pathname);
+    (Repository->SiteBroker)->IsSearchable(Pathname());
 }
 
 unsigned long long PosixFileInfo::Length() const
@@ -74,7 +188,7 @@ unsigned long long PosixFileInfo::Length() const
     throw Exception("Attempt to determine length of non-regular file '" +
 		    Moniker() + "'");
 
-  return info.st_size;
+  return size;
 }
 
 mode_t PosixFileInfo::Permissions() const
@@ -83,133 +197,119 @@ mode_t PosixFileInfo::Permissions() const
   if (! Exists())
     throw Exception("Attempt to read permissions of non-existant item '" +
 		    Moniker() + "'");
-  return info.st_mode & ~S_IFMT;
+  return mode & ~S_IFMT;
 }    
 
-void PosixFileInfo::SetPermissions(const mode_t& mode)
+void PosixFileInfo::SetPermissions(const mode_t& perms)
 {
-  info.st_mode = (((info.st_mode & S_IFMT) | mode) | info.st_mode & ~S_IFMT);
+  mode = (mode & S_IFMT) | (perms & ~S_IFMT);
   posixFlags |= POSIX_FILEINFO_MODECHG;
 }    
 
-const uid_t& PosixFileInfo::OwnerId() const
+uid_t PosixFileInfo::OwnerId() const
 {
-  const_cast<PosixFileInfo&>(*this).ReadAttributes();
+  ReadFields(POSIX_ATTR_OWNER);
   if (! Exists())
     throw Exception("Attempt to read owner id of non-existant item '" +
 		    Moniker() + "'");
-  return info.st_uid;
+  uid_t uid;
+  gid_t gid;
+  GetOwner(uid, gid);
+  return uid;
 }    
 
 void PosixFileInfo::SetOwnerId(const uid_t& uid) const
 {
-  info.st_uid = uid;
+  SetOwner(uid, GroupId());
   posixFlags |= POSIX_FILEINFO_OWNRCHG;
 }    
 
-const gid_t& PosixFileInfo::GroupId() const
+gid_t PosixFileInfo::GroupId() const
 {
-  const_cast<PosixFileInfo&>(*this).ReadAttributes();
+  ReadFields(POSIX_ATTR_GROUP);
   if (! Exists())
     throw Exception("Attempt to read group id of non-existant item '" +
 		    Moniker() + "'");
-  return info.st_gid;
+  uid_t uid;
+  gid_t gid;
+  GetOwner(uid, gid);
+  return gid;
 }    
 
 void PosixFileInfo::SetGroupId(const gid_t& gid)
 {
-  info.st_gid = gid;
+  SetOwner(OwnerId(), gid);
   posixFlags |= POSIX_FILEINFO_OWNRCHG;
 }    
 
+void PosixFileInfo::GetOwner(uid_t& uid, gid_t& gid) const
+{
+  OwnerPair pair;
+  std::memset(&pair, 0, sizeof(pair));
+  if (Owners.Length(owner) == sizeof(pair))
+    std::memcpy(&pair, Owners.Data(owner), sizeof(pair));
+  uid = pair.Uid;
+  gid = pair.Gid;
+}
+
+void PosixFileInfo::SetOwner(uid_t uid, gid_t gid) const
+{
+  OwnerPair pair;
+  std::memset(&pair, 0, sizeof(pair));
+  pair.Uid = uid;
+  pair.Gid = gid;
+  owner = Owners.Intern(reinterpret_cast<const char *>(&pair), sizeof(pair));
+}
+
 DateTime PosixFileInfo::LastWriteTime() const
 {
   const_cast<PosixFileInfo&>(*this).ReadAttributes();
   if (! Exists())
     throw Exception("Attempt to read last write time of non-existant item '" +
 		    Moniker() + "'");
-#ifdef STAT_USES_ST_ATIM
-  return DateTime(info.st_mtim);
-#else
-#ifdef STAT_USES_ST_ATIMESPEC
-  return DateTime(info.st_mtimespec);
-#else
-#ifdef STAT_USES_ST_ATIMENSEC
-  return DateTime(info.st_mtime, info.st_mtimensec);
-#else
-#ifdef STAT_USES_ST_ATIME
-  return DateTime(info.st_mtime);
-#endif
-#endif
-#endif
-#endif
+  return NanosecsToTime(mtime);
 }
 
 void PosixFileInfo::SetLastWriteTime(const DateTime& when)
 {
-#ifdef STAT_USES_ST_ATIM
-  info.st_mtim = when;
-#else
-#ifdef STAT_USES_ST_ATIMESPEC
-  info.st_mtimespec = when;
-#else
-#ifdef STAT_USES_ST_ATIMENSEC
-  info.st_mtime     = when.secs;
-  info.st_mtimensec = when.nsecs;
-#else
-#ifdef STAT_USES_ST_ATIME
-  info.st_mtime = when;
-#endif
-#endif
-#endif
-#endif
+  mtime = TimeToNanosecs(when);
   posixFlags |= POSIX_FILEINFO_TIMECHG;
 }
 
 DateTime PosixFileInfo::LastAccessTime() const
 {
-  const_cast<PosixFileInfo&>(*this).ReadAttributes();
+  ReadFields(POSIX_ATTR_ATIME);
   if (! Exists())
     throw Exception("Attempt to read last access time of non-existant item '" +
 		    Moniker() + "'");
-#ifdef STAT_USES_ST_ATIM
-  return DateTime(info.st_atim);
-#else
-#ifdef STAT_USES_ST_ATIMESPEC
-  return DateTime(info.st_atimespec);
-#else
-#ifdef STAT_USES_ST_ATIMENSEC
-  return DateTime(info.st_atime, info.st_atimensec);
-#else
-#ifdef STAT_USES_ST_ATIME
-  return DateTime(info.st_atime);
-#endif
-#endif
-#endif
-#endif
+  return NanosecsToTime(PosixExtra().AccessTime);
 }
 
 void PosixFileInfo::SetLastAccessTime(const DateTime& when)
 {
-#ifdef STAT_USES_ST_ATIM
-  info.st_atim = when;
-#else
-#ifdef STAT_USES_ST_ATIMESPEC
-  info.st_atimespec = when;
-#else
-#ifdef STAT_USES_ST_ATIMENSEC
-  info.st_atime     = when.secs;
-  info.st_atimensec = when.nsecs;
-#else
-#ifdef STAT_USES_ST_ATIME
-  info.st_atime = when;
-#endif
-#endif
-#endif
-#endif
+  PosixExtra().AccessTime = TimeToNanosecs(when);
+  attrsRead  |= POSIX_ATTR_ATIME;
   posixFlags |= POSIX_FILEINFO_TIMECHG;
 }
 
+ino_t PosixFileInfo::Inode() const
+{
+  ReadFields(POSIX_ATTR_NLINK);
+  if (! Exists())
+    throw Exception("Attempt to read inode of non-existant item '" +
+		    Moniker() + "'");
+  return PosixExtra().Inode;
+}
+
+unsigned int PosixFileInfo::LinkCount() const
+{
+  ReadFields(POSIX_ATTR_NLINK);
+  if (! Exists())
+    throw Exception("Attempt to read link count of non-existant item '" +
+		    Moniker() + "'");
+  return PosixExtra().LinkCount;
+}
+
 Path PosixFileInfo::LinkTarget() const
 {
   const_cast<PosixFileInfo&>(*this).ReadAttributes();
@@ -220,8 +320,7 @@ Path PosixFileInfo::LinkTarget() const
   else if (! IsSymbolicLink())
     throw Exception("Attempt to dereference non-symbol link '" + Moniker() + "'");
 
-  assert(LinkTargetPath);
-  return *LinkTargetPath;
+  return PosixExtra().LinkTarget;
 }
 
 void PosixFileInfo::SetLinkTarget(const Path& path)
@@ -230,13 +329,19 @@ void PosixFileInfo::SetLinkTarget(const Path& path)
     throw Exception("Attempt to set link target of non-symbolic link '" +
 		    Moniker() + "'");
 
-  if (LinkTargetPath)
-    delete LinkTargetPath;
-
-  LinkTargetPath = new Path(path);
+  PosixExtra().LinkTarget = path;
   posixFlags |= POSIX_FILEINFO_LINKCHG;
 }
 
+void PosixFileInfo::ReadFields(posix_flags_t fields) const
+{
+  const_cast<PosixFileInfo&>(*this).ReadAttributes();
+
+  if ((attrsRead & fields) != fields)
+    static_cast<PosixVolumeBroker *>(Repository->SiteBroker)->
+      ReadFields(const_cast<PosixFileInfo&>(*this), fields);
+}
+
 bool PosixFileInfo::CompareAttributes(const FileInfo& other) const
 {
   assert(FileKind() == other.FileKind());
@@ -246,11 +351,20 @@ bool PosixFileInfo::CompareAttributes(const FileInfo& other) const
   if (! otherInfo)
     return false;
 
-  return (Permissions() == otherInfo->Permissions() &&
-	  OwnerId()	== otherInfo->OwnerId()	 &&
-	  GroupId()	== otherInfo->GroupId()	 &&
-	  (! IsSymbolicLink() ||
-	   LinkTarget() == otherInfo->LinkTarget()));
+  // Only compare those attributes which are part of the state at
+  // this location; the others may not even have been read.
+  if (Repository->PreservePermissions &&
+      Permissions() != otherInfo->Permissions())
+    return false;
+  if (Repository->PreserveOwnership &&
+      OwnerId() != otherInfo->OwnerId())
+    return false;
+  if (Repository->PreserveGroup &&
+      GroupId() != otherInfo->GroupId())
+    return false;
+
+  return (! IsSymbolicLink() ||
+	  LinkTarget() == otherInfo->LinkTarget());
 }
 
 void PosixFileInfo::WriteData(std::ostream& out) const
@@ -265,7 +379,7 @@ void PosixFileInfo::ReadData(std::istream& in)
 
 void PosixFileInfo::Copy(const FileInfo& source)
 {
-  static_cast<PosixVolumeBroker *>(Repository->SiteBroker)->Copy(source, Pathname);
+  static_cast<PosixVolumeBroker *>(Repository->SiteBroker)->Copy(source, Pathname());
 }
 
 void PosixFileInfo::CopyAttributes(const FileInfo& source)
@@ -320,7 +434,7 @@ void PosixFileInfo::Dump(std::ostream& out, bool verbose, int depth) const
     }
   }
 
-  out << FullName << ':';
+  out << FullName() << ':';
 
   if (IsRegularFile()) {
     out << " len " << Length();
@@ -332,10 +446,10 @@ void PosixFileInfo::Dump(std::ostream& out, bool verbose, int depth) const
 
   out << std::endl;
 
-  for (ChildrenMap::iterator i = ChildrenBegin();
+  for (ChildrenArray::iterator i = ChildrenBegin();
        i != ChildrenEnd();
        i++)
-    (*i).second->Dump(out, verbose, depth + 1);
+    (*i)->Dump(out, verbose, depth + 1);
 }
 
 void PosixVolumeBroker::SetPermissions(const Path& path, mode_t mode)
@@ -386,27 +500,86 @@ void PosixVolumeBroker::CopyFile(const FileInfo& entry, const Path& dest)
 {
   assert(entry.Exists());
 
-  std::ofstream fout(dest.c_str());
-  entry.WriteData(fout);
-  fout.close();
+  // Only a file on another POSIX volume can be handed to the kernel
+  // to copy; anything else is streamed through WriteData.
+  if (! dynamic_cast<PosixVolumeBroker *>(entry.Repository->SiteBroker)) {
+    std::ofstream fout(dest.c_str());
+    entry.WriteData(fout);
+    fout.close();
 
-  assert(Exists(dest));
+    assert(Exists(dest));
+    return;
+  }
+
+  Path source(entry.Pathname());
+
+  // Reading the source may change its access time, so the one to be
+  // carried over to the copy is taken first.
+  if (Repository->PreserveTimestamps)
+    static_cast<const PosixFileInfo&>(entry).LastAccessTime();
+
+  int in = open(source.c_str(), O_RDONLY);
+  if (in == -1)
+    throw Exception("Failed to open '" + source + "'");
+
+  // Unless asked to write straight over the target, the copy is made
+  // beside it and put in its place once it is safely on disk.
+  bool direct = Repository->CopyByOverwrite;
+  int  out;
+  if (direct) {
+    out = open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out == -1) {
+      close(in);
+      throw Exception("Failed to create '" + dest + "'");
+    }
+  } else {
+    if (! Installs)
+      Installs = new Installer;
+    try {
+      out = Installs->Open(dest);
+    }
+    catch (...) {
+      close(in);
+      throw;
+    }
+  }
+
+  try {
+    if (! Copier)
+      Copier = new CopyEngine;
+    Copier->Copy(in, out, source, dest, Repository->PreserveSparseFiles);
+  }
+  catch (...) {
+    close(in);
+    if (direct)
+      close(out);
+    else
+      Installs->Discard();
+    throw;
+  }
+
+  close(in);
+  if (! direct)
+    Installs->Close();
+  else if (close(out) == -1)
+    throw Exception("Failed to write '" + dest + "'");
 }
 
-void PosixVolumeBroker::UpdateFile(const FileInfo& entry,
-				   const PosixFileInfo& dest)
+void PosixVolumeBroker::FlushInstalls(const Path& path)
 {
+  if (Installs && Installs->Holds(path))
+    Installs->Flush();
 }
 
 void PosixVolumeBroker::MoveFile(const PosixFileInfo& entry, const Path& dest)
 {
-  if (rename(entry.Pathname.c_str(), dest.c_str()) == -1)
+  if (rename(entry.Pathname().c_str(), dest.c_str()) == -1)
     throw Exception("Failed to move '" + entry.Moniker() + "' to '" + dest + "'");
 }
 
 void PosixVolumeBroker::WriteFile(const PosixFileInfo& entry, std::ostream& out)
 {
-  std::ifstream fin(entry.Pathname.c_str());
+  std::ifstream fin(entry.Pathname().c_str());
 
   do {
     char buf[8192];
@@ -463,45 +636,218 @@ bool PosixVolumeBroker::IsSearchable(const Path& path) const
   return access(path.c_str(), X_OK) != -1;
 }
 
+#define STATAHEAD_WINDOW 4096
+
+PosixVolumeBroker::~PosixVolumeBroker()
+{
+  delete Prefetcher;
+  delete Checksums;
+  delete Copier;
+  delete Installs;
+}
+
+void PosixVolumeBroker::SetRepository(Location * _Repository)
+{
+  VolumeBroker::SetRepository(_Repository);
+
+#ifndef SINGLE_THREADED
+  // A Scanner already reads every directory ahead of the comparer,
+  // so there would be nothing left for a StatAhead to do.
+  if (! Prefetcher && Repository &&
+      Repository->StatAheadThreads > 0 && ! Repository->ScanEngine)
+    Prefetcher = new StatAhead(Repository->StatAheadThreads,
+			       STATAHEAD_WINDOW);
+#endif
+
+  if (! Checksums && Repository && Repository->CacheChecksums)
+    Checksums = new ChecksumCache(FullPath(CHECKSUM_CACHE_NAME));
+}
+
+unsigned char PosixVolumeBroker::RequiredFields() const
+{
+  if (! Repository)
+    return POSIX_ATTR_ALL;
+
+  // The access time and link count are never compared, so they are
+  // left to be read for the few entries which need them.
+  unsigned char fields = POSIX_ATTR_BASIC;
+  if (Repository->PreserveOwnership)
+    fields |= POSIX_ATTR_OWNER;
+  if (Repository->PreserveGroup)
+    fields |= POSIX_ATTR_GROUP;
+  return fields;
+}
+
 void PosixVolumeBroker::ReadAttributes(FileInfo& entry) const
 {
   PosixFileInfo& posixEntry = static_cast<PosixFileInfo&>(entry);
 
-  if (lstat(entry.Pathname.c_str(), &posixEntry.info) == -1) {
+  if (Prefetcher) {
+    struct stat info;
+    int		error;
+    if (Prefetcher->TakeAttributes(posixEntry.Pathname(), info, error)) {
+      if (error == 0) {
+	StoreFields(posixEntry, info, POSIX_ATTR_ENTRY);
+	return;
+      }
+      if (error == ENOENT) {
+	posixEntry.SetFlags(FILEINFO_READATTR);
+	posixEntry.ClearFlags(FILEINFO_EXISTS);
+	posixEntry.attrsRead = POSIX_ATTR_ALL;
+	return;
+      }
+      // Otherwise, try again here so that the error is reported
+    }
+  }
+
+  ReadFields(posixEntry, RequiredFields());
+}
+
+#ifdef HAVE_STATX
+static unsigned int StatxMask(unsigned char fields)
+{
+  // statx lets us ask only for what the Location actually compares,
+  // which saves work on network filesystems in particular.
+  unsigned int mask = (STATX_TYPE | STATX_MODE | STATX_INO |
+		       STATX_SIZE | STATX_MTIME);
+  if (fields & POSIX_ATTR_OWNER)
+    mask |= STATX_UID;
+  if (fields & POSIX_ATTR_GROUP)
+    mask |= STATX_GID;
+  if (fields & POSIX_ATTR_ATIME)
+    mask |= STATX_ATIME;
+  if (fields & POSIX_ATTR_NLINK)
+    mask |= STATX_NLINK;
+  return mask;
+}
+
+static void StatxToStat(const struct statx& stx, struct stat& info)
+{
+  std::memset(&info, 0, sizeof(info));
+  info.st_dev	= makedev(stx.stx_dev_major, stx.stx_dev_minor);
+  info.st_ino	= stx.stx_ino;
+  info.st_mode	= stx.stx_mode;
+  info.st_nlink = stx.stx_nlink;
+  info.st_uid	= stx.stx_uid;
+  info.st_gid	= stx.stx_gid;
+  info.st_size	= stx.stx_size;
+  info.st_atim.tv_sec  = stx.stx_atime.tv_sec;
+  info.st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+  info.st_mtim.tv_sec  = stx.stx_mtime.tv_sec;
+  info.st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+  info.st_ctim.tv_sec  = stx.stx_ctime.tv_sec;
+  info.st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+}
+#endif
+
+// Every entry is stat'd through ReadFields, so each thread keeps one
+// buffer for the paths it builds there, rather than a new string each.
+static boost::thread_specific_ptr<std::string> StatPaths;
+
+void PosixVolumeBroker::ReadFields(PosixFileInfo& entry,
+				   unsigned char fields) const
+{
+  if (! StatPaths.get())
+    StatPaths.reset(new std::string);
+  std::string& pathname(*StatPaths);
+  pathname.clear();
+  AppendFullPath(entry, pathname);
+
+  struct stat info;
+
+#ifdef HAVE_STATX
+  struct statx stx;
+  int result = statx(AT_FDCWD, pathname.c_str(),
+		     AT_SYMLINK_NOFOLLOW | AT_STATX_SYNC_AS_STAT,
+		     StatxMask(fields), &stx);
+  if (result != -1)
+    StatxToStat(stx, info);
+#else
+  int result = lstat(pathname.c_str(), &info);
+  fields |= POSIX_ATTR_ENTRY;
+#endif
+
+  if (result == -1) {
     if (errno == ENOENT) {
-      posixEntry.SetFlags(FILEINFO_READATTR);
+      entry.SetFlags(FILEINFO_READATTR);
+      entry.ClearFlags(FILEINFO_EXISTS);
+      entry.attrsRead = POSIX_ATTR_ALL;
       return;
     }
-    throw Exception("Failed to lstat '" + posixEntry.Pathname + "'");
+    throw Exception("Failed to lstat '" + pathname + "'");
   }
 
-  posixEntry.SetFlags(FILEINFO_READATTR | FILEINFO_EXISTS);
+  StoreFields(entry, info, fields);
+}
 
-  if (posixEntry.IsSymbolicLink()) {
-    char buf[8192];
-    if (readlink(posixEntry.Pathname.c_str(), buf, 8191) != -1)
-      posixEntry.LinkTargetPath = new Path(buf);
-    else
-      throw Exception("Failed to read symbol link '" + posixEntry.Pathname + "'");
+void PosixVolumeBroker::StoreFields(PosixFileInfo& entry,
+				    const struct stat& info,
+				    unsigned char fields) const
+{
+  // Once the entry has been read, we are only filling in fields that
+  // were skipped the first time, so leave alone anything which might
+  // have been changed since then.
+  unsigned char missing = fields & ~entry.attrsRead;
+
+  if (! (entry.attrsRead & POSIX_ATTR_BASIC)) {
+    entry.mode	= info.st_mode;
+    entry.size	= info.st_size;
+    entry.mtime = TimeToNanosecs(ModificationTime(info));
+    entry.SetOwner(info.st_uid, info.st_gid);
+  }
+  else if (missing & (POSIX_ATTR_OWNER | POSIX_ATTR_GROUP)) {
+    uid_t uid;
+    gid_t gid;
+    entry.GetOwner(uid, gid);
+    if (missing & POSIX_ATTR_OWNER)
+      uid = info.st_uid;
+    if (missing & POSIX_ATTR_GROUP)
+      gid = info.st_gid;
+    entry.SetOwner(uid, gid);
+  }
+
+  if (missing & POSIX_ATTR_ATIME)
+    entry.PosixExtra().AccessTime = TimeToNanosecs(AccessTime(info));
+  if (missing & POSIX_ATTR_NLINK) {
+    entry.PosixExtra().Inode	 = info.st_ino;
+    entry.PosixExtra().LinkCount = info.st_nlink;
+  }
+
+  bool firstRead = ! (entry.attrsRead & POSIX_ATTR_BASIC);
+  entry.attrsRead |= fields | POSIX_ATTR_BASIC;
+  entry.SetFlags(FILEINFO_READATTR | FILEINFO_EXISTS);
+
+  if (firstRead && entry.IsSymbolicLink()) {
+    Path    pathname(entry.Pathname());
+    char    buf[8192];
+    ssize_t len = readlink(pathname.c_str(), buf, 8191);
+    if (len == -1)
+      throw Exception("Failed to read symbol link '" + pathname + "'");
+    buf[len] = '\0';
+
+    entry.PosixExtra().LinkTarget = buf;
   }
 }
 
 void PosixVolumeBroker::SyncAttributes(const FileInfo& entry)
 {
   const PosixFileInfo& posixEntry = static_cast<const PosixFileInfo&>(entry);
+  Path		       pathname;
+  AppendFullPath(posixEntry, pathname);
+
+  FlushInstalls(pathname);
 
   if (posixEntry.posixFlags & POSIX_FILEINFO_LINKCHG)
-    SetLinkTarget(posixEntry.Pathname, posixEntry.LinkTarget());
+    SetLinkTarget(pathname, posixEntry.LinkTarget());
 
   if (posixEntry.posixFlags & POSIX_FILEINFO_MODECHG)
-    SetPermissions(posixEntry.Pathname, posixEntry.Permissions());
+    SetPermissions(pathname, posixEntry.Permissions());
 
   if (posixEntry.posixFlags & POSIX_FILEINFO_OWNRCHG)
-    SetOwnership(posixEntry.Pathname, posixEntry.OwnerId(),
-		 posixEntry.GroupId());
+    SetOwnership(pathname, posixEntry.OwnerId(), posixEntry.GroupId());
 
   if (posixEntry.posixFlags & POSIX_FILEINFO_TIMECHG)
-    SetAccessTimes(posixEntry.Pathname, posixEntry.LastAccessTime(),
+    SetAccessTimes(pathname, posixEntry.LastAccessTime(),
 		   posixEntry.LastWriteTime());
 }
 
@@ -509,36 +855,778 @@ void PosixVolumeBroker::CopyAttributes(const FileInfo& entry, const Path& dest)
 {
   const PosixFileInfo& posixEntry = static_cast<const PosixFileInfo&>(entry);
 
+  FlushInstalls(dest);
+
   if (posixEntry.IsSymbolicLink())
     SetLinkTarget(dest, posixEntry.LinkTarget());
   SetPermissions(dest, posixEntry.Permissions());
-  SetOwnership(dest, posixEntry.OwnerId(), posixEntry.GroupId());
+
+  // Passing -1 to chown leaves that id unchanged.
+  if (Repository->PreserveOwnership || Repository->PreserveGroup)
+    SetOwnership(dest,
+		 Repository->PreserveOwnership ? posixEntry.OwnerId() : -1,
+		 Repository->PreserveGroup ? posixEntry.GroupId() : -1);
+
   SetAccessTimes(dest, posixEntry.LastAccessTime(), posixEntry.LastWriteTime());
 }
 
-void PosixVolumeBroker::ComputeChecksum(const Path& path, md5sum_t& csum) const
+static void StampFile(const struct stat& info, ChecksumCache::Stamp& stamp)
 {
-  md5_state_t state;
-  md5_init(&state);
+  stamp.Device	   = info.st_dev;
+  stamp.Inode	   = info.st_ino;
+  stamp.Size	   = info.st_size;
+  stamp.ModifyTime = TimeToNanosecs(ModificationTime(info));
+  stamp.ChangeTime = TimeToNanosecs(ChangeTime(info));
+}
 
-  char cbuf[8192];
+#define CHECKSUM_SPARSE_BUFFER (1024 * 1024)
 
-  std::fstream fin(path.c_str());
-  assert(fin.good());
+// True if a file has fewer blocks than its length needs, and so must
+// have holes in it.
+static bool IsSparse(const struct stat& info)
+{
+  return (static_cast<unsigned long long>(info.st_blocks) * 512 <
+	  static_cast<unsigned long long>(info.st_size));
+}
 
-  fin.read(cbuf, 8192);
-  int read = fin.gcount();
-  while (read > 0) {
-    md5_append(&state, (md5_byte_t *)cbuf, read);
-    if (fin.eof() || fin.bad())
+// Read length bytes of fd at offset, as pread would, but all of them,
+// so that the count is short only at the end of the file.  If
+// skipHoles is true, whatever lies in a hole is known to be zeros and
+// is not read at all.
+static ssize_t ReadAt(int fd, char * buffer, std::size_t length,
+		      off_t offset, bool skipHoles)
+{
+  std::size_t done = 0;
+  while (done < length) {
+    off_t	pos  = offset + done;
+    std::size_t want = length - done;
+
+#ifdef SEEK_DATA
+    if (skipHoles) {
+      off_t data = lseek(fd, pos, SEEK_DATA);
+      if (data == -1) {
+	if (errno != ENXIO) {
+	  skipHoles = false;	// this filesystem cannot say
+	  continue;
+	}
+	data = lseek(fd, 0, SEEK_END); // only a hole is left
+	if (data == -1)
+	  return -1;
+      }
+      if (data > pos) {
+	std::size_t zeros = std::min<unsigned long long>(data - pos, want);
+	std::memset(buffer + done, 0, zeros);
+	done += zeros;
+	continue;
+      }
+
+      off_t hole = lseek(fd, pos, SEEK_HOLE);
+      if (hole > pos)
+	want = std::min<unsigned long long>(hole - pos, want);
+    }
+#endif
+
+    ssize_t len = pread(fd, buffer + done, want, pos);
+    if (len == -1) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    if (len == 0)
       break;
-    fin.read(cbuf, 8192);
-    read = fin.gcount();
+    done += len;
   }
-  fin.close();
+  return done;
+}
+
+// Hashes the chunks of one large file for a tree checksum, on as many
+// threads as there are cores.  Each thread takes the next chunk not
+// yet taken, so that a thread held up by a slow read does not hold
+// up the rest; the digests are put in order as they are finished.
+// Where the repository has a ChecksumService, its hashers do the
+// work, rather than threads of our own competing with them.
+class ChunkHasher
+{
+  typedef boost::mutex::scoped_lock scoped_lock;
+
+  int			  Fd;
+  const Path&		  FilePath;
+  checksum_t::Algorithm	  BaseAlgorithm;
+  bool			  SkipHoles;
+  std::vector<checksum_t> Digests;
+
+  boost::mutex		  Mutex;
+  std::size_t		  NextChunk;
+  std::string		  Error;
+
+  class Worker {
+    ChunkHasher * Hasher;
+  public:
+    Worker(ChunkHasher * _Hasher) : Hasher(_Hasher) {}
+    void operator()() {
+      Hasher->Run();
+    }
+  };
+
+  void Run();
+
+public:
+  ChunkHasher(int _Fd, const Path& _FilePath, checksum_t::Algorithm _Base,
+	      unsigned long long length, bool _SkipHoles)
+    : Fd(_Fd), FilePath(_FilePath), BaseAlgorithm(_Base),
+      SkipHoles(_SkipHoles),
+      Digests((length + CHECKSUM_CHUNK_SIZE - 1) / CHECKSUM_CHUNK_SIZE),
+      NextChunk(0) {}
+
+  void Hash(ChecksumState& state, unsigned int threads,
+	    ChecksumService * service);
+};
+
+void ChunkHasher::Run()
+{
+  try {
+    std::vector<char> buffer(CHECKSUM_CHUNK_SIZE);
+
+    for (;;) {
+      std::size_t chunk;
+      {
+	scoped_lock lock(Mutex);
+	if (NextChunk == Digests.size() || ! Error.empty())
+	  return;
+	chunk = NextChunk++;
+      }
+
+      // A chunk read short means the file is shorter than it was;
+      // what there is gets hashed, as a sequential read would have,
+      // and the stamp taken before keeps it out of the cache.
+      ssize_t length = ReadAt(Fd, &buffer[0], buffer.size(),
+			      static_cast<off_t>(chunk) * CHECKSUM_CHUNK_SIZE,
+			      SkipHoles);
+      if (length == -1)
+	throw Exception("Failed to read '" + FilePath + "'");
+
+      ChecksumState state(BaseAlgorithm);
+      state.Append(&buffer[0], length);
+      state.Finish(Digests[chunk]);
+    }
+  }
+  catch (const std::exception& err) {
+    scoped_lock lock(Mutex);
+    if (Error.empty())
+      Error = err.what();
+  }
+}
+
+void ChunkHasher::Hash(ChecksumState& state, unsigned int threads,
+		       ChecksumService * service)
+{
+  if (service) {
+    service->Share(Worker(this), threads - 1);
+  } else {
+    boost::thread_group workers;
+    for (unsigned int i = 0; i < threads; i++)
+      workers.create_thread(Worker(this));
+    workers.join_all();
+  }
+
+  if (! Error.empty())
+    throw Exception(Error);
+
+  for (std::vector<checksum_t>::iterator i = Digests.begin();
+       i != Digests.end();
+       i++)
+    state.AppendChunk(*i);
+}
+
+// Files shorter than this are simply written over, since reading the
+// old contents would cost more than any writes it might save.
+#define UPDATE_MIN_LENGTH CHECKSUM_CHUNK_SIZE
+#define UPDATE_BLOCK_SIZE 4096	// where the target does not give its own
+
+// Write length bytes at offset, all of them.  If punchZeros is true
+// and they are all zeros, a hole is made there instead, where the
+// filesystem can.
+static bool WriteAt(int fd, const char * buffer, std::size_t length,
+		    off_t offset, bool punchZeros)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+  if (punchZeros && buffer[0] == '\0' &&
+      std::memcmp(buffer, buffer + 1, length - 1) == 0 &&
+      fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		offset, length) == 0)
+    return true;
+#endif
+
+  for (std::size_t done = 0; done < length; ) {
+    ssize_t len = pwrite(fd, buffer + done, length - done, offset + done);
+    if (len == -1) {
+      if (errno == EINTR)
+	continue;
+      return false;
+    }
+    done += len;
+  }
+  return true;
+}
+
+void PosixVolumeBroker::UpdateFile(const FileInfo& entry,
+				   const PosixFileInfo& dest)
+{
+  Path source(entry.Pathname());
+  Path target(dest.Pathname());
+
+  int in = open(source.c_str(), O_RDONLY);
+  if (in == -1)
+    throw Exception("Failed to open '" + source + "'");
+
+  int out = open(target.c_str(), O_RDWR);
+  if (out == -1) {
+    close(in);
+    throw Exception("Failed to open '" + target + "'");
+  }
+
+  try {
+    struct stat sourceInfo;
+    struct stat targetInfo;
+    if (fstat(in, &sourceInfo) == -1 || fstat(out, &targetInfo) == -1)
+      throw Exception("Failed to stat '" + source + "' or '" + target + "'");
+
+    unsigned long long length = sourceInfo.st_size;
+    unsigned long long common =
+      std::min<unsigned long long>(length, targetInfo.st_size);
+    bool sparse = Repository->PreserveSparseFiles && IsSparse(sourceInfo);
+
+    // If the source was hashed by chunks to find this change, a chunk
+    // of the target which hashes the same is known to need nothing,
+    // and that chunk of the source need not be read at all.
+    const std::vector<checksum_t> * chunks =
+      static_cast<const PosixFileInfo&>(entry).KnownChunkChecksums();
+    if (chunks && chunks->size() !=
+	(length + CHECKSUM_CHUNK_SIZE - 1) / CHECKSUM_CHUNK_SIZE)
+      chunks = NULL;
+
+    // If the target's own chunks were cached when it was last hashed,
+    // and it has not changed since, a chunk whose digest is the same
+    // as the source's need not be read from either file.
+    std::vector<checksum_t> stored;
+    if (chunks && Checksums) {
+      ChecksumCache::Stamp stamp;
+      checksum_t	   csum;
+      StampFile(targetInfo, stamp);
+      if (! Checksums->Find(stamp, entry.Checksum().Kind(), csum, &stored) ||
+	  stored.size() != ((static_cast<unsigned long long>
+			     (targetInfo.st_size) + CHECKSUM_CHUNK_SIZE - 1) /
+			    CHECKSUM_CHUNK_SIZE))
+	stored.clear();
+    }
+
+    // Runs of changes are written in whole blocks of the target's, as
+    // any less would cost the filesystem as much.
+    std::size_t block = targetInfo.st_blksize;
+    if (block == 0 || block > CHECKSUM_CHUNK_SIZE)
+      block = UPDATE_BLOCK_SIZE;
+
+    std::vector<char> theirs(CHECKSUM_CHUNK_SIZE);
+    std::vector<char> ours(CHECKSUM_CHUNK_SIZE);
+
+    for (unsigned long long offset = 0; offset < length;
+	 offset += CHECKSUM_CHUNK_SIZE) {
+      std::size_t want =
+	std::min<unsigned long long>(length - offset, CHECKSUM_CHUNK_SIZE);
+      std::size_t have = 0;
+      if (offset < common)
+	have = std::min<unsigned long long>(common - offset, want);
+
+      std::size_t chunk = offset / CHECKSUM_CHUNK_SIZE;
+      if (chunk < stored.size() && have == want &&
+	  std::min<unsigned long long>(targetInfo.st_size - offset,
+				       CHECKSUM_CHUNK_SIZE) == want &&
+	  stored[chunk] == (*chunks)[chunk])
+	continue;
+
+      if (have > 0) {
+	if (ReadAt(out, &ours[0], have, offset, true) !=
+	    static_cast<ssize_t>(have))
+	  throw Exception("Failed to read '" + target + "'");
+
+	if (chunks && have == want) {
+	  const checksum_t& known((*chunks)[chunk]);
+	  checksum_t	    csum;
+	  ChecksumState	    state(known.Kind());
+	  state.Append(&ours[0], have);
+	  state.Finish(csum);
+	  if (csum == known)
+	    continue;
+	}
+      }
+
+      if (ReadAt(in, &theirs[0], want, offset, sparse) !=
+	  static_cast<ssize_t>(want))
+	throw Exception("Failed to read '" + source + "'");
+
+      // Write each run of differing blocks with a single call.
+      std::size_t run = 0;
+      bool	  inRun = false;
+      for (std::size_t pos = 0; ; pos += block) {
+	bool differs = false;
+	if (pos < want) {
+	  std::size_t len = std::min<std::size_t>(want - pos, block);
+	  differs = (pos + len > have ||
+		     std::memcmp(&theirs[pos], &ours[pos], len) != 0);
+	}
+
+	if (differs && ! inRun) {
+	  run	= pos;
+	  inRun = true;
+	}
+	else if (! differs && inRun) {
+	  std::size_t end = std::min(pos, want);
+	  if (! WriteAt(out, &theirs[run], end - run, offset + run, sparse))
+	    throw Exception("Failed to write '" + target + "'");
+	  inRun = false;
+	}
+
+	if (pos >= want)
+	  break;
+      }
+    }
+
+    if (static_cast<unsigned long long>(targetInfo.st_size) != length &&
+	ftruncate(out, length) == -1)
+      throw Exception("Failed to set the length of '" + target + "'");
+  }
+  catch (...) {
+    close(in);
+    close(out);
+    throw;
+  }
+
+  close(in);
+  if (close(out) == -1)
+    throw Exception("Failed to write '" + target + "'");
+}
+
+void PosixVolumeBroker::ComputeChecksum(const Path& path,
+					checksum_t::Algorithm algorithm,
+					checksum_t& csum,
+					std::vector<checksum_t> * chunks) const
+{
+  struct stat	       info;
+  ChecksumCache::Stamp stamp;
+
+  if (Checksums && stat(path.c_str(), &info) == 0) {
+    StampFile(info, stamp);
+    if (Checksums->Find(stamp, algorithm, csum, chunks))
+      return;
+  }
+
+  if (Repository && Repository->HashEngine && ! chunks) {
+    std::time_t started;
+    int		error;
+    if (Repository->HashEngine->Take(path, algorithm, csum, info, started,
+				     error)) {
+      if (error == 0) {
+	if (Checksums) {
+	  StampFile(info, stamp);
+	  Checksums->Insert(stamp, started, csum);
+	}
+	return;
+      }
+      // Otherwise, try again here so that the error is reported
+    }
+  }
+
+  std::time_t started = std::time(NULL);
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1)
+    throw Exception("Failed to open '" + path + "'");
+
+  // The checksum is recorded against what the file was when it was
+  // opened, so that a change made while it is being read will not
+  // match next time.
+  if (fstat(fd, &info) == -1) {
+    close(fd);
+    throw Exception("Failed to stat '" + path + "'");
+  }
+  StampFile(info, stamp);
+
+  ChecksumState state(algorithm, chunks);
+
+  unsigned long long length = info.st_size;
+  unsigned int	     threads = boost::thread::hardware_concurrency();
+  if (checksum_t::IsTree(algorithm) && threads > 1 &&
+      length > CHECKSUM_CHUNK_SIZE) {
+    unsigned long long count =
+      (length + CHECKSUM_CHUNK_SIZE - 1) / CHECKSUM_CHUNK_SIZE;
+    if (count < threads)
+      threads = static_cast<unsigned int>(count);
+
+    try {
+      ChunkHasher hasher(fd, path, checksum_t::Base(algorithm), length,
+			 IsSparse(info));
+      hasher.Hash(state, threads,
+		  Repository ? Repository->HashEngine : NULL);
+    }
+    catch (...) {
+      close(fd);
+      throw;
+    }
+  }
+  else if (IsSparse(info)) {
+    // The holes still have to be hashed, as the zeros they read as,
+    // but there is no need to read them to find that out.
+    std::vector<char> buffer(CHECKSUM_SPARSE_BUFFER);
+    for (off_t offset = 0; ; ) {
+      ssize_t len = ReadAt(fd, &buffer[0], buffer.size(), offset, true);
+      if (len == -1) {
+	close(fd);
+	throw Exception("Failed to read '" + path + "'");
+      }
+      if (len == 0)
+	break;
+      state.Append(&buffer[0], len);
+      offset += len;
+    }
+  }
+  else {
+    char cbuf[8192];
+    for (;;) {
+      ssize_t len = read(fd, cbuf, sizeof(cbuf));
+      if (len == -1) {
+	if (errno == EINTR)
+	  continue;
+	close(fd);
+	throw Exception("Failed to read '" + path + "'");
+      }
+      if (len == 0)
+	break;
+      state.Append(cbuf, len);
+    }
+  }
+  close(fd);
+
+  state.Finish(csum);
+
+  if (Checksums)
+    Checksums->Insert(stamp, started, csum, chunks);
+}
+
+#define CHECKSUM_LANE_BUFFER (64 * 1024)
+
+// One file being hashed in a lane of ReadChecksums.  The buffer is
+// refilled only once every whole block in it has been hashed, and is
+// a whole number of blocks long, so anything short of a block left in
+// it is the end of the file.
+struct ChecksumLane {
+  FileInfo *		 Entry;
+  int			 Fd;
+  md5_state_t		 State;
+  ChecksumCache::Stamp	 Stamp;
+  std::time_t		 Started;
+  std::vector<md5_byte_t> Buffer;
+  std::size_t		 Length;
+  std::size_t		 Offset;
+  bool			 AtEnd;
+
+  ChecksumLane()
+    : Entry(NULL), Fd(-1), Buffer(CHECKSUM_LANE_BUFFER),
+      Length(0), Offset(0), AtEnd(false) {}
+
+  void Fill() {
+    Length = Offset = 0;
+    while (Length < Buffer.size()) {
+      ssize_t len = read(Fd, &Buffer[Length], Buffer.size() - Length);
+      if (len == -1) {
+	if (errno == EINTR)
+	  continue;
+	throw Exception("Failed to read '" + Entry->Pathname() + "'");
+      }
+      if (len == 0) {
+	AtEnd = true;
+	break;
+      }
+      Length += len;
+    }
+  }
+};
+
+void PosixVolumeBroker::ReadChecksums(const FileInfoArray& entries,
+				      checksum_t::Algorithm algorithm) const
+{
+  FileInfoArray pending;
+  for (FileInfoArray::const_iterator i = entries.begin();
+       i != entries.end();
+       i++) {
+    if ((*i)->HasFlags(FILEINFO_READCSUM) &&
+	(*i)->Checksum().Kind() == algorithm)
+      continue;
+
+    if (Checksums) {
+      struct stat	   info;
+      ChecksumCache::Stamp stamp;
+      checksum_t	   csum;
+      if (stat((*i)->Pathname().c_str(), &info) == 0) {
+	StampFile(info, stamp);
+	if (Checksums->Find(stamp, algorithm, csum)) {
+	  (*i)->SetChecksum(csum);
+	  continue;
+	}
+      }
+    }
+    pending.push_back(*i);
+  }
+
+  // The service hashes the files on its own threads, and the
+  // comparer picks up each checksum as it needs it.  Tree checksums
+  // are left to ComputeChecksum, which already uses every core.
+  if (Repository->HashEngine && ! checksum_t::IsTree(algorithm)) {
+    std::vector<std::string> paths;
+    for (FileInfoArray::iterator i = pending.begin();
+	 i != pending.end();
+	 i++)
+      paths.push_back((*i)->Pathname());
+    Repository->HashEngine->Enter(paths, algorithm);
+    return;
+  }
+
+  // Only MD5 is worth hashing in lanes; XXH64 already keeps up with
+  // reading the files.
+  unsigned int width = MD5Lanes::Width();
+  if (algorithm != checksum_t::MD5 || width == 1 || pending.size() < 2) {
+    VolumeBroker::ReadChecksums(pending, algorithm);
+    return;
+  }
+
+  // Each lane hashes one file after another, and every pass hashes
+  // as many blocks as all the busy lanes have buffered, so that the
+  // lanes are kept full until the last few files.
+  std::vector<ChecksumLane> lanes(std::min<std::size_t>(width,
+							pending.size()));
+  FileInfoArray::size_type next = 0;
+
+  try {
+    for (;;) {
+      md5_state_t *	 states[16];
+      const md5_byte_t * data[16];
+      unsigned int	 count	= 0;
+      std::size_t	 blocks = 0;
+
+      for (std::vector<ChecksumLane>::iterator i = lanes.begin();
+	   i != lanes.end();
+	   i++) {
+	ChecksumLane& lane(*i);
+
+	for (;;) {
+	  if (! lane.Entry) {
+	    if (next == pending.size())
+	      break;
+
+	    lane.Entry	 = pending[next++];
+	    lane.Started = std::time(NULL);
+	    lane.AtEnd	 = false;
+
+	    Path path(lane.Entry->Pathname());
+	    lane.Fd = open(path.c_str(), O_RDONLY);
+	    if (lane.Fd == -1)
+	      throw Exception("Failed to open '" + path + "'");
+
+	    if (Checksums) {
+	      struct stat info;
+	      if (fstat(lane.Fd, &info) == -1)
+		throw Exception("Failed to stat '" + path + "'");
+	      StampFile(info, lane.Stamp);
+	    }
+
+	    md5_init(&lane.State);
+	    lane.Fill();
+	  }
+
+	  std::size_t remaining = lane.Length - lane.Offset;
+	  if (remaining >= MD5_BLOCK_SIZE)
+	    break;
+	  if (! lane.AtEnd) {
+	    lane.Fill();
+	    continue;
+	  }
+
+	  checksum_t csum(checksum_t::MD5);
+	  md5_append(&lane.State, &lane.Buffer[lane.Offset], remaining);
+	  md5_finish(&lane.State, csum.digest);
+	  close(lane.Fd);
+	  lane.Fd = -1;
+
+	  lane.Entry->SetChecksum(csum);
+	  if (Checksums)
+	    Checksums->Insert(lane.Stamp, lane.Started, csum);
+	  lane.Entry = NULL;
+	}
+
+	if (lane.Entry) {
+	  std::size_t available = (lane.Length - lane.Offset) / MD5_BLOCK_SIZE;
+	  if (count == 0 || available < blocks)
+	    blocks = available;
+	  states[count] = &lane.State;
+	  data[count]	= &lane.Buffer[lane.Offset];
+	  count++;
+	}
+      }
+
+      if (count == 0)
+	break;
+
+      MD5Lanes::Update(states, data, count, blocks);
+
+      for (std::vector<ChecksumLane>::iterator i = lanes.begin();
+	   i != lanes.end();
+	   i++)
+	if ((*i).Entry)
+	  (*i).Offset += blocks * MD5_BLOCK_SIZE;
+    }
+  }
+  catch (...) {
+    for (std::vector<ChecksumLane>::iterator i = lanes.begin();
+	 i != lanes.end();
+	 i++)
+      if ((*i).Fd != -1)
+	close((*i).Fd);
+    throw;
+  }
+}
+
+#ifdef HAVE_GETDENTS64
+#define GETDENTS_BUFSIZE (128 * 1024)
+
+struct linux_dirent64 {
+  ino64_t	 d_ino;
+  off64_t	 d_off;
+  unsigned short d_reclen;
+  unsigned char	 d_type;
+  char		 d_name[];
+};
+#endif
+
+void PosixVolumeBroker::InsertEntry(PosixFileInfo& parent, const char * name,
+				    unsigned char type) const
+{
+  if (name[0] == '.' &&
+      (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+    return;
+
+  // The checksum cache is not part of the volume's state.
+  if (! parent.Parent &&
+      (std::strcmp(name, CHECKSUM_CACHE_NAME) == 0 ||
+       std::strcmp(name, CHECKSUM_CACHE_NAME ".new") == 0))
+    return;
 
-  md5_finish(&state, csum.digest);
+  // This gets added to the parent upon construction
+  PosixFileInfo * child =
+    static_cast<PosixFileInfo *>(CreateFileInfo(name, &parent));
+
+  child->entryType = type;
+  child->SetFlags(FILEINFO_EXISTS);
+}
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_STATX)
+#define METADATA_RING_SIZE 256
+
+// Each thread which reads directories gets its own ring.
+static boost::thread_specific_ptr<IoUring> MetadataRing;
+
+void PosixVolumeBroker::ReadChildAttributes(PosixFileInfo& entry,
+					    int dirfd) const
+{
+  std::vector<PosixFileInfo *> children;
+  for (FileInfo::ChildrenArray::iterator i = entry.Children()->begin();
+       i != entry.Children()->end();
+       i++)
+    if (! (*i)->HasFlags(FILEINFO_READATTR))
+      children.push_back(static_cast<PosixFileInfo *>(*i));
+  if (children.empty())
+    return;
+
+  IoUring * ring = MetadataRing.get();
+  if (! ring) {
+    ring = new IoUring(METADATA_RING_SIZE);
+    MetadataRing.reset(ring);
+  }
+
+  // Each child is looked up by name relative to the directory we
+  // already have open, so the kernel need not walk the full path for
+  // every entry.
+  unsigned char		   fields = RequiredFields();
+  unsigned int		   mask	  = StatxMask(fields);
+  boost::scoped_ptr<std::vector<struct statx> >
+    results(new std::vector<struct statx>(children.size()));
+  std::vector<int>	   status(children.size());
+
+  std::vector<PosixFileInfo *>::size_type next = 0, done = 0;
+  unsigned int inFlight = 0;
+
+  try {
+    while (done < children.size()) {
+      while (next < children.size() && inFlight < ring->Size()) {
+	struct io_uring_sqe * sqe = ring->GetSubmission();
+	if (! sqe)
+	  break;
+
+	sqe->opcode	 = IORING_OP_STATX;
+	sqe->fd		 = dirfd;
+	sqe->addr	 = reinterpret_cast<unsigned long>
+	  (FileInfo::Names.Data(children[next]->NameId()));
+	sqe->len	 = mask;
+	sqe->off	 = reinterpret_cast<unsigned long>(&(*results)[next]);
+	sqe->statx_flags = AT_SYMLINK_NOFOLLOW | AT_STATX_SYNC_AS_STAT;
+	sqe->user_data	 = next;
+
+	next++;
+	inFlight++;
+      }
+
+      ring->Submit(1);
+
+      unsigned long long index;
+      int		 result;
+      while (ring->NextCompletion(index, result)) {
+	assert(index < status.size());
+	status[index] = result;
+	inFlight--;
+	done++;
+      }
+    }
+  }
+  catch (...) {
+    // Requests still in flight point into results, so they must all
+    // complete before it can be freed.	 If even that fails, its
+    // storage is handed to a vector which is never freed, and the
+    // ring is replaced, so that no stale completion is seen again.
+    if (! ring->Drain()) {
+      (new std::vector<struct statx>)->swap(*results);
+      MetadataRing.reset();
+    }
+    throw;
+  }
+
+  // Nothing is stored until every request has completed, since the
+  // kernel may still be writing into results until then.
+  for (std::vector<PosixFileInfo *>::size_type i = 0;
+       i < children.size();
+       i++) {
+    if (status[i] == 0) {
+      struct stat info;
+      StatxToStat((*results)[i], info);
+      StoreFields(*children[i], info, fields);
+    }
+    else if (status[i] == -ENOENT) {
+      children[i]->SetFlags(FILEINFO_READATTR);
+      children[i]->ClearFlags(FILEINFO_EXISTS);
+      children[i]->attrsRead = POSIX_ATTR_ALL;
+    }
+    // Any other error is left for ReadAttributes to report, if the
+    // attributes of that entry are ever needed.
+  }
 }
+#endif
 
 void PosixVolumeBroker::ReadDirectory(FileInfo& entry) const
 {
@@ -548,27 +1636,116 @@ void PosixVolumeBroker::ReadDirectory(FileInfo& entry) const
 	 posixEntry.IsDirectory() &&
 	 posixEntry.IsReadable());
 
-  DIR * dirp = opendir(posixEntry.Pathname.c_str());
+  if (! Prefetcher) {
+    ListDirectory(posixEntry);
+    return;
+  }
+
+  Path pathname;
+  AppendFullPath(posixEntry, pathname);
+
+  StatAhead::DirEntryArray entries;
+  int			   error;
+  if (Prefetcher->TakeListing(pathname, entries, error) && error == 0) {
+    for (StatAhead::DirEntryArray::iterator i = entries.begin();
+	 i != entries.end();
+	 i++)
+      InsertEntry(posixEntry, (*i).Name.c_str(), (*i).Type);
+  } else {
+    ListDirectory(posixEntry);
+  }
+
+  // The comparer is about to visit these children, in order, so ask
+  // for their attributes now, and for the listings of those which are
+  // directories.  Each child's path is its name put after ours.
+  std::vector<std::string> statPaths;
+  std::vector<std::string> listPaths;
+  if (pathname.empty() || pathname[pathname.length() - 1] != '/')
+    pathname.push_back('/');
+  std::size_t prefix = pathname.length();
+  for (FileInfo::ChildrenArray::iterator i = posixEntry.Children()->begin();
+       i != posixEntry.Children()->end();
+       i++) {
+    PosixFileInfo * child = static_cast<PosixFileInfo *>(*i);
+    pathname.resize(prefix);
+    pathname.append(FileInfo::Names.Data(child->NameId()),
+		    FileInfo::Names.Length(child->NameId()));
+    if (child->HasFlags(FILEINFO_READATTR)) {
+      if (child->Exists() && S_ISDIR(child->mode))
+	listPaths.push_back(pathname);
+    } else {
+      statPaths.push_back(pathname);
+#ifdef DT_UNKNOWN
+      if (child->entryType == DT_DIR)
+	listPaths.push_back(pathname);
+#endif
+    }
+  }
+  Prefetcher->Enter(statPaths, listPaths);
+}
+
+void PosixVolumeBroker::ListDirectory(PosixFileInfo& posixEntry) const
+{
+  Path pathname;
+  AppendFullPath(posixEntry, pathname);
+
+#ifdef HAVE_GETDENTS64
+  // Read the directory in large chunks, rather than going through
+  // readdir, so that listing even a very large directory costs only a
+  // handful of system calls.
+  int fd = open(pathname.c_str(),
+		O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1)
+    return;
+
+  boost::scoped_array<char> buf(new char[GETDENTS_BUFSIZE]);
+
+  for (;;) {
+    long len = syscall(SYS_getdents64, fd, buf.get(), GETDENTS_BUFSIZE);
+    if (len == -1) {
+      close(fd);
+      throw Exception("Failed to read directory '" + pathname + "'");
+    }
+    if (len == 0)
+      break;
+
+    for (long offset = 0; offset < len; ) {
+      struct linux_dirent64 * dp =
+	reinterpret_cast<struct linux_dirent64 *>(buf.get() + offset);
+      InsertEntry(posixEntry, dp->d_name, dp->d_type);
+      offset += dp->d_reclen;
+    }
+  }
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_STATX)
+  if (Repository && Repository->BatchMetadata && IoUring::Available()) {
+    try {
+      ReadChildAttributes(posixEntry, fd);
+    }
+    catch (...) {
+      close(fd);
+      throw;
+    }
+  }
+#endif
+
+  close(fd);
+#else
+  DIR * dirp = opendir(pathname.c_str());
   if (dirp == NULL)
     return;
 
   struct dirent * dp;
   while ((dp = readdir(dirp)) != NULL) {
-#ifdef DIRENT_HAS_D_NAMLEN
-    int len = dp->d_namlen;
+#ifdef DT_UNKNOWN
+    InsertEntry(posixEntry, dp->d_name, dp->d_type);
 #else
-    int len = std::strlen(dp->d_name);
+    InsertEntry(posixEntry, dp->d_name, 0);
 #endif
-    if (dp->d_name[0] == '.' &&
-	(len == 1 || (len == 2 && dp->d_name[1] == '.')))
-      continue;
-
-    // This gets added to the parent upon construction
-    CreateFileInfo(Path::Combine(posixEntry.FullName, dp->d_name),
-		   &posixEntry);
   }
 
   (void)closedir(dirp);
+#endif
 }
 
 void PosixVolumeBroker::CreateDirectory(const Path& path)
@@ -593,7 +1770,7 @@ void PosixVolumeBroker::Create(FileInfo& entry)
 {
   if (entry.IsDirectory()) {
     if (! entry.Exists())
-      CreateDirectory(entry.Pathname);
+      CreateDirectory(entry.Pathname());
   }
   else if (! entry.Exists()) {
     CreateFile(static_cast<PosixFileInfo&>(entry));
@@ -604,15 +1781,17 @@ void PosixVolumeBroker::Create(FileInfo& entry)
 
 void PosixVolumeBroker::Delete(FileInfo& entry)
 {
+  FlushInstalls(entry.Pathname());
+
   if (entry.IsDirectory()) {
-    for (FileInfo::ChildrenMap::iterator i = entry.ChildrenBegin();
+    for (FileInfo::ChildrenArray::iterator i = entry.ChildrenBegin();
 	 i != entry.ChildrenEnd();
 	 i++)
-      (*i).second->Delete();
-    DeleteDirectory(entry.Pathname);
+      (*i)->Delete();
+    DeleteDirectory(entry.Pathname());
   }
   else if (! entry.IsVirtual() && entry.Exists()) {
-    DeleteFile(entry.Pathname);
+    DeleteFile(entry.Pathname());
   }
 
   entry.ClearFlags(FILEINFO_EXISTS);
@@ -628,8 +1807,24 @@ void PosixVolumeBroker::Copy(const FileInfo& entry, const Path& dest)
     assert(0);
 }
 
+void PosixVolumeBroker::Update(const FileInfo& entry, FileInfo& dest)
+{
+  // Only what has changed is written, but that can only be done over
+  // the old contents, and only with the new ones at hand to compare.
+  if (Repository->CopyByOverwrite && ! Repository->CopyWholeFiles &&
+      entry.IsRegularFile() && dest.IsRegularFile() &&
+      entry.Length() >= UPDATE_MIN_LENGTH &&
+      dynamic_cast<PosixVolumeBroker *>(entry.Repository->SiteBroker))
+    UpdateFile(entry, static_cast<PosixFileInfo&>(dest));
+  else
+    Copy(entry, dest.Pathname());
+}
+
 void PosixVolumeBroker::Move(FileInfo& entry, const Path& dest)
 {
+  FlushInstalls(entry.Pathname());
+  FlushInstalls(dest);
+
   if (entry.IsRegularFile())
     MoveFile(static_cast<PosixFileInfo&>(entry), dest);
   else if (entry.IsDirectory())
@@ -638,4 +1833,16 @@ void PosixVolumeBroker::Move(FileInfo& entry, const Path& dest)
     assert(0);
 }
 
+void PosixVolumeBroker::Flush()
+{
+  if (Installs)
+    Installs->Flush();
+}
+
+void PosixVolumeBroker::Sync()
+{
+  if (Installs)
+    Installs->Sync();
+}
+
 } // namespace Attic
@@ -21,23 +21,68 @@ class PosixFileInfo : public FileInfo
 #define POSIX_FILEINFO_LINKCHG	0x10
 #define POSIX_FILEINFO_ALLFLAGS 0xff
 
-  mutable struct stat	info;
+#define POSIX_ATTR_BASIC	0x01 // kind, permissions, size, mtime
+#define POSIX_ATTR_OWNER	0x02
+#define POSIX_ATTR_GROUP	0x04
+#define POSIX_ATTR_ATIME	0x08 // kept in PosixExtraInfo
+#define POSIX_ATTR_NLINK	0x10 // with the inode, in PosixExtraInfo
+#define POSIX_ATTR_ENTRY	0x07 // all those kept in the entry itself
+#define POSIX_ATTR_ALL		0xff
+
+  struct PosixExtraInfo : public ExtraInfo {
+    Path	 LinkTarget;	// symbolic links only
+
+    // Only wanted for entries whose attributes are copied, or whose
+    // hard links are looked for, so they are read when asked for.
+    long long	 AccessTime;	// in nanoseconds since the epoch
+    ino_t	 Inode;
+    unsigned int LinkCount;
+
+    PosixExtraInfo() : AccessTime(0), Inode(0), LinkCount(0) {}
+  };
+
+  // There is one of these for every entry in a tree, so only the
+  // parts of struct stat which a Location compares are kept, packed
+  // into the space left after FileInfo's own members; on LP64
+  // systems an entry takes 64 bytes in all.
   mutable posix_flags_t posixFlags;
+  mutable posix_flags_t attrsRead; // which fields are valid
 
-  union {
-    Path * LinkTargetPath;
-  };
+  // Filled in from the directory listing, this lets us answer
+  // FileKind without an lstat.
+  unsigned char		entryType; // d_type, or 0 (DT_UNKNOWN)
+
+  mode_t		mode;
+  mutable unsigned int	owner;	// the uid and gid, as an id in Owners
+  unsigned long long	size;
+  long long		mtime;	// in nanoseconds since the epoch
+
+  // Few distinct uid and gid pairs turn up in any tree.
+  static NameTable Owners;
+
+  void ReadFields(posix_flags_t fields) const;
+  void GetOwner(uid_t& uid, gid_t& gid) const;
+  void SetOwner(uid_t uid, gid_t gid) const;
+
+  virtual ExtraInfo * CreateExtra() const {
+    return new PosixExtraInfo;
+  }
+  PosixExtraInfo& PosixExtra() const {
+    return static_cast<PosixExtraInfo&>(Extra());
+  }
 
 public:
   PosixFileInfo(Location * _Repository = NULL)
-    : FileInfo(_Repository), posixFlags(POSIX_FILEINFO_NOFLAGS) {}
+    : FileInfo(_Repository), posixFlags(POSIX_FILEINFO_NOFLAGS),
+      attrsRead(0), entryType(0), mode(0), owner(0), size(0),
+      mtime(0) {}
   
   PosixFileInfo(const Path& _FullName, FileInfo * _Parent = NULL,
 		Location * _Repository = NULL)
     : FileInfo(_FullName, _Parent, _Repository),
-      posixFlags(POSIX_FILEINFO_NOFLAGS) {}
-
-  virtual ~PosixFileInfo() {}
+      posixFlags(POSIX_FILEINFO_NOFLAGS),
+      attrsRead(0), entryType(0), mode(0), owner(0), size(0),
+      mtime(0) {}
 
   virtual Kind FileKind() const;
 
@@ -52,12 +97,12 @@ public:
   virtual unsigned long long Length() const;
 
   mode_t Permissions() const;    
-  void SetPermissions(const mode_t& mode);    
+  void SetPermissions(const mode_t& perms);    
 
-  const uid_t& OwnerId() const;    
+  uid_t OwnerId() const;    
   void SetOwnerId(const uid_t& uid) const;    
 
-  const gid_t& GroupId() const;    
+  gid_t GroupId() const;    
   void SetGroupId(const gid_t& gid);    
 
   virtual DateTime LastWriteTime() const;
@@ -66,6 +111,10 @@ public:
   DateTime LastAccessTime() const;
   void SetLastAccessTime(const DateTime& when);
 
+  // Entries which are hard links to one another share an inode.
+  ino_t	       Inode() const;
+  unsigned int LinkCount() const;
+
   Path LinkTarget() const;
   void SetLinkTarget(const Path& path);
 
@@ -80,8 +129,17 @@ public:
   friend class PosixVolumeBroker;
 };
 
+class StatAhead;
+class ChecksumCache;
+class CopyEngine;
+class Installer;
 class PosixVolumeBroker : public VolumeBroker
 {
+  StatAhead *	  Prefetcher;
+  ChecksumCache * Checksums;
+  CopyEngine *	  Copier;
+  Installer *	  Installs;	// unless copying directly over each target
+
   void SetPermissions(const Path& path, mode_t mode);
   void SetOwnership(const Path& path, uid_t uid, gid_t gid);
   void SetAccessTimes(const Path& path, const DateTime& LastAccessTime,
@@ -93,8 +151,18 @@ class PosixVolumeBroker : public VolumeBroker
   void CopyFile(const FileInfo& entry, const Path& dest);
   void UpdateFile(const FileInfo& entry, const PosixFileInfo& dest);
   void MoveFile(const PosixFileInfo& entry, const Path& dest);
+  void FlushInstalls(const Path& path);
   void WriteFile(const PosixFileInfo& entry, std::ostream& out);
 
+  unsigned char RequiredFields() const;
+  void ReadFields(PosixFileInfo& entry, unsigned char fields) const;
+  void StoreFields(PosixFileInfo& entry, const struct stat& info,
+		   unsigned char fields) const;
+  void ReadChildAttributes(PosixFileInfo& entry, int dirfd) const;
+  void ListDirectory(PosixFileInfo& entry) const;
+  void InsertEntry(PosixFileInfo& parent, const char * name,
+		   unsigned char type) const;
+
   //void CreateDirectory(const PosixFileInfo& entry);
   void DeleteDirectory(const Path& entry);
   void CopyDirectory(const FileInfo& entry, const Path& dest);
@@ -103,14 +171,18 @@ class PosixVolumeBroker : public VolumeBroker
 public:
   explicit PosixVolumeBroker(const Path& _RootPath,
 			     const Path& _VolumePath = "/")
-    : VolumeBroker(_RootPath, _VolumePath) {}
-    
+    : VolumeBroker(_RootPath, _VolumePath), Prefetcher(NULL),
+      Checksums(NULL), Copier(NULL), Installs(NULL) {}
+  virtual ~PosixVolumeBroker();
+
+  virtual void SetRepository(Location * _Repository);
+
   virtual FileInfo * FindRoot() {
     return CreateFileInfo("");
   }
   virtual FileInfo * CreateFileInfo(const Path& path,
 				    FileInfo * parent = NULL) const {
-    return new PosixFileInfo(path, parent, Repository);
+    return new (Repository) PosixFileInfo(path, parent, Repository);
   }
 
   virtual unsigned long long Length(const Path& path) const;
@@ -124,7 +196,12 @@ public:
   virtual void SyncAttributes(const FileInfo& entry);
   virtual void CopyAttributes(const FileInfo& entry, const Path& dest);
 
-  virtual void ComputeChecksum(const Path& path, md5sum_t& csum) const;
+  virtual void ComputeChecksum(const Path& path,
+			       checksum_t::Algorithm algorithm,
+			       checksum_t& csum,
+			       std::vector<checksum_t> * chunks = NULL) const;
+  virtual void ReadChecksums(const FileInfoArray& entries,
+			     checksum_t::Algorithm algorithm) const;
 
   virtual void ReadDirectory(FileInfo& entry) const;
   virtual void CreateDirectory(const Path& path);
@@ -132,6 +209,9 @@ public:
   virtual void Delete(FileInfo& entry);
   virtual void Copy(const FileInfo& source, const Path& dest);
   virtual void Move(FileInfo& entry, const Path& dest);
+  virtual void Update(const FileInfo& entry, FileInfo& dest);
+  virtual void Flush();
+  virtual void Sync();
 
   virtual Path GetSignature(const FileInfo& entry) const { return Path(); }
   virtual Path CreateDelta(const FileInfo& entry, const Path& sigfile) { return Path(); }
@@ -0,0 +1,225 @@
+#include "Scanner.h"
+#include "Location.h"
+
+namespace Attic {
+
+Scanner::Scanner(unsigned int threads)
+  : NextQueue(0), PendingJobs(0), ShuttingDown(false)
+{
+  assert(threads > 0);
+
+  for (unsigned int i = 0; i < threads; i++)
+    Queues.push_back(new WorkQueue);
+  for (unsigned int i = 0; i < threads; i++)
+    Workers.create_thread(Worker(this, i));
+}
+
+Scanner::~Scanner()
+{
+  {
+    scoped_lock lock(StatusMutex);
+    ShuttingDown = true;
+    WorkAvailable.notify_all();
+  }
+  Workers.join_all();
+
+  for (std::vector<WorkQueue *>::iterator i = Queues.begin();
+       i != Queues.end();
+       i++)
+    delete *i;
+}
+
+void Scanner::Start(FileInfo * root)
+{
+  assert(root);
+
+  // The root's own attributes are read here, so that no worker ever
+  // races with the caller over them.
+  root->ReadAttributes();
+  if (! root->Exists() || ! root->IsDirectory())
+    return;
+
+  unsigned int index;
+  {
+    scoped_lock lock(StatusMutex);
+    if (! Directories.insert(StatusPair(root, Status())).second)
+      return;
+    PendingJobs++;
+    index = NextQueue++ % Queues.size();
+  }
+  Push(index, root);
+}
+
+bool Scanner::WaitFor(const FileInfo& entry)
+{
+  scoped_lock lock(StatusMutex);
+
+  StatusMap::iterator i = Directories.find(&entry);
+  if (i == Directories.end())
+    return false;
+
+  if ((*i).second.ScanState == Queued) {
+    // Nobody has gotten to this directory yet, so rather than wait
+    // we read it ourselves.  The job left in the worker's deque will
+    // be discarded when it fails to claim the entry.
+    (*i).second.ScanState = Claimed;
+    unsigned int index = NextQueue++ % Queues.size();
+
+    lock.unlock();
+    Scan(const_cast<FileInfo&>(entry), index);
+    lock.lock();
+
+    i = Directories.find(&entry);
+    assert(i != Directories.end());
+  }
+
+  while ((*i).second.ScanState == Claimed) {
+    StatusChanged.wait(lock);
+    i = Directories.find(&entry);
+    assert(i != Directories.end());
+  }
+
+  if ((*i).second.ScanState == Failed) {
+    std::string reason = (*i).second.Reason;
+    Directories.erase(i);
+    throw Exception("Failed to scan directory '" + entry.Moniker() +
+		    "': " + reason);
+  }
+
+  assert((*i).second.ScanState == Finished);
+  Directories.erase(i);
+  return true;
+}
+
+void Scanner::Run(unsigned int index)
+{
+  for (;;) {
+    {
+      scoped_lock lock(StatusMutex);
+      while (PendingJobs == 0 && ! ShuttingDown)
+	WorkAvailable.wait(lock);
+      if (ShuttingDown)
+	return;
+    }
+
+    FileInfo * entry = Pop(index);
+    if (! entry)
+      entry = Steal(index);
+
+    if (entry && Claim(entry))
+      Scan(*entry, index);
+  }
+}
+
+void Scanner::Push(unsigned int index, FileInfo * entry)
+{
+  {
+    scoped_lock lock(Queues[index]->QueueMutex);
+    Queues[index]->Jobs.push_back(entry);
+  }
+  scoped_lock lock(StatusMutex);
+  WorkAvailable.notify_all();
+}
+
+FileInfo * Scanner::Pop(unsigned int index)
+{
+  FileInfo * entry;
+  {
+    scoped_lock lock(Queues[index]->QueueMutex);
+    if (Queues[index]->Jobs.empty())
+      return NULL;
+    entry = Queues[index]->Jobs.back();
+    Queues[index]->Jobs.pop_back();
+  }
+  scoped_lock lock(StatusMutex);
+  PendingJobs--;
+  return entry;
+}
+
+FileInfo * Scanner::Steal(unsigned int index)
+{
+  for (unsigned int n = 1; n < Queues.size(); n++) {
+    WorkQueue * victim = Queues[(index + n) % Queues.size()];
+
+    FileInfo * entry;
+    {
+      scoped_lock lock(victim->QueueMutex);
+      if (victim->Jobs.empty())
+	continue;
+      entry = victim->Jobs.front();
+      victim->Jobs.pop_front();
+    }
+    scoped_lock lock(StatusMutex);
+    PendingJobs--;
+    return entry;
+  }
+  return NULL;
+}
+
+bool Scanner::Claim(FileInfo * entry)
+{
+  scoped_lock lock(StatusMutex);
+
+  StatusMap::iterator i = Directories.find(entry);
+  if (i == Directories.end() || (*i).second.ScanState != Queued)
+    return false;
+
+  (*i).second.ScanState = Claimed;
+  return true;
+}
+
+void Scanner::Scan(FileInfo& entry, unsigned int index)
+{
+  FileInfoArray subdirs;
+
+  try {
+    assert(! entry.Children());
+    entry.ListChildren();
+
+    for (FileInfo::ChildrenArray::iterator i = entry.Children()->begin();
+	 i != entry.Children()->end();
+	 i++) {
+      FileInfo * child = *i;
+      child->ReadAttributes();
+      if (child->Exists() && child->IsDirectory())
+	subdirs.push_back(child);
+    }
+  }
+  catch (const std::exception& err) {
+    scoped_lock lock(StatusMutex);
+    Status& status(Directories[&entry]);
+    status.ScanState = Failed;
+    status.Reason    = err.what();
+    StatusChanged.notify_all();
+    return;
+  }
+
+  {
+    scoped_lock lock(StatusMutex);
+    for (FileInfoArray::iterator i = subdirs.begin();
+	 i != subdirs.end();
+	 i++) {
+      Directories.insert(StatusPair(*i, Status()));
+      PendingJobs++;
+    }
+    Directories[&entry].ScanState = Finished;
+    StatusChanged.notify_all();
+  }
+
+  if (subdirs.empty())
+    return;
+
+  // Push in reverse, so that the owning worker pops the children in
+  // the same order in which the comparer will visit them.
+  {
+    scoped_lock lock(Queues[index]->QueueMutex);
+    for (FileInfoArray::reverse_iterator i = subdirs.rbegin();
+	 i != subdirs.rend();
+	 i++)
+      Queues[index]->Jobs.push_back(*i);
+  }
+  scoped_lock lock(StatusMutex);
+  WorkAvailable.notify_all();
+}
+
+} // namespace Attic
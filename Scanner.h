@@ -0,0 +1,101 @@
+#ifndef _SCANNER_H
+#define _SCANNER_H
+
+#include "FileInfo.h"
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <string>
+
+#include <boost/thread.hpp>
+
+namespace Attic {
+
+// A Scanner reads the directories of a Location on a pool of worker
+// threads, ahead of whoever is walking the tree (normally the
+// comparer in ChangeSet::CompareFiles).  Each worker keeps its own
+// deque of directories to read: it pushes the subdirectories it
+// discovers onto the back of its deque and takes its next job from
+// the back as well, so that each worker proceeds depth-first through
+// a subtree.  A worker with nothing left to do steals from the front
+// of another worker's deque, which is where the largest untouched
+// subtrees are found.
+//
+// When a worker reads a directory, it creates the FileInfo children
+// and reads their attributes, then marks the directory as finished.
+// FileInfo::ChildrenBegin calls WaitFor before touching the children
+// of a directory, which hands over the finished directory to the
+// caller.  If nobody has claimed that directory yet, the caller
+// simply reads it on its own thread instead of waiting.  WaitFor
+// returns false for directories the Scanner knows nothing about
+// (such as those in a tree not passed to Start), in which case they
+// are read lazily, as before.
+
+class Scanner
+{
+public:
+  typedef boost::mutex::scoped_lock scoped_lock;
+
+  explicit Scanner(unsigned int threads);
+  ~Scanner();
+
+  void Start(FileInfo * root);
+  bool WaitFor(const FileInfo& entry);
+
+private:
+  enum State {
+    Queued, Claimed, Finished, Failed
+  };
+
+  struct Status {
+    State	ScanState;
+    std::string Reason;
+
+    Status() : ScanState(Queued) {}
+  };
+
+  typedef std::map<const FileInfo *, Status>  StatusMap;
+  typedef std::pair<const FileInfo *, Status> StatusPair;
+
+  struct WorkQueue {
+    boost::mutex	   QueueMutex;
+    std::deque<FileInfo *> Jobs;
+  };
+
+  std::vector<WorkQueue *> Queues;
+  boost::thread_group	   Workers;
+  unsigned int		   NextQueue;
+
+  // All of the following are guarded by StatusMutex.
+  boost::mutex		   StatusMutex;
+  boost::condition	   StatusChanged; // a directory was finished
+  boost::condition	   WorkAvailable; // a job was pushed, or shutdown
+  StatusMap		   Directories;
+  unsigned int		   PendingJobs;
+  bool			   ShuttingDown;
+
+  class Worker {
+    Scanner *	 Engine;
+    unsigned int Index;
+  public:
+    Worker(Scanner * _Engine, unsigned int _Index)
+      : Engine(_Engine), Index(_Index) {}
+    void operator()() {
+      Engine->Run(Index);
+    }
+  };
+
+  void Run(unsigned int index);
+  void Push(unsigned int index, FileInfo * entry);
+  FileInfo * Pop(unsigned int index);
+  FileInfo * Steal(unsigned int index);
+  bool Claim(FileInfo * entry);
+  void Scan(FileInfo& entry, unsigned int index);
+
+  friend class Worker;
+};
+
+} // namespace Attic
+
+#endif // _SCANNER_H
@@ -0,0 +1,150 @@
+#include "Snapshot.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace Attic {
+
+#ifdef __SSE2__
+static inline __m128i Load(const void * ptr)
+{
+  return _mm_loadu_si128(static_cast<const __m128i *>(ptr));
+}
+#endif
+
+Snapshot::Snapshot(FileInfo * root)
+{
+  if (root)
+    Add(root, 0, 0);
+}
+
+void Snapshot::Add(FileInfo * entry, unsigned int depth, unsigned int parent)
+{
+  unsigned int index = static_cast<unsigned int>(Keys.size());
+
+  // The roots of two locations are always the same path, whatever
+  // their names may be.
+  unsigned long long nameId = depth == 0 ? 0 : entry->NameId();
+
+  FileInfo::Kind kind = entry->FileKind();
+
+  Keys.push_back(static_cast<unsigned long long>(depth) << 32 | nameId);
+  Parents.push_back(parent);
+  Kinds.push_back(static_cast<unsigned char>(kind));
+  Entries.push_back(entry);
+
+  if (kind == FileInfo::RegularFile) {
+    DateTime when(entry->LastWriteTime());
+    Lengths.push_back(entry->Length());
+    Times.push_back(static_cast<long long>(when.secs) * 1000000000LL +
+		    when.nsecs);
+  } else {
+    Lengths.push_back(0);
+    Times.push_back(0);
+  }
+
+  if (kind == FileInfo::Directory)
+    for (FileInfo::ChildrenArray::const_iterator i = entry->ChildrenBegin();
+	 i != entry->ChildrenEnd();
+	 i++)
+      Add(*i, depth + 1, index);
+}
+
+Snapshot::size_type Snapshot::SubtreeEnd(size_type index) const
+{
+  unsigned int depth = Depth(index);
+  for (index++; index < size() && Depth(index) > depth; index++)
+    ;
+  return index;
+}
+
+int Snapshot::ComparePaths(size_type index, const Snapshot& other,
+			   size_type otherIndex) const
+{
+  unsigned int depth	  = Depth(index);
+  unsigned int otherDepth = other.Depth(otherIndex);
+
+  // Everything above the shallower of the two is common to both, so
+  // they differ at that depth, if anywhere.
+  size_type left  = AncestorAt(index, otherDepth);
+  size_type right = other.AncestorAt(otherIndex, depth);
+
+  if ((Keys[left] & 0xffffffffULL) == (other.Keys[right] & 0xffffffffULL))
+    return depth < otherDepth ? -1 : (depth > otherDepth ? 1 : 0);
+
+  return Entries[left]->CompareName(*other.Entries[right]);
+}
+
+Snapshot::size_type Snapshot::MatchingRun(size_type index,
+					  const Snapshot& other,
+					  size_type otherIndex,
+					  size_type count,
+					  bool lengthOnly) const
+{
+  const unsigned long long * keys	= &Keys[index];
+  const unsigned long long * otherKeys	= &other.Keys[otherIndex];
+  const unsigned char *	     kinds	= &Kinds[index];
+  const unsigned char *	     otherKinds	= &other.Kinds[otherIndex];
+  const unsigned long long * lengths	= &Lengths[index];
+  const unsigned long long * otherLengths = &other.Lengths[otherIndex];
+  const long long *	     times	= &Times[index];
+  const long long *	     otherTimes	= &other.Times[otherIndex];
+
+  size_type run = 0;
+
+#ifdef __SSE2__
+  // Sixteen entries at a time: the kinds in one comparison, and the
+  // other columns two entries at a time, each entry matching only if
+  // both 32-bit halves of the difference of each column are zero.
+  const __m128i zero	 = _mm_setzero_si128();
+  const __m128i symlinks = _mm_set1_epi8(FileInfo::SymbolicLink);
+  const __m128i timeMask = lengthOnly ? zero : _mm_cmpeq_epi32(zero, zero);
+
+  while (run + 16 <= count) {
+    __m128i left  = Load(kinds + run);
+    __m128i right = Load(otherKinds + run);
+
+    unsigned int same =
+      _mm_movemask_epi8(_mm_andnot_si128(_mm_cmpeq_epi8(left, symlinks),
+					 _mm_cmpeq_epi8(left, right)));
+
+    for (unsigned int lane = 0; lane < 16; lane += 2) {
+      size_type at = run + lane;
+      __m128i diff =
+	_mm_or_si128(_mm_xor_si128(Load(keys + at), Load(otherKeys + at)),
+		     _mm_xor_si128(Load(lengths + at), Load(otherLengths + at)));
+      diff = _mm_or_si128(diff, _mm_and_si128(timeMask,
+					      _mm_xor_si128(Load(times + at),
+							    Load(otherTimes + at))));
+
+      int equal =
+	_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(diff, zero)));
+      if ((equal & 0x3) != 0x3)
+	same &= ~(1U << lane);
+      if ((equal & 0xc) != 0xc)
+	same &= ~(2U << lane);
+    }
+
+    if (same != 0xffff) {
+      while (same & 1) {
+	same >>= 1;
+	run++;
+      }
+      return run;
+    }
+    run += 16;
+  }
+#endif
+
+  for (; run < count; run++)
+    if (keys[run] != otherKeys[run] || kinds[run] != otherKinds[run] ||
+	kinds[run] == FileInfo::SymbolicLink ||
+	lengths[run] != otherLengths[run] ||
+	(! lengthOnly && times[run] != otherTimes[run]))
+      break;
+
+  return run;
+}
+
+} // namespace Attic
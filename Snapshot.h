@@ -0,0 +1,86 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include "FileInfo.h"
+
+#include <vector>
+
+namespace Attic {
+
+// A Snapshot is a columnar copy of just those details of a tree that
+// a comparison by length and modification time looks at: a key, kind,
+// length and time for every entry, each kept in an array of its own,
+// so that two trees can be compared by scanning a few flat arrays
+// side by side rather than by walking two graphs of FileInfo objects
+// and asking each of them for its details through a virtual call.
+// Since it only reads the tree, it can be taken of any Location,
+// whether its broker is a volume or a database.
+//
+// Entries are in the order of a depth-first walk which visits the
+// children of each directory sorted by name, which is also the order
+// of their full names taken component by component.  The key of an
+// entry packs its depth together with the id of its name.  When two
+// snapshots are merged in this order, everything above the two
+// current entries is always the same path on both sides, so two
+// entries with the same key are the same path, and the long runs of
+// unchanged entries can be recognized by comparing integers.
+//
+// Only regular files record a length and time; for anything else both
+// are zero, so that they always compare equal.
+
+class Snapshot
+{
+public:
+  typedef std::vector<FileInfo *>::size_type size_type;
+
+  std::vector<unsigned long long> Keys;	   // depth << 32 | name id
+  std::vector<unsigned int>	  Parents; // index of each entry's parent
+  std::vector<unsigned char>	  Kinds;
+  std::vector<unsigned long long> Lengths;
+  std::vector<long long>	  Times;   // in nanoseconds
+  std::vector<FileInfo *>	  Entries;
+
+  explicit Snapshot(FileInfo * root);
+
+  size_type size() const {
+    return Keys.size();
+  }
+
+  unsigned int Depth(size_type index) const {
+    return static_cast<unsigned int>(Keys[index] >> 32);
+  }
+
+  // The entry at the given depth that index lies within, which may
+  // be index itself.
+  size_type AncestorAt(size_type index, unsigned int depth) const {
+    while (Depth(index) > depth)
+      index = Parents[index];
+    return index;
+  }
+
+  // The index just past the entry at index and everything below it.
+  size_type SubtreeEnd(size_type index) const;
+
+  // Compare the path of the entry at index with that of the entry at
+  // otherIndex in other, where both are the next entries of a merge,
+  // returning less than, equal to or greater than zero as with
+  // std::string::compare.
+  int ComparePaths(size_type index, const Snapshot& other,
+		   size_type otherIndex) const;
+
+  // Return how many of the count entries starting at index match
+  // those starting at otherIndex in other: that is, have the same
+  // key, kind, length, and time (unless lengthOnly is true).  The
+  // run also stops at any symbolic link, since where they point is
+  // not recorded here.
+  size_type MatchingRun(size_type index, const Snapshot& other,
+			size_type otherIndex, size_type count,
+			bool lengthOnly) const;
+
+private:
+  void Add(FileInfo * entry, unsigned int depth, unsigned int parent);
+};
+
+} // namespace Attic
+
+#endif // _SNAPSHOT_H
@@ -0,0 +1,212 @@
+#include "StatAhead.h"
+
+#include <cassert>
+
+#include <dirent.h>
+#include <errno.h>
+
+namespace Attic {
+
+StatAhead::StatAhead(unsigned int threads, unsigned int window)
+  : Window(window), NextSequence(0), ShuttingDown(false)
+{
+  assert(threads > 0);
+  assert(window > 0);
+
+  for (unsigned int i = 0; i < threads; i++)
+    Workers.create_thread(Worker(this));
+}
+
+StatAhead::~StatAhead()
+{
+  {
+    scoped_lock lock(ResultsMutex);
+    ShuttingDown = true;
+    WorkAvailable.notify_all();
+  }
+  Workers.join_all();
+}
+
+void StatAhead::Enter(const std::vector<std::string>& statPaths,
+		      const std::vector<std::string>& listPaths)
+{
+  std::vector<Key> batch;
+  for (std::vector<std::string>::const_iterator i = statPaths.begin();
+       i != statPaths.end();
+       i++)
+    batch.push_back(Key(Attributes, *i));
+  for (std::vector<std::string>::const_iterator i = listPaths.begin();
+       i != listPaths.end();
+       i++)
+    batch.push_back(Key(Listing, *i));
+
+  if (batch.empty())
+    return;
+
+  scoped_lock lock(ResultsMutex);
+
+  // The walker will visit these entries next, so they go ahead of
+  // everything queued so far, in the order given.
+  for (std::vector<Key>::reverse_iterator i = batch.rbegin();
+       i != batch.rend();
+       i++)
+    if (Results.insert(ResultMap::value_type(*i, Result())).second)
+      Requests.push_front(*i);
+
+  Trim();
+  WorkAvailable.notify_all();
+}
+
+bool StatAhead::TakeAttributes(const std::string& path, struct stat& info,
+			       int& error)
+{
+  Result result;
+  if (! Take(Key(Attributes, path), result))
+    return false;
+
+  info  = result.Info;
+  error = result.Error;
+  return true;
+}
+
+bool StatAhead::TakeListing(const std::string& path, DirEntryArray& entries,
+			    int& error)
+{
+  Result result;
+  if (! Take(Key(Listing, path), result))
+    return false;
+
+  entries.swap(result.Entries);
+  error = result.Error;
+  return true;
+}
+
+bool StatAhead::Take(const Key& key, Result& result)
+{
+  scoped_lock lock(ResultsMutex);
+
+  ResultMap::iterator i = Results.find(key);
+  if (i == Results.end())
+    return false;
+
+  if ((*i).second.RequestState == Queued) {
+    // Cheaper to do it ourselves than to wait our turn.  The stale
+    // key left in Requests is skipped by whichever worker finds it.
+    Results.erase(i);
+    return false;
+  }
+
+  while ((*i).second.RequestState == Running) {
+    RequestDone.wait(lock);
+    i = Results.find(key);
+    if (i == Results.end())
+      return false;
+  }
+
+  assert((*i).second.RequestState == Done);
+  Finished.erase((*i).second.Sequence);
+  result.Info  = (*i).second.Info;
+  result.Error = (*i).second.Error;
+  result.Entries.swap((*i).second.Entries);
+  Results.erase(i);
+  return true;
+}
+
+void StatAhead::Trim()
+{
+  // Drop the least urgent requests first, since no work has been
+  // spent on them, then the oldest unclaimed results.
+  while (Results.size() > Window) {
+    if (! Requests.empty()) {
+      ResultMap::iterator i = Results.find(Requests.back());
+      if (i != Results.end() && (*i).second.RequestState == Queued)
+	Results.erase(i);
+      Requests.pop_back();
+    }
+    else if (! Finished.empty()) {
+      Results.erase((*Finished.begin()).second);
+      Finished.erase(Finished.begin());
+    }
+    else {
+      break;
+    }
+  }
+}
+
+void StatAhead::Run()
+{
+  for (;;) {
+    Key key;
+    {
+      scoped_lock lock(ResultsMutex);
+      while (Requests.empty() && ! ShuttingDown)
+	WorkAvailable.wait(lock);
+      if (ShuttingDown)
+	return;
+
+      key = Requests.front();
+      Requests.pop_front();
+
+      ResultMap::iterator i = Results.find(key);
+      if (i == Results.end() || (*i).second.RequestState != Queued)
+	continue;
+      (*i).second.RequestState = Running;
+    }
+
+    Result result;
+    Perform(key, result);
+
+    scoped_lock lock(ResultsMutex);
+
+    // Nothing removes a running request, so it must still be there.
+    ResultMap::iterator i = Results.find(key);
+    assert(i != Results.end());
+
+    (*i).second.RequestState = Done;
+    (*i).second.Sequence     = NextSequence++;
+    (*i).second.Info	     = result.Info;
+    (*i).second.Error	     = result.Error;
+    (*i).second.Entries.swap(result.Entries);
+    Finished[(*i).second.Sequence] = key;
+
+    Trim();
+    RequestDone.notify_all();
+  }
+}
+
+void StatAhead::Perform(const Key& key, Result& result)
+{
+  if (key.first == Attributes) {
+    if (lstat(key.second.c_str(), &result.Info) == -1)
+      result.Error = errno;
+    return;
+  }
+
+  DIR * dirp = opendir(key.second.c_str());
+  if (dirp == NULL) {
+    result.Error = errno;
+    return;
+  }
+
+  struct dirent * dp;
+  while ((dp = readdir(dirp)) != NULL) {
+    if (dp->d_name[0] == '.' &&
+	(dp->d_name[1] == '\0' ||
+	 (dp->d_name[1] == '.' && dp->d_name[2] == '\0')))
+      continue;
+
+    DirEntry entry;
+    entry.Name  = dp->d_name;
+#ifdef DT_UNKNOWN
+    entry.Type  = dp->d_type;
+#else
+    entry.Type  = 0;
+#endif
+    entry.Inode = dp->d_ino;
+    result.Entries.push_back(entry);
+  }
+
+  (void)closedir(dirp);
+}
+
+} // namespace Attic
@@ -0,0 +1,113 @@
+#ifndef _STATAHEAD_H
+#define _STATAHEAD_H
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <string>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <boost/thread.hpp>
+
+namespace Attic {
+
+// A StatAhead fetches the attributes and listings of directory
+// entries on background threads, just ahead of a single thread which
+// is walking the tree (normally the comparer in
+// ChangeSet::CompareFiles).  Whenever the walker lists a directory,
+// the broker calls Enter with the entries it is about to visit: every
+// child whose attributes are still unknown is queued to be lstat'd,
+// and every child which is itself a directory is queued to be listed.
+// The newest batch goes to the front of the queue, so the background
+// threads always work on whatever the walker will reach next.
+//
+// The walker picks up those results with TakeAttributes and
+// TakeListing.  If a request has not been started yet, it is dropped
+// and the caller does the work itself, rather than waiting behind
+// other requests; if it is in progress, the caller waits for it.
+// StatAhead only ever deals in paths, so FileInfo objects are never
+// touched by its threads.  At most Window requests and unclaimed
+// results are held at once; the oldest are discarded beyond that.
+
+class StatAhead
+{
+public:
+  typedef boost::mutex::scoped_lock scoped_lock;
+
+  struct DirEntry {
+    std::string	  Name;
+    unsigned char Type;		// d_type, or 0 (DT_UNKNOWN)
+    ino_t	  Inode;
+  };
+  typedef std::vector<DirEntry> DirEntryArray;
+
+  StatAhead(unsigned int threads, unsigned int window);
+  ~StatAhead();
+
+  void Enter(const std::vector<std::string>& statPaths,
+	     const std::vector<std::string>& listPaths);
+
+  // Each returns false if the caller must do the work itself;
+  // otherwise, error is zero or the errno from the failed call.
+  bool TakeAttributes(const std::string& path, struct stat& info, int& error);
+  bool TakeListing(const std::string& path, DirEntryArray& entries,
+		   int& error);
+
+private:
+  enum Kind {
+    Attributes, Listing
+  };
+  enum State {
+    Queued, Running, Done
+  };
+
+  typedef std::pair<Kind, std::string> Key;
+
+  struct Result {
+    State	  RequestState;
+    unsigned long Sequence;	// completion order, once Done
+    int		  Error;
+    struct stat	  Info;
+    DirEntryArray Entries;
+
+    Result() : RequestState(Queued), Sequence(0), Error(0) {}
+  };
+
+  typedef std::map<Key, Result>		 ResultMap;
+  typedef std::map<unsigned long, Key>	 FinishedMap;
+
+  unsigned int		Window;
+  boost::thread_group	Workers;
+
+  // All of the following are guarded by ResultsMutex.
+  boost::mutex		ResultsMutex;
+  boost::condition	WorkAvailable;	// a request was queued, or shutdown
+  boost::condition	RequestDone;	// a running request finished
+  std::deque<Key>	Requests;
+  ResultMap		Results;
+  FinishedMap		Finished;
+  unsigned long		NextSequence;
+  bool			ShuttingDown;
+
+  class Worker {
+    StatAhead * Engine;
+  public:
+    Worker(StatAhead * _Engine) : Engine(_Engine) {}
+    void operator()() {
+      Engine->Run();
+    }
+  };
+
+  void Run();
+  void Perform(const Key& key, Result& result);
+  bool Take(const Key& key, Result& result);
+  void Trim();
+
+  friend class Worker;
+};
+
+} // namespace Attic
+
+#endif // _STATAHEAD_H
@@ -44,9 +44,9 @@ void StateChange::DebugPrint(MessageLog& log) const
   if (Ancestor) {
     LOG(log, Message,
 	label << "Ancestor(" << Ancestor << ") " <<
-	Item->FullName << " ");
+	Item->FullName() << " ");
   } else {
-    LOG(log, Message, label << Item->FullName << " ");
+    LOG(log, Message, label << Item->FullName() << " ");
   }
 }
 
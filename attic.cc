@@ -3,6 +3,10 @@
 #include "FlatDB.h"
 
 #include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <climits>
+#include <cerrno>
 
 #include <boost/thread.hpp>
 
@@ -14,6 +18,41 @@ namespace Attic {
   boost::mutex io_mutex;
 }
 
+// No more threads than this are started for any one task.
+#define MAX_THREADS 256
+
+// Parse the thread count given to option, which must be a whole
+// number no greater than MAX_THREADS.
+static unsigned int ThreadCount(char option, const char * arg)
+{
+  char *	end;
+  unsigned long count = std::strtoul(arg, &end, 10);
+  if (*arg < '0' || *arg > '9' || *end != '\0' || count > MAX_THREADS) {
+    std::ostringstream message;
+    message << "Option -" << option << " takes a thread count from 0 to "
+	    << MAX_THREADS << ", not '" << arg << "'";
+    throw Exception(message.str());
+  }
+  return count;
+}
+
+// Parse the size in megabytes given to option, which must be a whole
+// number, and return it in bytes.
+static unsigned long long MegabyteCount(char option, const char * arg)
+{
+  char *	     end;
+  errno = 0;
+  unsigned long long count = std::strtoull(arg, &end, 10);
+  if (*arg < '0' || *arg > '9' || *end != '\0' || errno == ERANGE ||
+      count > ULLONG_MAX / (1024 * 1024)) {
+    std::ostringstream message;
+    message << "Option -" << option << " takes a size in megabytes, not '"
+	    << arg << "'";
+    throw Exception(message.str());
+  }
+  return count * 1024 * 1024;
+}
+
 int main(int argc, char *args[])
 {
   try {
@@ -25,6 +64,7 @@ int main(int argc, char *args[])
 
   Manager    atticManager(messageLog);
   DataPool * pool = atticManager.CreatePool();
+  bool	     checksumsAsked = false;
 
   for (int i = 1; i < argc; i++) {
     if (args[i][0] != '-') {
@@ -33,6 +73,10 @@ int main(int argc, char *args[])
     }
 
     switch (args[i][1]) {
+    case 'a':
+      optionTemplate.BatchMetadata = true;
+      break;
+
     case 'b':
       optionTemplate.PreserveChanges = true;
       break;
@@ -71,12 +115,66 @@ int main(int argc, char *args[])
 	pool->SetAncestor(new FlatDatabaseBroker(Path::ExpandPath(args[++i])));
       break;
 
+    case 'm':
+      optionTemplate.UseSnapshots = true;
+      break;
+
+    case 'k':
+      optionTemplate.CacheChecksums = true;
+      break;
+
+    case 'K':
+      if (i + 1 < argc) {
+	optionTemplate.ChecksumAlgorithm = checksum_t::Named(args[++i]);
+	if (optionTemplate.ChecksumAlgorithm == checksum_t::None)
+	  throw Exception(std::string("Unknown checksum algorithm '") +
+			  args[i] + "'");
+      }
+      break;
+
+    case 'T':
+      if (i + 1 < argc)
+	optionTemplate.TreeChecksumSize = MegabyteCount('T', args[++i]);
+      break;
+
     case 'n':
       pool->LoggingOnly = true;
       break;
 
+    case 'O':
+      optionTemplate.CopyByOverwrite = true;
+      break;
+
+    case 'W':
+      optionTemplate.CopyWholeFiles = true;
+      break;
+
+    case 's':
+      pool->Streaming = true;
+      break;
+
+    case 'P':
+      pool->Pipelined = true;
+      break;
+
     case 'c':
       optionTemplate.UseChecksums = true;
+      checksumsAsked = true;
+      break;
+
+    case 'j':
+      if (i + 1 < argc)
+	optionTemplate.ScanThreads = ThreadCount('j', args[++i]);
+      break;
+
+    case 'A':
+      if (i + 1 < argc)
+	optionTemplate.StatAheadThreads = ThreadCount('A', args[++i]);
+      break;
+
+    case 'H':
+      if (i + 1 < argc)
+	optionTemplate.ChecksumThreads = ThreadCount('H', args[++i]);
       break;
 
     case 'x':
@@ -115,10 +213,29 @@ Options accepted:\n\
     -c        Use checksums instead of just length & timestamps.\n\
               This is MUCH slower, but can optimize network traffic\n\
               by discovering when files have been moved\n\
+    -k        Remember checksums in DIR/.attic.csums, so that\n\
+              unchanged files need not be read again\n\
+    -K ALG    Checksum with ALG (xxh64, the default, or md5)\n\
+    -T MB     Hash files of MB megabytes or more in chunks, on\n\
+              every core at once (default 64; 0 never does)\n\
     -b        Perform a bi-directional update among all directories\n\
               specified on the command-line, using the given\n\
               database (-d) as the common ancestor\n\
     -G DIR    When updating, use DIR to keep generational data\n\
+    -s        Compare and update one directory at a time, so that\n\
+              transfers begin at once and memory use stays small\n\
+    -P        Begin updating while changes are still being found\n\
+    -O        Update files in place, rewriting only the blocks of a\n\
+              large file which differ, rather than installing a new\n\
+              copy of each\n\
+    -W        With -O, rewrite the whole of every file\n\
+    -j NUM    Read directories using NUM threads at once (not\n\
+              with -s)\n\
+    -A NUM    Read attributes ahead of the comparer using NUM threads\n\
+    -H NUM    Read files to be checksummed ahead of the comparer\n\
+              using NUM threads, and hash them on every core\n\
+    -a        Read file attributes in large batches, where the\n\
+              system supports it (Linux io_uring)\n\
     -V        Verify the database after an update is performed\n\
     -v        Be a bit more verbose\n\
     -D        Turn on debugging (be a lot more verbose)\n\
@@ -148,6 +265,23 @@ Update the database to reflect foo's recent changes:\n\
     return 1;
   }
 
+  // Snapshots hold only the kind, length and time of each entry, so
+  // -m means nothing else is compared; it cannot be had with -c.
+  if (optionTemplate.UseSnapshots) {
+    if (checksumsAsked)
+      throw Exception("Options -m and -c cannot be used together");
+    optionTemplate.UseChecksums	       = false;
+    optionTemplate.PreservePermissions = false;
+    optionTemplate.PreserveOwnership   = false;
+    optionTemplate.PreserveGroup       = false;
+  }
+
+  // A streaming pool reads no directories ahead; see DataPool.
+  if (pool->Streaming && optionTemplate.ScanThreads > 0) {
+    std::cerr << "Warning: -j is ignored with -s" << std::endl;
+    optionTemplate.ScanThreads = 0;
+  }
+
   for (std::vector<Location *>::iterator i = pool->Locations.begin();
        i != pool->Locations.end();
        i++) {
@@ -157,6 +291,10 @@ Update the database to reflect foo's recent changes:\n\
       (*i)->PreserveChanges = true;
   }
 
+  if (pool->Streaming && pool->OriginCount() > 1)
+    std::cerr << "Warning: -s is ignored when more than one location's "
+	      << "changes are kept" << std::endl;
+
   atticManager.Synchronize();
 
   messageLog.EndQueue();
@@ -2,6 +2,8 @@
 
 #include <assert.h>
 
+#include <boost/thread/once.hpp>
+
 void read_binary_string(char *& data, std::string& str)
 {
   read_binary_guard(data, 0x3001);
@@ -43,3 +45,29 @@ void write_binary_string(std::ostream& out, const std::string& str)
 
   write_binary_guard(out, 0x3002);
 }
+
+static unsigned int	crc32_table[256];
+static boost::once_flag crc32_once = BOOST_ONCE_INIT;
+
+static void init_crc32_table()
+{
+  for (unsigned int i = 0; i < 256; i++) {
+    unsigned int c = i;
+    for (int k = 0; k < 8; k++)
+      c = c & 1 ? 0xedb88320U ^ (c >> 1) : c >> 1;
+    crc32_table[i] = c;
+  }
+}
+
+unsigned int binary_crc32(unsigned int crc, const char * data, std::size_t len)
+{
+  // Journal records are checksummed on whichever thread applies the
+  // changes, so the table is filled by whoever gets here first.
+  boost::call_once(init_crc32_table, crc32_once);
+
+  crc = ~crc;
+  for (std::size_t i = 0; i < len; i++)
+    crc = (crc32_table[(crc ^ static_cast<unsigned char>(data[i])) & 0xff] ^
+	   (crc >> 8));
+  return ~crc;
+}
@@ -3,6 +3,8 @@
 
 #include <string>
 #include <iostream>
+#include <streambuf>
+#include <cstddef>
 
 template <typename T>
 inline void read_binary_number_nocheck(std::istream& in, T& num) {
@@ -216,4 +218,101 @@ void write_binary_long(std::ostream& out, T num)
 
 void write_binary_string(std::ostream& out, const std::string& str);
 
+// Variable-length integers, in LEB128 form: seven bits to a byte, the
+// least significant first, with the high bit set on every byte but
+// the last.  Signed values are zigzag-encoded first, so that small
+// negative numbers stay short too.
+
+inline unsigned long long read_binary_varint(char *& data) {
+  unsigned long long num = 0;
+  unsigned int	     shift = 0;
+  unsigned char	     byte;
+  do {
+    byte = *data++;
+    if (shift < 64)
+      num |= ((unsigned long long)(byte & 0x7f)) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+  return num;
+}
+
+// The same, but reading nothing at or beyond end.  False if the
+// number would run past it, or is longer than any 64-bit number.
+inline bool read_binary_varint(char *& data, const char * end,
+			       unsigned long long& num) {
+  num = 0;
+  for (unsigned int shift = 0; shift < 64 && data < end; shift += 7) {
+    unsigned char byte = *data++;
+    num |= ((unsigned long long)(byte & 0x7f)) << shift;
+    if (! (byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+inline long long binary_unzigzag(unsigned long long num) {
+  return (long long)(num >> 1) ^ -(long long)(num & 1);
+}
+
+inline long long read_binary_varint_signed(char *& data) {
+  return binary_unzigzag(read_binary_varint(data));
+}
+
+inline void write_binary_varint(std::ostream& out, unsigned long long num) {
+  char		buf[10];
+  std::size_t	len = 0;
+  do {
+    unsigned char byte = num & 0x7f;
+    num >>= 7;
+    if (num)
+      byte |= 0x80;
+    buf[len++] = byte;
+  } while (num);
+  out.write(buf, len);
+}
+
+inline void write_binary_varint_signed(std::ostream& out, long long num) {
+  write_binary_varint(out, ((unsigned long long)num << 1) ^
+		      (unsigned long long)(num >> 63));
+}
+
+// The CRC-32 used by zlib and PNG.  Pass the result of one call as
+// crc to the next to checksum data in pieces; start with zero.
+unsigned int binary_crc32(unsigned int crc, const char * data,
+			  std::size_t len);
+
+// A stream buffer which hands everything written to it on to another,
+// keeping count of the bytes written and their CRC-32 as it goes.
+
+class crc32_streambuf : public std::streambuf
+{
+  std::streambuf * dest;
+
+public:
+  unsigned int	     crc;
+  unsigned long long count;
+
+  explicit crc32_streambuf(std::streambuf * _dest)
+    : dest(_dest), crc(0), count(0) {}
+
+protected:
+  virtual std::streamsize xsputn(const char * s, std::streamsize n) {
+    std::streamsize done = dest->sputn(s, n);
+    if (done > 0) {
+      crc    = binary_crc32(crc, s, done);
+      count += done;
+    }
+    return done;
+  }
+  virtual int_type overflow(int_type c) {
+    if (traits_type::eq_int_type(c, traits_type::eof()))
+      return traits_type::not_eof(c);
+    char ch = traits_type::to_char_type(c);
+    return xsputn(&ch, 1) == 1 ? c : traits_type::eof();
+  }
+  virtual int sync() {
+    return dest->pubsync();
+  }
+};
+
 #endif // _BINARY_H
@@ -0,0 +1,164 @@
+/*
+  XXH64; see xxhash.h.
+*/
+
+#include "xxhash.h"
+#include <string.h>
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define ROTATE_LEFT(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+/* Words are read in little-endian order, whatever the CPU's. */
+static xxh64_word_t
+read64(const unsigned char *p)
+{
+    return ((xxh64_word_t)p[0]	     | ((xxh64_word_t)p[1] << 8) |
+	    ((xxh64_word_t)p[2] << 16) | ((xxh64_word_t)p[3] << 24) |
+	    ((xxh64_word_t)p[4] << 32) | ((xxh64_word_t)p[5] << 40) |
+	    ((xxh64_word_t)p[6] << 48) | ((xxh64_word_t)p[7] << 56));
+}
+
+static xxh64_word_t
+read32(const unsigned char *p)
+{
+    return ((xxh64_word_t)p[0]	     | ((xxh64_word_t)p[1] << 8) |
+	    ((xxh64_word_t)p[2] << 16) | ((xxh64_word_t)p[3] << 24));
+}
+
+static xxh64_word_t
+xxh64_round(xxh64_word_t acc, xxh64_word_t input)
+{
+    acc += input * PRIME64_2;
+    acc = ROTATE_LEFT(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static xxh64_word_t
+xxh64_merge(xxh64_word_t acc, xxh64_word_t lane)
+{
+    acc ^= xxh64_round(0, lane);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+/* Consume whole 32-byte stripes, returning how many bytes were used. */
+static size_t
+xxh64_stripes(xxh64_state_t *pxs, const unsigned char *p, size_t nbytes)
+{
+    xxh64_word_t
+	a = pxs->acc[0], b = pxs->acc[1],
+	c = pxs->acc[2], d = pxs->acc[3];
+    size_t used = 0;
+
+    for (; used + 32 <= nbytes; used += 32, p += 32) {
+	a = xxh64_round(a, read64(p));
+	b = xxh64_round(b, read64(p + 8));
+	c = xxh64_round(c, read64(p + 16));
+	d = xxh64_round(d, read64(p + 24));
+    }
+
+    pxs->acc[0] = a;
+    pxs->acc[1] = b;
+    pxs->acc[2] = c;
+    pxs->acc[3] = d;
+    return used;
+}
+
+void
+xxh64_init(xxh64_state_t *pxs, xxh64_word_t seed)
+{
+    pxs->total = 0;
+    pxs->acc[0] = seed + PRIME64_1 + PRIME64_2;
+    pxs->acc[1] = seed + PRIME64_2;
+    pxs->acc[2] = seed;
+    pxs->acc[3] = seed - PRIME64_1;
+    pxs->buffered = 0;
+    pxs->seed = seed;
+}
+
+void
+xxh64_append(xxh64_state_t *pxs, const void *data, size_t nbytes)
+{
+    const unsigned char *p = (const unsigned char *)data;
+
+    if (nbytes == 0)
+	return;
+    pxs->total += nbytes;
+
+    /* Complete a stripe left over from last time. */
+    if (pxs->buffered) {
+	size_t copy = 32 - pxs->buffered;
+
+	if (copy > nbytes)
+	    copy = nbytes;
+	memcpy(pxs->buf + pxs->buffered, p, copy);
+	pxs->buffered += (unsigned int)copy;
+	p += copy;
+	nbytes -= copy;
+	if (pxs->buffered < 32)
+	    return;
+	xxh64_stripes(pxs, pxs->buf, 32);
+	pxs->buffered = 0;
+    }
+
+    /* Process whole stripes directly from the data. */
+    {
+	size_t used = xxh64_stripes(pxs, p, nbytes);
+
+	p += used;
+	nbytes -= used;
+    }
+
+    /* Save any remainder. */
+    if (nbytes) {
+	memcpy(pxs->buf, p, nbytes);
+	pxs->buffered = (unsigned int)nbytes;
+    }
+}
+
+xxh64_word_t
+xxh64_digest(const xxh64_state_t *pxs)
+{
+    const unsigned char *p = pxs->buf;
+    unsigned int left = pxs->buffered;
+    xxh64_word_t h;
+
+    if (pxs->total >= 32) {
+	h = (ROTATE_LEFT(pxs->acc[0], 1) + ROTATE_LEFT(pxs->acc[1], 7) +
+	     ROTATE_LEFT(pxs->acc[2], 12) + ROTATE_LEFT(pxs->acc[3], 18));
+	h = xxh64_merge(h, pxs->acc[0]);
+	h = xxh64_merge(h, pxs->acc[1]);
+	h = xxh64_merge(h, pxs->acc[2]);
+	h = xxh64_merge(h, pxs->acc[3]);
+    } else {
+	h = pxs->seed + PRIME64_5;
+    }
+    h += pxs->total;
+
+    for (; left >= 8; left -= 8, p += 8) {
+	h ^= xxh64_round(0, read64(p));
+	h = ROTATE_LEFT(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (left >= 4) {
+	h ^= read32(p) * PRIME64_1;
+	h = ROTATE_LEFT(h, 23) * PRIME64_2 + PRIME64_3;
+	left -= 4;
+	p += 4;
+    }
+    for (; left > 0; left--, p++) {
+	h ^= (xxh64_word_t)*p * PRIME64_5;
+	h = ROTATE_LEFT(h, 11) * PRIME64_1;
+    }
+
+    /* Avalanche. */
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
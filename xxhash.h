@@ -0,0 +1,47 @@
+/*
+  XXH64, the 64-bit member of the xxHash family of non-cryptographic
+  hash functions designed by Yann Collet, implemented from the
+  published specification:
+
+	https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+
+  Only the streaming interface needed by Attic is provided.  The
+  digest of a message is the same whether it is appended all at once
+  or in pieces, and matches the reference implementation's XXH64()
+  with the same seed.
+*/
+
+#ifndef xxhash_INCLUDED
+#  define xxhash_INCLUDED
+
+#include <stddef.h>
+
+typedef unsigned long long xxh64_word_t; /* 64-bit word */
+
+typedef struct xxh64_state_s {
+    xxh64_word_t total;		/* message length in bytes */
+    xxh64_word_t acc[4];	/* the four lanes of accumulators */
+    unsigned char buf[32];	/* accumulate stripe */
+    unsigned int buffered;	/* bytes waiting in buf */
+    xxh64_word_t seed;
+} xxh64_state_t;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Initialize the algorithm. */
+void xxh64_init(xxh64_state_t *pxs, xxh64_word_t seed);
+
+/* Append a string to the message. */
+void xxh64_append(xxh64_state_t *pxs, const void *data, size_t nbytes);
+
+/* Return the digest of the message so far. */
+xxh64_word_t xxh64_digest(const xxh64_state_t *pxs);
+
+#ifdef __cplusplus
+}  /* end extern "C" */
+#endif
+
+#endif /* xxhash_INCLUDED */